@@ -22,7 +22,9 @@ LOCAL_SRC_FILES := \
     mounts.c \
     extendedcommands.c \
     nandroid.c \
+    nandroid_chunks.c \
     nandroid_md5.c \
+    nandroid_tar.c \
     reboot.c \
     ../../system/core/toolbox/dynarray.c \
     ../../system/core/toolbox/newfs_msdos.c \
@@ -31,6 +33,8 @@ LOCAL_SRC_FILES := \
     prop.c \
     adb_install.c \
     verifier.c \
+    update_binary_probe.c \
+    update_progress.c \
     ../../system/vold/vdc.c \
     propsrvc/legacy_property_service.c
 
@@ -133,6 +137,9 @@ LOCAL_STATIC_LIBRARIES += libmake_f2fs libfsck_f2fs libfibmap_f2fs
 endif
 
 LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt
+ifeq ($(BOARD_MINZIP_INFLATE),libdeflate)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
 
 LOCAL_STATIC_LIBRARIES += libminizip libminadbd libedify libbusybox libmkyaffs2image libunyaffs liberase_image libdump_image libflash_image
 LOCAL_LDFLAGS += -Wl,--no-fatal-warnings
@@ -181,6 +188,17 @@ $(RECOVERY_BUSYBOX_SYMLINKS): $(LOCAL_INSTALLED_MODULE)
 
 ALL_DEFAULT_INSTALLED_MODULES += $(RECOVERY_BUSYBOX_SYMLINKS) 
 
+# The images of res/images, decoded at build time; see minui/res_bundle.h
+RECOVERY_RES_BUNDLE := $(TARGET_RECOVERY_ROOT_OUT)/res/images.bundle
+RECOVERY_RES_BUNDLE_TOOL := $(HOST_OUT_EXECUTABLES)/minui_res_bundle$(HOST_EXECUTABLE_SUFFIX)
+$(RECOVERY_RES_BUNDLE): RECOVERY_RES_IMAGES := $(commands_recovery_local_path)/res/images
+$(RECOVERY_RES_BUNDLE): $(RECOVERY_RES_BUNDLE_TOOL) $(wildcard $(commands_recovery_local_path)/res/images/*.png)
+	@echo "Image bundle: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(RECOVERY_RES_BUNDLE_TOOL) $(RECOVERY_RES_IMAGES) $@
+
+ALL_DEFAULT_INSTALLED_MODULES += $(RECOVERY_RES_BUNDLE)
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := killrecovery.sh
 LOCAL_MODULE_TAGS := optional
@@ -205,6 +223,52 @@ LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := verifier_bench.c verifier.c
+
+LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include
+
+LOCAL_MODULE := verifier_bench
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := update_progress_bench.c update_progress.c updater/progress.c
+
+LOCAL_MODULE := update_progress_bench
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libselinux libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := nandroid_tar_bench.c nandroid_tar.c
+
+LOCAL_C_INCLUDES += external/openssl/include external/zlib
+
+LOCAL_MODULE := nandroid_tar_bench
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libz libcrypto_static libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
 include $(commands_recovery_local_path)/bmlutils/Android.mk
 include $(commands_recovery_local_path)/dedupe/Android.mk
 include $(commands_recovery_local_path)/flashutils/Android.mk
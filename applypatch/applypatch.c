@@ -16,11 +16,14 @@
 
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -30,7 +33,8 @@
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -44,21 +48,19 @@ static int GenerateTarget(FileContents* source_file,
 
 static int mtd_partitions_scanned = 0;
 
-// Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
-// the retouched entries back to their original value (such that SHA-1 checks
-// don't fail due to randomization); store the file contents and associated
-// metadata in *file.
-//
-// Return 0 on success.
-int LoadFileContents(const char* filename, FileContents* file,
-                     int retouch_flag) {
+// LoadFileContents(), except that when 'map' is set EMMC partitions are
+// mmap()ed rather than copied into memory.  Such contents must be
+// released with FreeFileContents().
+static int LoadContents(const char* filename, FileContents* file,
+                        int retouch_flag, int map) {
     file->data = NULL;
+    file->map_size = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, map);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -105,6 +107,43 @@ int LoadFileContents(const char* filename, FileContents* file,
     return 0;
 }
 
+// Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
+// the retouched entries back to their original value (such that SHA-1 checks
+// don't fail due to randomization); store the file contents and associated
+// metadata in *file.
+//
+// Return 0 on success.
+int LoadFileContents(const char* filename, FileContents* file,
+                     int retouch_flag) {
+    return LoadContents(filename, file, retouch_flag, 0);
+}
+
+void FreeFileContents(FileContents* file) {
+    if (file->map_size > 0) {
+        munmap(file->data, file->map_size);
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+    file->map_size = 0;
+}
+
+// Hash 'len' bytes of a mapped partition a window at a time, dropping
+// each window from our page tables once it has been hashed so that
+// checking a large partition doesn't leave all of it resident.
+static void HashMapped(SHA_CTX* ctx, unsigned char* data, size_t len) {
+    const size_t window = 1 << 20;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    while (len > 0) {
+        size_t n = len < window ? len : window;
+        SHA_update(ctx, data, n);
+        uintptr_t start = (uintptr_t)data & ~(page - 1);
+        madvise((void*)start, (uintptr_t)data + n - start, MADV_DONTNEED);
+        data += n;
+        len -= n;
+    }
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -128,6 +167,10 @@ static int compare_size_indices(const void* a, const void* b) {
 // sha1 hash will be loaded.  It is acceptable for a size value to be
 // repeated with different sha1s.  Will return 0 on success.
 //
+// With 'map' set, an EMMC partition is mmap()ed and hashed in place
+// instead of being read into a buffer as large as the biggest
+// candidate, so memory use doesn't grow with the partition size.
+//
 // This complexity is needed because if an OTA installation is
 // interrupted, the partition might contain either the source or the
 // target data, which might be of different lengths.  We need to know
@@ -137,7 +180,8 @@ static int compare_size_indices(const void* a, const void* b) {
 // to find one of those hashes.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -189,6 +233,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
 
     MtdReadContext* ctx = NULL;
     FILE* dev = NULL;
+    size_t map_size = 0;
 
     switch (type) {
         case MTD:
@@ -213,6 +258,33 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             break;
 
         case EMMC:
+            if (map) {
+                int fd = open(partition, O_RDONLY);
+                if (fd < 0) {
+                    printf("failed to open emmc partition \"%s\": %s\n",
+                           partition, strerror(errno));
+                    return -1;
+                }
+                // never map past the end of the device; a candidate
+                // size beyond it fails below as a short read.
+                off_t end = lseek(fd, 0, SEEK_END);
+                map_size = size[index[pairs-1]];
+                if (end >= 0 && (size_t)end < map_size) {
+                    map_size = end;
+                }
+                file->data = map_size == 0 ? MAP_FAILED :
+                    mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if (file->data == MAP_FAILED) {
+                    printf("failed to map emmc partition \"%s\": %s\n",
+                           partition, strerror(errno));
+                    file->data = NULL;
+                    return -1;
+                }
+                file->map_size = map_size;
+                madvise(file->data, map_size, MADV_SEQUENTIAL);
+                break;
+            }
             dev = fopen(partition, "rb");
             if (dev == NULL) {
                 printf("failed to open emmc partition \"%s\": %s\n",
@@ -226,7 +298,9 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
     // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
+    if (file->map_size == 0) {
+        file->data = malloc(size[index[pairs-1]]);
+    }
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -243,17 +317,25 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    if (map_size > 0) {
+                        read = map_size - file->size;
+                        if (read > next) read = next;
+                    } else {
+                        read = fread(p, 1, next, dev);
+                    }
                     break;
             }
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
+                FreeFileContents(file);
                 return -1;
             }
-            SHA_update(&sha_ctx, p, read);
+            if (map_size > 0) {
+                HashMapped(&sha_ctx, (unsigned char*)p, read);
+            } else {
+                SHA_update(&sha_ctx, p, read);
+            }
             file->size += read;
         }
 
@@ -266,8 +348,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
+            FreeFileContents(file);
             return -1;
         }
 
@@ -288,7 +369,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
             break;
 
         case EMMC:
-            fclose(dev);
+            if (dev != NULL) fclose(dev);
             break;
     }
 
@@ -298,8 +379,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         // finding a match.
         printf("contents of partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
+        FreeFileContents(file);
         return -1;
     }
 
@@ -355,6 +435,269 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
+// EMMC partitions are written with O_DIRECT in large aligned blocks and
+// read back (also with O_DIRECT, so the page cache never has to be
+// dropped) by a verifier thread trailing the writer.  Blocks that don't
+// read back correctly are the only ones rewritten on the next attempt.
+#define EMMC_BLOCK_SIZE (1 << 20)
+#define EMMC_ALIGN 4096
+#define EMMC_SYNC_INTERVAL (8 << 20)
+#define EMMC_ATTEMPTS 10
+
+typedef struct {
+    const char* partition;
+    const unsigned char* data;
+    size_t len;
+    int fd;             // O_DIRECT if direct is set
+    int tail_fd;        // buffered, for the unaligned end of the data
+    int direct;
+    unsigned char* bad; // per EMMC_BLOCK_SIZE block: failed verification
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t synced;      // bytes written and flushed, safe to read back
+    int done;
+} EmmcWriter;
+
+static int EmmcTransfer(int fd, unsigned char* buf, size_t len, off_t offset,
+                        int write_mode) {
+    while (len > 0) {
+        ssize_t n = write_mode ? pwrite(fd, buf, len, offset) :
+                                 pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Write or read 'len' bytes at 'offset' through 'buf', which is
+// EMMC_ALIGN aligned.  Only the unaligned tail of the data goes through
+// the page cache, so it is flushed and dropped for this device alone.
+static int EmmcBlockIO(EmmcWriter* w, unsigned char* buf, size_t len,
+                       off_t offset, int write_mode) {
+    size_t aligned = w->direct ? len & ~(EMMC_ALIGN - 1) : len;
+    if (aligned > 0 &&
+        EmmcTransfer(w->fd, buf, aligned, offset, write_mode) != 0) {
+        return -1;
+    }
+    if (aligned < len) {
+        if (!write_mode) {
+            posix_fadvise(w->tail_fd, offset + aligned, len - aligned,
+                          POSIX_FADV_DONTNEED);
+        }
+        if (EmmcTransfer(w->tail_fd, buf + aligned, len - aligned,
+                         offset + aligned, write_mode) != 0) {
+            return -1;
+        }
+        if (write_mode) {
+            fdatasync(w->tail_fd);
+            posix_fadvise(w->tail_fd, offset + aligned, len - aligned,
+                          POSIX_FADV_DONTNEED);
+        }
+    }
+    return 0;
+}
+
+static int EmmcSync(EmmcWriter* w, size_t start, size_t end) {
+    if (fdatasync(w->fd) != 0) return -1;
+    if (!w->direct) {
+        // make the read-back come from the device rather than our own
+        // dirty pages
+        posix_fadvise(w->fd, start, end - start, POSIX_FADV_DONTNEED);
+    }
+    return 0;
+}
+
+static int EmmcVerifyBlock(EmmcWriter* w, unsigned char* buf, size_t p) {
+    size_t n = w->len - p < EMMC_BLOCK_SIZE ? w->len - p : EMMC_BLOCK_SIZE;
+    if (EmmcBlockIO(w, buf, n, p, 0) != 0) {
+        printf("verify read error %s at %ld: %s\n",
+               w->partition, (long)p, strerror(errno));
+        return -1;
+    }
+    return memcmp(buf, w->data + p, n) != 0;
+}
+
+static void* EmmcVerifyThread(void* cookie) {
+    EmmcWriter* w = (EmmcWriter*)cookie;
+    unsigned char* buf = NULL;
+    size_t p = 0;
+
+    if (posix_memalign((void**)&buf, EMMC_ALIGN, EMMC_BLOCK_SIZE) != 0) {
+        buf = NULL;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (p < w->len) {
+        while (p >= w->synced && !w->done) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (p >= w->synced) break;
+        pthread_mutex_unlock(&w->lock);
+
+        // a read error marks the block bad too; it is rewritten and
+        // read again on the next attempt
+        if (buf == NULL || EmmcVerifyBlock(w, buf, p) != 0) {
+            w->bad[p / EMMC_BLOCK_SIZE] = 1;
+        }
+        p += EMMC_BLOCK_SIZE;
+
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    // anything the writer never got to is unverified
+    for (; p < w->len; p += EMMC_BLOCK_SIZE) {
+        w->bad[p / EMMC_BLOCK_SIZE] = 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int EmmcWriteBlock(EmmcWriter* w, unsigned char* buf, size_t p) {
+    size_t n = w->len - p < EMMC_BLOCK_SIZE ? w->len - p : EMMC_BLOCK_SIZE;
+    memcpy(buf, w->data + p, n);
+    if (EmmcBlockIO(w, buf, n, p, 1) != 0) {
+        printf("failed write writing to %s (%s)\n",
+               w->partition, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int WriteToEmmc(const unsigned char* data, size_t len,
+                       const char* partition) {
+    EmmcWriter w;
+    unsigned char* buf = NULL;
+    size_t blocks = (len + EMMC_BLOCK_SIZE - 1) / EMMC_BLOCK_SIZE;
+    size_t p, i;
+    int attempt, result = -1;
+    struct timeval start, end;
+
+    gettimeofday(&start, NULL);
+    memset(&w, 0, sizeof(w));
+    w.partition = partition;
+    w.data = data;
+    w.len = len;
+    w.direct = 1;
+    w.fd = open(partition, O_RDWR | O_DIRECT);
+    if (w.fd < 0) {
+        // some devices can't do direct I/O; writes then go through the
+        // page cache, which is flushed and dropped per range
+        w.direct = 0;
+        w.fd = open(partition, O_RDWR);
+    }
+    w.tail_fd = open(partition, O_RDWR);
+    if (w.fd < 0 || w.tail_fd < 0) {
+        printf("failed to open %s: %s\n", partition, strerror(errno));
+        goto done;
+    }
+    w.bad = calloc(blocks ? blocks : 1, 1);
+    if (w.bad == NULL ||
+        posix_memalign((void**)&buf, EMMC_ALIGN, EMMC_BLOCK_SIZE) != 0) {
+        buf = NULL;
+        printf("failed to allocate write buffers for %s\n", partition);
+        goto done;
+    }
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+
+    // first attempt: write everything while the verifier reads back
+    // whatever has already been flushed
+    printf("raw write %s (%s I/O) %ld bytes\n", partition,
+           w.direct ? "direct" : "buffered", (long)len);
+    pthread_t verifier;
+    int threaded = pthread_create(&verifier, NULL, EmmcVerifyThread, &w) == 0;
+    size_t last_sync = 0;
+    int write_error = 0;
+    for (p = 0; p < len && !write_error; p += EMMC_BLOCK_SIZE) {
+        if (EmmcWriteBlock(&w, buf, p) != 0) {
+            write_error = 1;
+            break;
+        }
+        size_t written = p + EMMC_BLOCK_SIZE < len ? p + EMMC_BLOCK_SIZE : len;
+        if (written - last_sync >= EMMC_SYNC_INTERVAL || written == len) {
+            if (EmmcSync(&w, last_sync, written) != 0) {
+                printf("failed to sync %s (%s)\n", partition, strerror(errno));
+                write_error = 1;
+                break;
+            }
+            last_sync = written;
+            pthread_mutex_lock(&w.lock);
+            w.synced = written;
+            pthread_cond_broadcast(&w.cond);
+            pthread_mutex_unlock(&w.lock);
+        }
+    }
+    pthread_mutex_lock(&w.lock);
+    w.done = 1;
+    pthread_cond_broadcast(&w.cond);
+    pthread_mutex_unlock(&w.lock);
+    if (threaded) {
+        pthread_join(verifier, NULL);
+    } else {
+        EmmcVerifyThread(&w);
+    }
+    if (write_error) goto destroy;
+
+    for (attempt = 1; attempt <= EMMC_ATTEMPTS; ++attempt) {
+        size_t bad = 0;
+        for (i = 0; i < blocks; ++i) bad += w.bad[i];
+        if (bad == 0) {
+            printf("verification read succeeded (attempt %d)\n", attempt);
+            result = 0;
+            break;
+        }
+        if (attempt == EMMC_ATTEMPTS) break;
+
+        // rewrite and re-check only the blocks that didn't match
+        printf("verification failed in %ld of %ld blocks; rewriting them "
+               "(attempt %d)\n", (long)bad, (long)blocks, attempt + 1);
+        for (i = 0; i < blocks; ++i) {
+            if (!w.bad[i]) continue;
+            p = i * EMMC_BLOCK_SIZE;
+            size_t n = len - p < EMMC_BLOCK_SIZE ? len - p : EMMC_BLOCK_SIZE;
+            printf("  rewriting %ld bytes at %ld\n", (long)n, (long)p);
+            if (EmmcWriteBlock(&w, buf, p) != 0 ||
+                EmmcSync(&w, p, p + n) != 0) {
+                goto destroy;
+            }
+            w.bad[i] = EmmcVerifyBlock(&w, buf, p) != 0;
+        }
+    }
+    if (result != 0) {
+        printf("failed to verify after all attempts\n");
+    }
+
+destroy:
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+done:
+    free(buf);
+    free(w.bad);
+    if (w.tail_fd >= 0) close(w.tail_fd);
+    if (w.fd >= 0) {
+        if (result == 0 && fsync(w.fd) != 0) {
+            printf("error syncing %s (%s)\n", partition, strerror(errno));
+            result = -1;
+        }
+        if (close(w.fd) != 0 && result == 0) {
+            printf("error closing %s (%s)\n", partition, strerror(errno));
+            result = -1;
+        }
+    }
+    gettimeofday(&end, NULL);
+    if (result == 0) {
+        printf("wrote %ld bytes to %s in %ld ms\n", (long)len, partition,
+               (long)((end.tv_sec - start.tv_sec) * 1000 +
+                      (end.tv_usec - start.tv_usec) / 1000));
+    }
+    return result;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
 // success.
@@ -421,111 +764,10 @@ int WriteToPartition(unsigned char* data, size_t len,
             break;
 
         case EMMC:
-        {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
-            int attempt;
-
-            for (attempt = 0; attempt < 10; ++attempt) {
-                size_t next_sync = start + (1<<20);
-                printf("raw write %s attempt %d start at %d\n", partition, attempt+1, start);
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 4096) to_write = 4096;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                    if (start >= next_sync) {
-                        fsync(fd);
-                        next_sync = start + (1<<20);
-                    }
-                }
-                fsync(fd);
-
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
-                        break;
-                    }
-                }
-
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
-                    break;
-                }
-
-                sleep(2);
-            }
-
-            if (!success) {
-                printf("failed to verify after all attempts\n");
+            if (WriteToEmmc(data, len, partition) != 0) {
                 return -1;
             }
-
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
-            }
-            // hack: sync and sleep after closing in hopes of getting
-            // the data actually onto flash.
-            printf("sleeping after close\n");
-            sync();
-            sleep(5);
             break;
-        }
     }
 
     free(copy);
@@ -586,12 +828,13 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.map_size = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    int filestate = LoadFileContents(filename, &file, RETOUCH_DO_MASK);
+    int filestate = LoadContents(filename, &file, RETOUCH_DO_MASK, 1);
     if (filestate == -ENOENT) {
         return -ENOENT;
     }
@@ -602,8 +845,7 @@ int applypatch_check(const char* filename,
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -611,19 +853,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (LoadContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK, 1) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -734,19 +976,21 @@ int applypatch(const char* source_filename,
     FileContents copy_file;
     FileContents source_file;
     copy_file.data = NULL;
+    copy_file.map_size = 0;
     source_file.data = NULL;
+    source_file.map_size = 0;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
-                         RETOUCH_DO_MASK) == 0) {
+    if (LoadContents(target_filename, &source_file,
+                     RETOUCH_DO_MASK, 1) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -756,10 +1000,9 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
-                         RETOUCH_DO_MASK);
+        FreeFileContents(&source_file);
+        LoadContents(source_filename, &source_file,
+                     RETOUCH_DO_MASK, 1);
     }
 
     if (source_file.data != NULL) {
@@ -771,12 +1014,11 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
-                             RETOUCH_DO_MASK) < 0) {
+        if (LoadContents(CACHE_TEMP_SOURCE, &copy_file,
+                         RETOUCH_DO_MASK, 1) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
@@ -791,7 +1033,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -800,8 +1042,8 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
@@ -822,6 +1064,8 @@ static int GenerateTarget(FileContents* source_file,
     FileContents* source_to_use;
     char* outname;
     int made_copy = 0;
+    int partition_target = strncmp(target_filename, "MTD:", 4) == 0 ||
+                           strncmp(target_filename, "EMMC:", 5) == 0;
 
     // assume that target_filename (eg "/system/app/Foo.apk") is located
     // on the same filesystem as its top-level directory ("/system").
@@ -840,8 +1084,7 @@ static int GenerateTarget(FileContents* source_file,
         // Is there enough room in the target filesystem to hold the patched
         // file?
 
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
+        if (partition_target) {
             // If the target is a partition, we're actually going to
             // write the output to /tmp and then copy it to the
             // partition.  statfs() always returns 0 blocks free for
@@ -925,9 +1168,26 @@ static int GenerateTarget(FileContents* source_file,
         void* token = NULL;
         output = -1;
         outname = NULL;
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0) {
-            // We store the decoded output in memory.
+        msi.buffer = NULL;
+        size_t cache_free = 0;
+        if (partition_target) {
+            // Only use space /cache already has free: making room would
+            // delete files applypatch didn't create.
+            unlink(CACHE_TEMP_TARGET);
+            cache_free = FreeSpaceForFile("/cache");
+            if (cache_free == (size_t)-1) cache_free = 0;
+        }
+        if (partition_target &&
+            cache_free > target_size + (256 << 10) &&
+            (output = open(CACHE_TEMP_TARGET, O_WRONLY | O_CREAT | O_TRUNC,
+                           S_IRUSR | S_IWUSR)) >= 0) {
+            // Stream the decoded output to /cache, so that even a large
+            // partition image never has to be held in memory.  It is
+            // mapped back in and copied once its sha1 has been checked.
+            sink = FileSink;
+            token = &output;
+        } else if (partition_target) {
+            // No room on /cache; store the decoded output in memory.
             msi.buffer = malloc(target_size);
             if (msi.buffer == NULL) {
                 printf("failed to alloc %ld bytes for output\n",
@@ -982,6 +1242,7 @@ static int GenerateTarget(FileContents* source_file,
         if (result != 0) {
             if (retry == 0) {
                 printf("applying patch failed\n");
+                if (partition_target) unlink(CACHE_TEMP_TARGET);
                 return result != 0;
             } else {
                 printf("applying patch failed; retrying\n");
@@ -998,16 +1259,58 @@ static int GenerateTarget(FileContents* source_file,
     const uint8_t* current_target_sha1 = SHA_final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
+        if (partition_target) unlink(CACHE_TEMP_TARGET);
         return 1;
     }
 
-    if (output < 0) {
-        // Copy the temp file to the partition.
+    if (partition_target && msi.buffer != NULL) {
+        // Copy the decoded output to the partition.
         if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
             printf("write of patched data to %s failed\n", target_filename);
             return 1;
         }
         free(msi.buffer);
+    } else if (partition_target) {
+        // The source isn't read again; let its pages go before mapping
+        // the output.
+        if (source_to_use->map_size > 0) {
+            madvise(source_to_use->data, source_to_use->map_size, MADV_DONTNEED);
+        }
+
+        // Copy the temp file to the partition.
+        int fd = open(CACHE_TEMP_TARGET, O_RDONLY);
+        struct stat st;
+        unsigned char* data = MAP_FAILED;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (fd >= 0) close(fd);
+        if (data == MAP_FAILED) {
+            printf("failed to map %s: %s\n", CACHE_TEMP_TARGET, strerror(errno));
+            return 1;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+        // What was hashed went to /cache through the page cache; check
+        // that it reads back the same before it goes anywhere near the
+        // partition.
+        uint8_t written_sha1[SHA_DIGEST_SIZE];
+        SHA_hash(data, st.st_size, written_sha1);
+        if ((size_t)st.st_size != target_size ||
+            memcmp(written_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
+            printf("%s does not have the expected sha1\n", CACHE_TEMP_TARGET);
+            munmap(data, st.st_size);
+            unlink(CACHE_TEMP_TARGET);
+            return 1;
+        }
+
+        int result = WriteToPartition(data, st.st_size, target_filename);
+        munmap(data, st.st_size);
+        unlink(CACHE_TEMP_TARGET);
+        if (result != 0) {
+            printf("write of patched data to %s failed\n", target_filename);
+            return 1;
+        }
     } else {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
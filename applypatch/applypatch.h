@@ -32,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  size_t map_size;  // nonzero if data is mmap()ed rather than malloc()ed
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -41,6 +42,10 @@ typedef struct _FileContents {
 // and use it as the source instead.
 #define CACHE_TEMP_SOURCE "/cache/saved.file"
 
+// Patched data for a partition target is written here (when /cache has
+// room for it) and checked before it is copied to the partition.
+#define CACHE_TEMP_TARGET "/cache/saved.target"
+
 typedef ssize_t (*SinkFn)(unsigned char*, ssize_t, void*);
 
 // applypatch.c
@@ -40,6 +40,8 @@ void ui_clear_key_queue();
 // The screen is small, and users may need to report these messages to support,
 // so keep the output short and not too cryptic.
 void ui_print(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+// Like ui_print(), for text of any length; the screen is redrawn once.
+void ui_print_str(const char *str);
 void ui_printlogtail(int nb_lines);
 
 void ui_delete_line();
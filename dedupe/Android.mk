@@ -2,18 +2,27 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := dedupe.c driver.c \
+LOCAL_SRC_FILES := dedupe.c manifest.c driver.c \
     ../../../external/libselinux/src/lsetfilecon.c \
     ../../../external/libselinux/src/lgetfilecon.c
 
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE := dedupe
 LOCAL_STATIC_LIBRARIES := libcrypto_static libselinux
+LOCAL_LDLIBS += -lpthread
 LOCAL_C_INCLUDES += external/openssl/include external/libselinux/include
 include $(BUILD_HOST_EXECUTABLE)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := dedupe.c
+LOCAL_SRC_FILES := manifest_bench.c manifest.c
+LOCAL_MODULE := dedupe_manifest_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libcrypto_static
+LOCAL_C_INCLUDES += external/openssl/include
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := dedupe.c manifest.c
 LOCAL_STATIC_LIBRARIES := libcrypto_static libcutils libc libselinux
 LOCAL_MODULE := libdedupe
 LOCAL_MODULE_TAGS := eng
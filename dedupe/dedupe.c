@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <dirent.h>
+#include <libgen.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,15 +21,105 @@
 #include <unistd.h>
 #include <paths.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 
 #include <selinux/selinux.h>
 
-#define DEDUPE_VERSION 2
-#define ARRAY_CAPACITY 1000
+#include "manifest.h"
+
+
+// Files up to this size are read once into memory, then hashed and written
+// from there. Larger files are hashed first and only copied if the blob is
+// missing, so unchanged large files are never rewritten.
+#define INGEST_BUFFER_SIZE (1024 * 1024)
+#define INGEST_QUEUE_SIZE 256
+#define INGEST_MAX_WORKERS 8
+#define RESTORE_BUFFER_SIZE (1024 * 1024)
+// content defined chunks, only for files bigger than the ingest buffer
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_AVG_MASK ((64 * 1024) - 1)
+#define CHUNK_MAX_SIZE (256 * 1024)
+#define RESTORE_QUEUE_SIZE 256
+#define HASH_CACHE_BUCKETS 65536
+#define DIGEST_SET_MIN_CAPACITY 4096
+#define GC_SHARDS 4096
+
+static int write_fully(int fd, const char *buf, int len) {
+    while (len > 0) {
+        int bytes_written = write(fd, buf, len);
+        if (bytes_written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// Errors that mean this way of copying is not available for these files.
+static int copy_unsupported(int err) {
+    return err == ENOSYS || err == EINVAL || err == EXDEV || err == EOPNOTSUPP ||
+           err == ENOTTY || err == EBADF;
+}
 
-static int copy_file(const char *src, const char *dst) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+// Append srcfd to dstfd from their current offsets. Lets the kernel copy
+// when it can, and only falls back to read/write through buf when it can't.
+static int copy_fd(int srcfd, int dstfd, char *buf, int len) {
+    ssize_t bytes;
+    int copied = 0;
+
+#ifdef __NR_copy_file_range
+    while ((bytes = syscall(__NR_copy_file_range, srcfd, NULL, dstfd, NULL, RESTORE_BUFFER_SIZE, 0)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!copied && copy_unsupported(errno))
+                break;
+            return -1;
+        }
+        copied = 1;
+    }
+    if (bytes == 0)
+        return 0;
+#endif
+
+    while ((bytes = sendfile(dstfd, srcfd, NULL, RESTORE_BUFFER_SIZE)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!copied && copy_unsupported(errno))
+                break;
+            return -1;
+        }
+        copied = 1;
+    }
+    if (bytes == 0)
+        return 0;
+
+    while ((bytes = read(srcfd, buf, len)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (write_fully(dstfd, buf, bytes))
+            return -1;
+    }
+    return 0;
+}
+
+static int copy_file_buffer(const char *src, const char *dst, char *buf, int len) {
+    int dstfd, srcfd;
+    int ret = 0;
     if (src == NULL)
         return 1;
     if (dst == NULL)
@@ -44,126 +135,687 @@ static int copy_file(const char *src, const char *dst) {
         return 4;
     }
 
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
-    }
+    // share the extents when the filesystem can reflink
+    if (ioctl(dstfd, FICLONE, srcfd) != 0 && copy_fd(srcfd, dstfd, buf, len))
+        ret = 5;
 
-    close(dstfd);
+    if (close(dstfd) && ret == 0)
+        ret = 5;
     close(srcfd);
 
-    return 0;
+    return ret;
 }
 
-typedef struct DEDUPE_STORE_CONTEXT {
+struct INGEST_JOB {
+    char type;
+    char *path;
+    char *selabel;
+    char *link;
+    struct stat st;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct dedupe_chunk *chunks;
+    uint32_t chunk_count;
+    int done;
+    int ret;
+};
+
+// Blob keys of the previous backup of the same partition, indexed by path.
+struct HASH_CACHE_ENTRY {
+    char *path;
+    unsigned long size;
+    unsigned long mtime;
+    unsigned long ctime;
+    unsigned long ino;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct dedupe_chunk *chunks;
+    uint32_t chunk_count;
+    struct HASH_CACHE_ENTRY *next;
+};
+
+struct HASH_CACHE {
+    struct HASH_CACHE_ENTRY **buckets;
+    int count;
+    // files changed at or after this time may have changed within the same
+    // second the previous manifest recorded them, so they are always hashed
+    time_t stamp;
+};
+
+struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
-    FILE *output_manifest;
+    struct MANIFEST_WRITER output_manifest;
     const char** excludes;
     int exclude_count;
+    struct HASH_CACHE *cache;
+    int chunked;
+
+    // Files are hashed and stored by a pool of workers, while the manifest
+    // is still written in directory walk order from the job ring.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct INGEST_JOB jobs[INGEST_QUEUE_SIZE];
+    int head;       // next job to write to the manifest
+    int next;       // next job for a worker to pick up
+    int tail;       // next free slot for the walker
+    int finished;
+    int error;
 };
 
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s c [-C] input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
     fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
-    fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s gc [-n] [-f] blob_dir input_manifests_or_directories...\n", argv[0]);
 }
 
-static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
-    char rdata[BUFSIZ];
-    int rsize;
-    SHA256_CTX c;
+static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d);
 
-    SHA256_Init(&c);
-    while(!feof(mfile)) {
-        rsize = fread(rdata, sizeof(char), BUFSIZ, mfile);
-        if(rsize > 0) {
-            SHA256_Update(&c, rdata, rsize);
+static int blob_present(const char *out_blob, off_t size) {
+    struct stat file_info;
+    // verify the file exists and is of the same size
+    return stat(out_blob, &file_info) == 0 && file_info.st_size == size;
+}
+
+static unsigned int hash_path(const char *path) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    while (*path) {
+        hash ^= (unsigned char) *path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void hash_cache_free(struct HASH_CACHE *cache) {
+    int i;
+    if (cache == NULL)
+        return;
+    for (i = 0; i < HASH_CACHE_BUCKETS; i++) {
+        struct HASH_CACHE_ENTRY *entry = cache->buckets[i];
+        while (entry != NULL) {
+            struct HASH_CACHE_ENTRY *next = entry->next;
+            free(entry->path);
+            free(entry->chunks);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+// Index the regular files of a manifest that recorded inodes.
+static struct HASH_CACHE* hash_cache_load(const char *manifest) {
+    struct MANIFEST m;
+    struct MANIFEST_ENTRY e;
+    struct stat st;
+    int ret;
+
+    if (stat(manifest, &st) || manifest_open(&m, manifest))
+        return NULL;
+
+    struct HASH_CACHE *cache = calloc(1, sizeof(struct HASH_CACHE));
+    if (cache == NULL || (cache->buckets = calloc(HASH_CACHE_BUCKETS, sizeof(struct HASH_CACHE_ENTRY*))) == NULL) {
+        free(cache);
+        manifest_close(&m);
+        return NULL;
+    }
+    cache->stamp = st.st_mtime;
+
+    while ((ret = manifest_next(&m, &e)) > 0) {
+        if (e.type != 'f' || !e.has_ino || !e.has_times)
+            continue;
+
+        struct HASH_CACHE_ENTRY *entry = malloc(sizeof(struct HASH_CACHE_ENTRY));
+        if (entry == NULL)
+            break;
+        entry->path = strdup(e.filename);
+        entry->mtime = e.mtime;
+        entry->ctime = e.ctime;
+        entry->size = e.size;
+        entry->ino = e.ino;
+        memcpy(entry->digest, e.digest, SHA256_DIGEST_LENGTH);
+        entry->chunks = NULL;
+        entry->chunk_count = e.chunk_count;
+        if (e.chunks != NULL) {
+            entry->chunks = malloc(e.chunk_count * sizeof(struct dedupe_chunk));
+            if (entry->chunks == NULL) {
+                free(entry->path);
+                free(entry);
+                break;
+            }
+            memcpy(entry->chunks, e.chunks, e.chunk_count * sizeof(struct dedupe_chunk));
         }
+
+        unsigned int bucket = hash_path(entry->path) % HASH_CACHE_BUCKETS;
+        entry->next = cache->buckets[bucket];
+        cache->buckets[bucket] = entry;
+        cache->count++;
     }
+    manifest_close(&m);
+    return cache;
+}
 
-    SHA256_Final(rptr, &c);
+static const struct HASH_CACHE_ENTRY* hash_cache_lookup(struct HASH_CACHE *cache, const char *path, const struct stat *st) {
+    if (cache == NULL)
+        return NULL;
+    if (st->st_mtime >= cache->stamp || st->st_ctime >= cache->stamp)
+        return NULL;
+
+    struct HASH_CACHE_ENTRY *entry = cache->buckets[hash_path(path) % HASH_CACHE_BUCKETS];
+    for (; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) != 0)
+            continue;
+        if (entry->size == (unsigned long) st->st_size &&
+                entry->mtime == (unsigned long) st->st_mtime &&
+                entry->ctime == (unsigned long) st->st_ctime &&
+                entry->ino == (unsigned long) st->st_ino)
+            return entry;
+        return NULL;
+    }
+    return NULL;
 }
 
-static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open file: %s\n", filename);
+// Backups live in <backup>/<name>/<partition>.dup; use the most recently
+// written manifest of the same partition from another backup.
+static int find_previous_manifest(const char *output_manifest, char *previous) {
+    char backup_dir[PATH_MAX];
+    char own_dir[PATH_MAX];
+    char base[PATH_MAX];
+    char candidate[PATH_MAX];
+    time_t newest = 0;
+
+    strcpy(backup_dir, output_manifest);
+    char *sep = strrchr(backup_dir, '/');
+    if (sep == NULL)
         return 1;
+    strcpy(base, sep + 1);
+    *sep = '\0';
+    sep = strrchr(backup_dir, '/');
+    if (sep == NULL)
+        return 1;
+    strcpy(own_dir, sep + 1);
+    *sep = '\0';
+
+    DIR *dp = opendir(backup_dir[0] ? backup_dir : "/");
+    if (dp == NULL)
+        return 1;
+    struct dirent *ep;
+    while ((ep = readdir(dp))) {
+        struct stat st;
+        if (ep->d_name[0] == '.' || strcmp(ep->d_name, own_dir) == 0)
+            continue;
+        snprintf(candidate, PATH_MAX, "%s/%s/%s", backup_dir, ep->d_name, base);
+        if (stat(candidate, &st) || !S_ISREG(st.st_mode) || st.st_mtime < newest)
+            continue;
+        newest = st.st_mtime;
+        strcpy(previous, candidate);
+    }
+    closedir(dp);
+    return newest == 0;
+}
+
+// Store data as the blob for key unless it is already there.
+static int store_blob(struct DEDUPE_STORE_CONTEXT *context, const char *key, const char *data, int len, int worker) {
+    char out_blob[PATH_MAX];
+    char tmp_out_blob[PATH_MAX];
+    int ret = 0;
+    snprintf(out_blob, PATH_MAX, "%s/%s", context->blob_dir, key);
+    if (blob_present(out_blob, len))
+        return 0;
+
+    // per worker, two workers may be storing identical content at once
+    snprintf(tmp_out_blob, PATH_MAX, "%s.%d.tmp", out_blob, worker);
+    //when BUILD_HOST_EXECUTABLE, dirname(out_blob) will change out_blob
+    char out_blob_dir[PATH_MAX];
+    strcpy(out_blob_dir, out_blob);
+    mkdir(dirname(out_blob_dir), S_IRWXU | S_IRWXG | S_IRWXO);
+
+    int dstfd = open(tmp_out_blob, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0)
+        ret = 4;
+    else {
+        if (write_fully(dstfd, data, len))
+            ret = 5;
+        if (close(dstfd) && ret == 0)
+            ret = 5;
+    }
+    if (ret || (ret = rename(tmp_out_blob, out_blob))) {
+        unlink(tmp_out_blob);
+        return ret;
     }
-    do_sha256sum(f, rptr);
-    fclose(f);
     return 0;
 }
 
-static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+static uint32_t chunk_gear[256];
+
+// The gear table only has to be random looking and never change, so it is
+// generated from a fixed seed (splitmix64) instead of being spelled out.
+static void chunk_gear_init() {
+    uint64_t x = 0x6465647570652121ULL;
+    int i;
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        chunk_gear[i] = (uint32_t) ((z ^ (z >> 31)) >> 32);
+    }
+}
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, char *selabel, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%lu\t%lu\t%s\t%lu\t%lu\t%lu\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, selabel, st.st_atime, st.st_mtime, st.st_ctime, f);
+// Length of the next content defined chunk in data (gear rolling hash): cut
+// where the hash has its low bits clear, so an edit only moves the
+// boundaries next to it. Returns 0 if more data is needed to decide.
+static int chunk_length(const unsigned char *data, int len, int eof) {
+    uint32_t hash = 0;
+    int i;
+    int limit = len < CHUNK_MAX_SIZE ? len : CHUNK_MAX_SIZE;
+    if (limit <= CHUNK_MIN_SIZE)
+        return eof || len >= CHUNK_MAX_SIZE ? limit : 0;
+    for (i = CHUNK_MIN_SIZE - 64; i < CHUNK_MIN_SIZE; i++)
+        hash = (hash << 1) + chunk_gear[data[i]];
+    for (; i < limit; i++) {
+        hash = (hash << 1) + chunk_gear[data[i]];
+        if ((hash & CHUNK_AVG_MASK) == 0)
+            return i + 1;
+    }
+    return eof || limit == CHUNK_MAX_SIZE ? limit : 0;
 }
 
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
-    int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
-        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
+static int add_job_chunk(struct INGEST_JOB *job, uint32_t *capacity, const unsigned char *digest, int len) {
+    if (job->chunk_count == *capacity) {
+        uint32_t grown = *capacity ? *capacity * 2 : 64;
+        struct dedupe_chunk *chunks = realloc(job->chunks, grown * sizeof(struct dedupe_chunk));
+        if (chunks == NULL)
+            return 1;
+        job->chunks = chunks;
+        *capacity = grown;
+    }
+    memcpy(job->chunks[job->chunk_count].digest, digest, SHA256_DIGEST_LENGTH);
+    job->chunks[job->chunk_count].size = len;
+    job->chunk_count++;
+    return 0;
+}
+
+// Split a large file into content defined chunks and store each as a blob.
+// The whole file is hashed on the same pass for the hash cache.
+static int ingest_chunked(struct DEDUPE_STORE_CONTEXT *context, struct INGEST_JOB *job, char *buf, int worker) {
+    char key[DEDUPE_KEY_LENGTH + 1];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint32_t capacity = 0;
+    SHA256_CTX c;
+    off_t size = 0;
+    int ret = 0;
+    int start = 0, len = 0, eof = 0;
+
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", job->path);
+        return 1;
+    }
+
+    SHA256_Init(&c);
+    while (ret == 0) {
+        int n = chunk_length((unsigned char*) buf + start, len - start, eof);
+        if (n > 0) {
+            SHA256((unsigned char*) buf + start, n, digest);
+            manifest_format_key(key, digest);
+            if ((ret = store_blob(context, key, buf + start, n, worker))) {
+                fprintf(stderr, "Error copying blob %s\n", job->path);
+                break;
+            }
+            if ((ret = add_job_chunk(job, &capacity, digest, n)))
+                break;
+            size += n;
+            start += n;
+            continue;
+        }
+        if (eof)
+            break;
+
+        // keep the undecided tail and refill behind it
+        memmove(buf, buf + start, len - start);
+        len -= start;
+        start = 0;
+        int bytes_read = read(fd, buf + len, INGEST_BUFFER_SIZE - len);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error calculating sha256sum of %s\n", job->path);
+            ret = 1;
+            break;
+        }
+        if (bytes_read == 0)
+            eof = 1;
+        SHA256_Update(&c, buf + len, bytes_read);
+        len += bytes_read;
+    }
+    close(fd);
+    SHA256_Final(job->digest, &c);
+
+    if (ret) {
+        free(job->chunks);
+        job->chunks = NULL;
+        job->chunk_count = 0;
         return ret;
     }
-    char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+    // the chunks must add up to the size in the manifest, whatever
+    // lstat saw before the file grew or shrank
+    job->st.st_size = size;
+    return 0;
+}
 
-    // if a hash is abcdefg,
-    // the output blob name is abc/defg
-    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
+static int chunks_present(struct DEDUPE_STORE_CONTEXT *context, const struct dedupe_chunk *chunks, uint32_t count) {
+    char key[DEDUPE_KEY_LENGTH + 1];
     char out_blob[PATH_MAX];
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        manifest_format_key(key, chunks[i].digest);
+        snprintf(out_blob, PATH_MAX, "%s/%s", context->blob_dir, key);
+        if (!blob_present(out_blob, chunks[i].size))
+            return 0;
+    }
+    return 1;
+}
+
+// Hash and store a single file in one pass: in buf when it fits, else into a
+// temporary blob renamed to its digest.
+static int ingest_file(struct DEDUPE_STORE_CONTEXT *context, struct INGEST_JOB *job, char *buf, int worker) {
+    char key[DEDUPE_KEY_LENGTH + 1];
+    SHA256_CTX c;
+    int ret = 0;
+    int len = 0;
+    int buffered = job->st.st_size <= INGEST_BUFFER_SIZE;
+
+    // unchanged since the previous backup, and its blobs are still there
+    const struct HASH_CACHE_ENTRY *cached = hash_cache_lookup(context->cache, job->path, &job->st);
+    if (cached != NULL && cached->chunks != NULL) {
+        if (chunks_present(context, cached->chunks, cached->chunk_count)) {
+            size_t size = cached->chunk_count * sizeof(struct dedupe_chunk);
+            if ((job->chunks = malloc(size)) != NULL) {
+                memcpy(job->chunks, cached->chunks, size);
+                job->chunk_count = cached->chunk_count;
+                memcpy(job->digest, cached->digest, SHA256_DIGEST_LENGTH);
+                return 0;
+            }
+        }
+    }
+    else if (cached != NULL) {
+        char out_blob[PATH_MAX];
+        manifest_format_key(key, cached->digest);
+        snprintf(out_blob, PATH_MAX, "%s/%s", context->blob_dir, key);
+        if (blob_present(out_blob, job->st.st_size)) {
+            memcpy(job->digest, cached->digest, SHA256_DIGEST_LENGTH);
+            return 0;
+        }
+    }
+
+    if (context->chunked && !buffered)
+        return ingest_chunked(context, job, buf, worker);
+
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", job->path);
+        return 1;
+    }
+
+    // Larger files are written to a temporary blob as they are hashed, and
+    // renamed to their digest at the end.
     char tmp_out_blob[PATH_MAX];
-    char key[SHA256_DIGEST_LENGTH * 2 + 2];
-    // int i = 0;
-    // int keyIndex = 0;
-    // while (psum[i]) {
-    //     key[keyIndex] = psum[i];
-    //     i++;
-    //     keyIndex++;
-    //     if (i % 2 == 0 && psum[i]) {
-    //         key[keyIndex] = '/';
-    //         keyIndex++;
-    //     }
-    // }
-    strcpy(key, psum);
-    key[3] = '/';
-    key[4] = NULL;
-    strcat(key, psum + 3);
-    sprintf(out_blob, "%s/%s", context->blob_dir, key);
-    sprintf(tmp_out_blob, "%s.tmp", out_blob);
-    //when BUILD_HOST_EXECUTABLE, dirname(out_blob) will change out_blob
+    int tmpfd = -1;
+    snprintf(tmp_out_blob, PATH_MAX, "%s/ingest.%d.tmp", context->blob_dir, worker);
+    if (!buffered && (tmpfd = open(tmp_out_blob, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+        fprintf(stderr, "Unable to create %s\n", tmp_out_blob);
+        close(fd);
+        return 4;
+    }
+
+    off_t size = 0;
+    SHA256_Init(&c);
+    for (;;) {
+        int bytes_read = read(fd, buf + len, INGEST_BUFFER_SIZE - len);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error calculating sha256sum of %s\n", job->path);
+            ret = 1;
+            break;
+        }
+        if (bytes_read == 0)
+            break;
+        SHA256_Update(&c, buf + len, bytes_read);
+        size += bytes_read;
+        if (buffered) {
+            len += bytes_read;
+            if (len < INGEST_BUFFER_SIZE)
+                continue;
+            // the file grew past the buffer after we stat'ed it: go on
+            // like any large file, starting with what is buffered
+            buffered = 0;
+            tmpfd = open(tmp_out_blob, O_RDWR | O_CREAT | O_TRUNC, 0666);
+            if (tmpfd < 0) {
+                fprintf(stderr, "Unable to create %s\n", tmp_out_blob);
+                ret = 4;
+                break;
+            }
+            bytes_read = len;
+            len = 0;
+        }
+        if (write_fully(tmpfd, buf, bytes_read)) {
+            fprintf(stderr, "Error writing %s\n", tmp_out_blob);
+            ret = 5;
+            break;
+        }
+    }
+    close(fd);
+    if (tmpfd >= 0 && close(tmpfd) && ret == 0)
+        ret = 5;
+    if (ret) {
+        if (tmpfd >= 0)
+            unlink(tmp_out_blob);
+        return ret;
+    }
+    SHA256_Final(job->digest, &c);
+    manifest_format_key(key, job->digest);
+    // what was hashed, not what lstat saw
+    job->st.st_size = size;
+
+    if (buffered) {
+        if ((ret = store_blob(context, key, buf, len, worker)))
+            fprintf(stderr, "Error copying blob %s\n", job->path);
+        return ret;
+    }
+
+    char out_blob[PATH_MAX];
+    snprintf(out_blob, PATH_MAX, "%s/%s", context->blob_dir, key);
+    if (blob_present(out_blob, size)) {
+        unlink(tmp_out_blob);
+        return 0;
+    }
+
     char out_blob_dir[PATH_MAX];
     strcpy(out_blob_dir, out_blob);
     mkdir(dirname(out_blob_dir), S_IRWXU | S_IRWXG | S_IRWXO);
+    if ((ret = rename(tmp_out_blob, out_blob))) {
+        fprintf(stderr, "Error copying blob %s\n", job->path);
+        unlink(tmp_out_blob);
+        return ret;
+    }
+    return 0;
+}
 
-    // don't copy the file if it exists? not quite sure how I feel about this.
-    int size = (int)st.st_size;
-    struct stat file_info;
-    // verify the file exists and is of the same size
-    int file_ok = stat(out_blob, &file_info) == 0;
-    if (file_ok) {
-        int existing_size = file_info.st_size;
-        if (existing_size != size)
-            file_ok = 0;
-    }
-    if (!file_ok) {
-        // copy to the tmp file
-        if ((ret = copy_file(f, tmp_out_blob)) || (ret = rename(tmp_out_blob, out_blob))) {
-            fprintf(stderr, "Error copying blob %s\n", f);
-            return ret;
+struct INGEST_WORKER {
+    struct DEDUPE_STORE_CONTEXT *context;
+    int id;
+};
+
+static void* ingest_thread(void *cookie) {
+    struct INGEST_WORKER *worker = (struct INGEST_WORKER*) cookie;
+    struct DEDUPE_STORE_CONTEXT *context = worker->context;
+    char *buf = malloc(INGEST_BUFFER_SIZE);
+
+    pthread_mutex_lock(&context->lock);
+    if (buf == NULL) {
+        context->error = 1;
+        pthread_cond_broadcast(&context->cond);
+    }
+    while (!context->error) {
+        if (context->next == context->tail) {
+            if (context->finished)
+                break;
+            pthread_cond_wait(&context->cond, &context->lock);
+            continue;
+        }
+        struct INGEST_JOB *job = &context->jobs[context->next % INGEST_QUEUE_SIZE];
+        context->next++;
+        if (job->type != 'f') {
+            job->done = 1;
+            pthread_cond_broadcast(&context->cond);
+            continue;
         }
+        pthread_mutex_unlock(&context->lock);
+
+        int ret = ingest_file(context, job, buf, worker->id);
+
+        pthread_mutex_lock(&context->lock);
+        job->ret = ret;
+        job->done = 1;
+        pthread_cond_broadcast(&context->cond);
     }
+    pthread_mutex_unlock(&context->lock);
 
-    fprintf(context->output_manifest, "%s\t%d\t\n", key, size);
-    return 0;
+    free(buf);
+    return NULL;
+}
+
+static void ingest_job_free(struct INGEST_JOB *job) {
+    free(job->path);
+    freecon(job->selabel);
+    free(job->link);
+    free(job->chunks);
+    job->path = NULL;
+    job->selabel = NULL;
+    job->link = NULL;
+    job->chunks = NULL;
+    job->chunk_count = 0;
+}
+
+// Write finished jobs to the manifest in order. Called with the lock held.
+static int ingest_flush(struct DEDUPE_STORE_CONTEXT *context, int wait) {
+    int ret = 0;
+    while (context->head != context->tail) {
+        struct INGEST_JOB *job = &context->jobs[context->head % INGEST_QUEUE_SIZE];
+        if (!job->done) {
+            if (!wait || context->error)
+                break;
+            pthread_cond_wait(&context->cond, &context->lock);
+            continue;
+        }
+        if (job->ret) {
+            fprintf(stderr, "Error storing: %s\n", job->path);
+            context->error = 1;
+            pthread_cond_broadcast(&context->cond);
+            ret = job->ret;
+            break;
+        }
+        if (manifest_writer_add(&context->output_manifest, job->type, &job->st, job->selabel,
+                                job->path, job->digest, job->link, job->chunks, job->chunk_count)) {
+            fprintf(stderr, "Out of memory for manifest\n");
+            context->error = 1;
+            pthread_cond_broadcast(&context->cond);
+            ret = 1;
+            break;
+        }
+        ingest_job_free(job);
+        context->head++;
+    }
+    return ret;
+}
+
+// Takes ownership of selabel and link.
+static int ingest_push(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *path,
+                       char *selabel, char *link) {
+    int ret = 0;
+    pthread_mutex_lock(&context->lock);
+    while (!context->error && context->tail - context->head == INGEST_QUEUE_SIZE) {
+        if ((ret = ingest_flush(context, 0)))
+            break;
+        if (context->tail - context->head == INGEST_QUEUE_SIZE)
+            pthread_cond_wait(&context->cond, &context->lock);
+    }
+    if (context->error) {
+        pthread_mutex_unlock(&context->lock);
+        freecon(selabel);
+        free(link);
+        return ret ? ret : 1;
+    }
+
+    struct INGEST_JOB *job = &context->jobs[context->tail % INGEST_QUEUE_SIZE];
+    job->type = type;
+    job->path = strdup(path);
+    job->selabel = selabel;
+    job->link = link;
+    job->chunks = NULL;
+    job->chunk_count = 0;
+    job->st = st;
+    job->done = 0;
+    job->ret = 0;
+    context->tail++;
+    pthread_cond_broadcast(&context->cond);
+    ret = ingest_flush(context, 0);
+    pthread_mutex_unlock(&context->lock);
+    return ret;
+}
+
+static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f, char *selabel) {
+    printf("%s\n", f);
+    return ingest_push(context, 'f', st, f, selabel, NULL);
+}
+
+static int store_tree(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
+    struct INGEST_WORKER workers[INGEST_MAX_WORKERS];
+    pthread_t threads[INGEST_MAX_WORKERS];
+    int nworkers, i, ret;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = cpus < 1 ? 1 : (cpus > INGEST_MAX_WORKERS ? INGEST_MAX_WORKERS : cpus);
+
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->cond, NULL);
+    context->head = context->next = context->tail = 0;
+    context->finished = context->error = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        workers[i].context = context;
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, ingest_thread, &workers[i]))
+            break;
+    }
+    nworkers = i;
+    if (nworkers == 0) {
+        fprintf(stderr, "Unable to start dedupe workers\n");
+        return 1;
+    }
+
+    ret = store_dir(context, st, d);
+
+    pthread_mutex_lock(&context->lock);
+    if (ret) {
+        context->error = 1;
+    } else {
+        context->finished = 1;
+        ret = ingest_flush(context, 1);
+    }
+    pthread_cond_broadcast(&context->cond);
+    pthread_mutex_unlock(&context->lock);
+
+    for (i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+
+    // drop whatever was left unwritten after an error
+    for (i = context->head; i != context->tail; i++)
+        ingest_job_free(&context->jobs[i % INGEST_QUEUE_SIZE]);
+    pthread_cond_destroy(&context->cond);
+    pthread_mutex_destroy(&context->lock);
+    return ret;
 }
 
 static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
@@ -206,40 +858,36 @@ static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     return 0;
 }
 
-static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
+static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l, char *selabel) {
     printf("%s\n", l);
     char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
+    int ret = readlink(l, link, PATH_MAX - 1);
     if (ret < 0) {
         fprintf(stderr, "Error reading symlink\n");
+        freecon(selabel);
         return errno;
     }
     link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
-    return 0;
+    return ingest_push(context, 'l', st, l, selabel, strdup(link));
 }
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
     char* selabel = NULL;
+    int ret;
     if (lgetfilecon(s, &selabel) < 0) {
         fprintf(stderr, "Can't get %s context\n", s);
         selabel = strdup("unlabel");
     }
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, selabel, s);
-        freecon(selabel);
-        return store_file(context, st, s);
+        return store_file(context, st, s, selabel);
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, selabel, s);
-        fprintf(context->output_manifest, "\n");
-        freecon(selabel);
+        if ((ret = ingest_push(context, 'd', st, s, selabel, NULL)))
+            return ret;
         return store_dir(context, st, s);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, selabel, s);
-        freecon(selabel);
-        return store_link(context, st, s);
+        return store_link(context, st, s, selabel);
     }
     else {
         fprintf(stderr, "Skipping special: %s\n", s);
@@ -248,112 +896,569 @@ static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     }
 }
 
-static char* tokenize(char *out, const char* line, const char sep) {
-    while (*line != sep) {
-        if (*line == '\0') {
-            return NULL;
+static int check_file(const char* f) {
+    struct stat cst;
+    return lstat(f, &cst);
+}
+
+// Open addressing set of blob digests. sha256 output is already uniformly
+// distributed, so its leading bytes serve as the hash, and the all zero
+// digest marks an empty slot (the real one is tracked separately).
+struct DIGEST_SET {
+    unsigned char *slots;
+    size_t capacity;
+    size_t count;
+    int has_zero;
+};
+
+static const unsigned char zero_digest[SHA256_DIGEST_LENGTH];
+
+static size_t digest_slot(const struct DIGEST_SET *set, const unsigned char *digest) {
+    size_t hash;
+    memcpy(&hash, digest, sizeof(hash));
+    return hash & (set->capacity - 1);
+}
+
+static int digest_set_contains(const struct DIGEST_SET *set, const unsigned char *digest) {
+    if (memcmp(digest, zero_digest, SHA256_DIGEST_LENGTH) == 0)
+        return set->has_zero;
+    if (set->capacity == 0)
+        return 0;
+    size_t i = digest_slot(set, digest);
+    for (;;) {
+        const unsigned char *slot = set->slots + i * SHA256_DIGEST_LENGTH;
+        if (memcmp(slot, zero_digest, SHA256_DIGEST_LENGTH) == 0)
+            return 0;
+        if (memcmp(slot, digest, SHA256_DIGEST_LENGTH) == 0)
+            return 1;
+        i = (i + 1) & (set->capacity - 1);
+    }
+}
+
+static void digest_set_place(struct DIGEST_SET *set, const unsigned char *digest) {
+    size_t i = digest_slot(set, digest);
+    for (;;) {
+        unsigned char *slot = set->slots + i * SHA256_DIGEST_LENGTH;
+        if (memcmp(slot, zero_digest, SHA256_DIGEST_LENGTH) == 0) {
+            memcpy(slot, digest, SHA256_DIGEST_LENGTH);
+            set->count++;
+            return;
         }
+        if (memcmp(slot, digest, SHA256_DIGEST_LENGTH) == 0)
+            return;
+        i = (i + 1) & (set->capacity - 1);
+    }
+}
 
-        *out = *line;
-        out++;
-        line++;
+static int digest_set_add(struct DIGEST_SET *set, const unsigned char *digest) {
+    if (memcmp(digest, zero_digest, SHA256_DIGEST_LENGTH) == 0) {
+        set->has_zero = 1;
+        return 0;
+    }
+    // keep the load under 3/4
+    if ((set->count + 1) * 4 > set->capacity * 3) {
+        struct DIGEST_SET grown = *set;
+        grown.capacity = set->capacity ? set->capacity * 2 : DIGEST_SET_MIN_CAPACITY;
+        grown.count = 0;
+        grown.slots = calloc(grown.capacity, SHA256_DIGEST_LENGTH);
+        if (grown.slots == NULL)
+            return 1;
+        size_t i;
+        for (i = 0; i < set->capacity; i++) {
+            const unsigned char *slot = set->slots + i * SHA256_DIGEST_LENGTH;
+            if (memcmp(slot, zero_digest, SHA256_DIGEST_LENGTH) != 0)
+                digest_set_place(&grown, slot);
+        }
+        free(set->slots);
+        *set = grown;
     }
+    digest_set_place(set, digest);
+    return 0;
+}
 
-    *out = '\0';
-    // resume at the next char
-    return ++line;
+static int manifest_name(const char *name) {
+    size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".dup") == 0;
 }
 
-static int dec_to_oct(int dec) {
-    int ret = 0;
-    int mult = 1;
-    while (dec != 0) {
-        int rem = dec % 10;
-        ret += (rem * mult);
-        dec /= 10;
-        mult *= 8;
+// Mark every blob referenced by a manifest, or by the manifests found under
+// a directory. Returns the number of manifests that could not be read.
+static int gc_mark(struct DIGEST_SET *set, const char *path, int *manifests) {
+    struct stat st;
+    if (stat(path, &st)) {
+        fprintf(stderr, "Unable to open input manifest %s\n", path);
+        return 1;
     }
 
-    return ret;
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dp = opendir(path);
+        if (dp == NULL) {
+            fprintf(stderr, "Error opening directory: %s\n", path);
+            return 1;
+        }
+        int failed = 0;
+        struct dirent *ep;
+        while ((ep = readdir(dp))) {
+            if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+                continue;
+            char child[PATH_MAX];
+            struct stat cst;
+            snprintf(child, PATH_MAX, "%s/%s", path, ep->d_name);
+            if (lstat(child, &cst))
+                continue;
+            if (S_ISDIR(cst.st_mode) || (S_ISREG(cst.st_mode) && manifest_name(ep->d_name)))
+                failed += gc_mark(set, child, manifests);
+        }
+        closedir(dp);
+        return failed;
+    }
+
+    struct MANIFEST m;
+    if (manifest_open(&m, path)) {
+        fprintf(stderr, "Unable to open input manifest %s (or it is from a newer dedupe)\n", path);
+        return 1;
+    }
+
+    int ret = 0;
+    uint32_t key_count, k;
+    const unsigned char *keys = manifest_keys(&m, &key_count);
+    if (keys != NULL) {
+        for (k = 0; k < key_count && ret == 0; k++)
+            ret = digest_set_add(set, keys + k * SHA256_DIGEST_LENGTH);
+    }
+    else {
+        struct MANIFEST_ENTRY e;
+        while ((ret = manifest_next(&m, &e)) > 0) {
+            if (e.type == 'f' && digest_set_add(set, e.digest)) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    manifest_close(&m);
+    if (ret) {
+        fprintf(stderr, "Corrupt manifest %s\n", path);
+        return 1;
+    }
+    (*manifests)++;
+    return 0;
 }
 
-struct array {
-    void** data;
-    int size;
-    int capacity;
+struct GC_CONTEXT {
+    const char *blob_dir;
+    const struct DIGEST_SET *used;
+    int dry_run;
+    pthread_mutex_t lock;
+    char (*shards)[NAME_MAX + 1];
+    int shard_count;
+    int next_shard;
 };
 
-static void array_init(struct array* arr, int capacity) {
-    arr->data = malloc(sizeof(void*) * capacity);
-    assert(arr->data != NULL);
-    arr->size = 0;
-    arr->capacity = capacity;
+struct GC_WORKER {
+    struct GC_CONTEXT *context;
+    unsigned long kept;
+    unsigned long removed;
+    unsigned long long removed_bytes;
+    unsigned long errors;
+};
+
+// blob names are abc/defg..., turn them back into the digest they name
+static int gc_blob_digest(const char *shard, const char *name, unsigned char *digest) {
+    char key[DEDUPE_KEY_LENGTH + 1];
+    if (strlen(shard) != 3 || strlen(name) != DEDUPE_KEY_LENGTH - 4)
+        return 1;
+    snprintf(key, sizeof(key), "%s/%s", shard, name);
+    return manifest_parse_key(digest, key);
 }
 
-static void array_free(struct array* arr, int free_members) {
-    if (free_members) {
-        int i;
-        for (i = 0; i < arr->size; i++) {
-            free(arr->data[i]);
-        }
+static void gc_sweep_file(struct GC_WORKER *worker, const char *shard, const char *name, const char *path) {
+    struct GC_CONTEXT *context = worker->context;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct stat st;
+
+    if (shard != NULL && gc_blob_digest(shard, name, digest) == 0 &&
+            digest_set_contains(context->used, digest)) {
+        worker->kept++;
+        return;
     }
 
-    if (arr->data != NULL) {
-        free(arr->data);
-        arr->data = NULL;
+    if (lstat(path, &st))
+        st.st_size = 0;
+    if (!context->dry_run && remove(path)) {
+        fprintf(stderr, "Error removing: %s\n", path);
+        worker->errors++;
+        return;
     }
-    arr->size = 0;
-    arr->capacity = 0;
+    printf("%s: %s\n", context->dry_run ? "Unused" : "Delete", path);
+    worker->removed++;
+    worker->removed_bytes += st.st_size;
 }
 
-static void array_add(struct array* arr, void* val) {
-    if (arr->size == arr->capacity) {
-        // Expand array
-        arr->capacity *= 2;
-        arr->data = realloc(arr->data, sizeof(void*) * arr->capacity);
-        assert(arr->data != NULL);
+static void* gc_thread(void *cookie) {
+    struct GC_WORKER *worker = (struct GC_WORKER*) cookie;
+    struct GC_CONTEXT *context = worker->context;
+
+    for (;;) {
+        pthread_mutex_lock(&context->lock);
+        int i = context->next_shard++;
+        pthread_mutex_unlock(&context->lock);
+        if (i >= context->shard_count)
+            break;
+
+        const char *shard = context->shards[i];
+        char dir[PATH_MAX];
+        snprintf(dir, PATH_MAX, "%s/%s", context->blob_dir, shard);
+        DIR *dp = opendir(dir);
+        if (dp == NULL) {
+            fprintf(stderr, "Error opening directory: %s\n", dir);
+            worker->errors++;
+            continue;
+        }
+        struct dirent *ep;
+        while ((ep = readdir(dp))) {
+            if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+                continue;
+            char path[PATH_MAX];
+            snprintf(path, PATH_MAX, "%s/%s", dir, ep->d_name);
+            if (ep->d_type == DT_DIR)
+                continue;
+            gc_sweep_file(worker, shard, ep->d_name, path);
+        }
+        closedir(dp);
     }
-    arr->data[arr->size++] = val;
+    return NULL;
 }
 
-static int string_compare(const void* a, const void* b) {
-    return strcmp(*(char**) a, *(char **) b);
-}
+// Walk the blob shards in parallel and remove every blob that is not in used.
+static int gc_sweep(const char *blob_dir, const struct DIGEST_SET *used, int dry_run) {
+    struct GC_CONTEXT context;
+    struct GC_WORKER workers[INGEST_MAX_WORKERS];
+    pthread_t threads[INGEST_MAX_WORKERS];
+    int nworkers, i;
 
-static void recursive_list_dir(char* d, struct array *arr) {
-    DIR *dp = opendir(d);
+    DIR *dp = opendir(blob_dir);
     if (dp == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", d);
-        return;
+        fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
+        return 1;
+    }
+
+    memset(&context, 0, sizeof(context));
+    memset(workers, 0, sizeof(workers));
+    context.blob_dir = blob_dir;
+    context.used = used;
+    context.dry_run = dry_run;
+    context.shards = malloc(GC_SHARDS * sizeof(*context.shards));
+    if (context.shards == NULL) {
+        closedir(dp);
+        return 1;
     }
+
+    // loose files in the top level are never referenced
+    workers[0].context = &context;
     struct dirent *ep;
+    int capacity = GC_SHARDS;
     while ((ep = readdir(dp))) {
-        if (strcmp(ep->d_name, ".") == 0)
+        if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
             continue;
-        if (strcmp(ep->d_name, "..") == 0)
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, PATH_MAX, "%s/%s", blob_dir, ep->d_name);
+        if (lstat(path, &st))
             continue;
-        struct stat cst;
-        int ret;
-        char blob[PATH_MAX];
-        sprintf(blob, "%s/%s", d, ep->d_name);
-        if ((ret = lstat(blob, &cst))) {
-            fprintf(stderr, "Error opening: %s\n", ep->d_name);
+        if (!S_ISDIR(st.st_mode)) {
+            gc_sweep_file(&workers[0], NULL, ep->d_name, path);
             continue;
         }
+        if (context.shard_count == capacity) {
+            void *shards = realloc(context.shards, capacity * 2 * sizeof(*context.shards));
+            if (shards == NULL)
+                break;
+            context.shards = shards;
+            capacity *= 2;
+        }
+        strcpy(context.shards[context.shard_count++], ep->d_name);
+    }
+    closedir(dp);
 
-        if (S_ISDIR(cst.st_mode)) {
-            recursive_list_dir(blob, arr);
-            continue;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = cpus < 1 ? 1 : (cpus > INGEST_MAX_WORKERS ? INGEST_MAX_WORKERS : cpus);
+    pthread_mutex_init(&context.lock, NULL);
+    for (i = 0; i < nworkers; i++) {
+        workers[i].context = &context;
+        if (pthread_create(&threads[i], NULL, gc_thread, &workers[i]))
+            break;
+    }
+    nworkers = i;
+    if (nworkers == 0)
+        gc_thread(&workers[0]);
+    for (i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&context.lock);
+    free(context.shards);
+
+    unsigned long kept = 0, removed = 0, errors = 0;
+    unsigned long long removed_bytes = 0;
+    for (i = 0; i < INGEST_MAX_WORKERS; i++) {
+        kept += workers[i].kept;
+        removed += workers[i].removed;
+        removed_bytes += workers[i].removed_bytes;
+        errors += workers[i].errors;
+    }
+    printf("%s %lu unused blobs (%llu bytes), %lu in use\n",
+           dry_run ? "Would remove" : "Removed", removed, removed_bytes, kept);
+    return errors != 0;
+}
+
+// Ownership, mode, label and times of a restored file or directory.
+struct RESTORE_ENTRY {
+    char *path;
+    char *blob;
+    // chunked files, these point into the open manifest
+    const struct dedupe_chunk *chunks;
+    uint32_t chunk_count;
+    unsigned int mode;
+    unsigned long uid;
+    unsigned long gid;
+    char *selabel;
+    int has_times;
+    unsigned long atime;
+    unsigned long mtime;
+};
+
+struct RESTORE_CONTEXT {
+    const char *blob_dir;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct RESTORE_ENTRY jobs[RESTORE_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    int finished;
+    int error;
+};
+
+static int restore_entry_init(struct RESTORE_ENTRY *r, const struct MANIFEST_ENTRY *e, const char *blob_dir) {
+    memset(r, 0, sizeof(*r));
+    r->path = strdup(e->filename);
+    r->selabel = strdup(e->selabel);
+    r->chunks = e->chunks;
+    r->chunk_count = e->chunk_count;
+    if (e->type == 'f' && e->chunks == NULL) {
+        r->blob = malloc(PATH_MAX);
+        if (r->blob != NULL)
+            snprintf(r->blob, PATH_MAX, "%s/%s", blob_dir, e->key);
+    }
+    r->mode = e->mode;
+    r->uid = e->uid;
+    r->gid = e->gid;
+    r->has_times = e->has_times;
+    r->atime = e->atime;
+    r->mtime = e->mtime;
+    return r->path == NULL || r->selabel == NULL || (e->type == 'f' && e->chunks == NULL && r->blob == NULL);
+}
+
+static void restore_entry_free(struct RESTORE_ENTRY *r) {
+    free(r->path);
+    free(r->blob);
+    free(r->selabel);
+}
+
+static void restore_metadata(const struct RESTORE_ENTRY *r) {
+    chown(r->path, r->uid, r->gid);
+    chmod(r->path, r->mode);
+    if (lsetfilecon(r->path, r->selabel) < 0) {
+        fprintf(stderr, "Can't setfilecon %s\n", r->path);
+    }
+    if (r->has_times) {
+        struct timeval times[2];
+        times[0].tv_sec = r->atime;
+        times[0].tv_usec = 0;
+        times[1].tv_sec = r->mtime;
+        times[1].tv_usec = 0;
+        utimes(r->path, times);
+    }
+}
+
+// Concatenate the chunks of a chunked file.
+static int restore_chunks(const char *blob_dir, const struct RESTORE_ENTRY *r, char *buf, int len) {
+    char key[DEDUPE_KEY_LENGTH + 1];
+    char blob[PATH_MAX];
+    uint32_t i;
+    int ret = 0;
+
+    int dstfd = open(r->path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0)
+        return 4;
+    for (i = 0; i < r->chunk_count && ret == 0; i++) {
+        manifest_format_key(key, r->chunks[i].digest);
+        snprintf(blob, PATH_MAX, "%s/%s", blob_dir, key);
+        int srcfd = open(blob, O_RDONLY);
+        if (srcfd < 0) {
+            ret = 3;
+            break;
+        }
+        if (copy_fd(srcfd, dstfd, buf, len))
+            ret = 5;
+        close(srcfd);
+    }
+    if (close(dstfd) && ret == 0)
+        ret = 5;
+    return ret;
+}
+
+static void* restore_thread(void *cookie) {
+    struct RESTORE_CONTEXT *context = (struct RESTORE_CONTEXT*) cookie;
+    struct RESTORE_ENTRY job;
+    char *buf = malloc(RESTORE_BUFFER_SIZE);
+
+    pthread_mutex_lock(&context->lock);
+    for (;;) {
+        while (context->head == context->tail && !context->finished)
+            pthread_cond_wait(&context->cond, &context->lock);
+        if (context->head == context->tail)
+            break;
+        job = context->jobs[context->head++ % RESTORE_QUEUE_SIZE];
+        pthread_cond_broadcast(&context->cond);
+        int skip = context->error != 0;
+        pthread_mutex_unlock(&context->lock);
+
+        int ret = 0;
+        if (!skip) {
+            if (buf == NULL)
+                ret = 1;
+            else if ((ret = job.chunks != NULL ?
+                    restore_chunks(context->blob_dir, &job, buf, RESTORE_BUFFER_SIZE) :
+                    copy_file_buffer(job.blob, job.path, buf, RESTORE_BUFFER_SIZE)))
+                fprintf(stderr, "Unable to copy file %s\n", job.path);
+            else
+                restore_metadata(&job);
         }
+        restore_entry_free(&job);
 
-        array_add(arr, strdup(blob));
+        pthread_mutex_lock(&context->lock);
+        if (ret && !context->error)
+            context->error = ret;
     }
-    closedir(dp);
+    pthread_mutex_unlock(&context->lock);
+    free(buf);
+    return NULL;
 }
 
-static int check_file(const char* f) {
-    struct stat cst;
-    return lstat(f, &cst);
+// Takes ownership of the entry.
+static int restore_push(struct RESTORE_CONTEXT *context, struct RESTORE_ENTRY *r) {
+    pthread_mutex_lock(&context->lock);
+    while (context->tail - context->head == RESTORE_QUEUE_SIZE && !context->error)
+        pthread_cond_wait(&context->cond, &context->lock);
+    int ret = context->error;
+    if (ret == 0) {
+        context->jobs[context->tail++ % RESTORE_QUEUE_SIZE] = *r;
+        pthread_cond_broadcast(&context->cond);
+    }
+    pthread_mutex_unlock(&context->lock);
+    if (ret)
+        restore_entry_free(r);
+    return ret;
+}
+
+// Directories and symlinks are created as the manifest is walked, which
+// always lists a directory before anything in it, and file contents are
+// copied by a pool of workers. Directory ownership, mode and times are
+// applied last, deepest first, so files landing in them don't bump their
+// mtime and read only directories can still be filled.
+static int restore_tree(struct MANIFEST *m, const char *blob_dir) {
+    struct RESTORE_CONTEXT context;
+    pthread_t threads[INGEST_MAX_WORKERS];
+    struct RESTORE_ENTRY *dirs = NULL;
+    int dir_count = 0, dir_capacity = 0;
+    struct MANIFEST_ENTRY e;
+    int nworkers, i, ret = 0, next;
+
+    memset(&context, 0, sizeof(context));
+    context.blob_dir = blob_dir;
+    pthread_mutex_init(&context.lock, NULL);
+    pthread_cond_init(&context.cond, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = cpus < 1 ? 1 : (cpus > INGEST_MAX_WORKERS ? INGEST_MAX_WORKERS : cpus);
+    // copies mostly wait on storage, keep a few more in flight than cores
+    nworkers = nworkers * 2 > INGEST_MAX_WORKERS ? INGEST_MAX_WORKERS : nworkers * 2;
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&threads[i], NULL, restore_thread, &context))
+            break;
+    }
+    nworkers = i;
+    if (nworkers == 0) {
+        fprintf(stderr, "Unable to start restore threads\n");
+        ret = 1;
+    }
+
+    while (ret == 0 && (next = manifest_next(m, &e)) > 0) {
+        printf("%s\n", e.filename);
+        struct RESTORE_ENTRY r;
+        if (restore_entry_init(&r, &e, blob_dir)) {
+            fprintf(stderr, "Out of memory restoring %s\n", e.filename);
+            restore_entry_free(&r);
+            ret = 1;
+            break;
+        }
+
+        if (e.type == 'f') {
+            ret = restore_push(&context, &r);
+        }
+        else if (e.type == 'l') {
+            symlink(e.link, e.filename);
+
+            // Android has no lchmod, and chmod follows symlinks
+            lchown(e.filename, e.uid, e.gid);
+            if (lsetfilecon(e.filename, e.selabel) < 0) {
+                fprintf(stderr, "Can't setfilecon %s\n", e.filename);
+            }
+            restore_entry_free(&r);
+        }
+        else if (e.type == 'd') {
+            mkdir(e.filename, S_IRWXU);
+            if (dir_count == dir_capacity) {
+                int capacity = dir_capacity ? dir_capacity * 2 : 256;
+                struct RESTORE_ENTRY *grown = realloc(dirs, capacity * sizeof(struct RESTORE_ENTRY));
+                if (grown == NULL) {
+                    restore_entry_free(&r);
+                    ret = 1;
+                    break;
+                }
+                dirs = grown;
+                dir_capacity = capacity;
+            }
+            dirs[dir_count++] = r;
+        }
+        else {
+            fprintf(stderr, "Unknown type %c\n", e.type);
+            restore_entry_free(&r);
+            ret = 1;
+        }
+    }
+    if (ret == 0 && next < 0) {
+        fprintf(stderr, "Corrupt manifest\n");
+        ret = 1;
+    }
+
+    pthread_mutex_lock(&context.lock);
+    if (ret && !context.error)
+        context.error = ret;
+    context.finished = 1;
+    pthread_cond_broadcast(&context.cond);
+    pthread_mutex_unlock(&context.lock);
+    for (i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+    ret = context.error;
+    pthread_cond_destroy(&context.cond);
+    pthread_mutex_destroy(&context.lock);
+
+    for (i = dir_count - 1; i >= 0; i--) {
+        if (ret == 0)
+            restore_metadata(&dirs[i]);
+        restore_entry_free(&dirs[i]);
+    }
+    free(dirs);
+    return ret;
 }
 
 int dedupe_main(int argc, char** argv) {
@@ -363,6 +1468,12 @@ int dedupe_main(int argc, char** argv) {
     }
 
     if (strcmp(argv[1], "c") == 0) {
+        int chunked = 0;
+        if (argc > 2 && strcmp(argv[2], "-C") == 0) {
+            chunked = 1;
+            memmove(argv + 2, argv + 3, (argc - 3) * sizeof(char*));
+            argc--;
+        }
         if (argc < 5) {
             usage(argv);
             return 1;
@@ -381,19 +1492,39 @@ int dedupe_main(int argc, char** argv) {
         }
 
         struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
-        if (context.output_manifest == NULL) {
+        char previous_manifest[PATH_MAX];
+        context.cache = NULL;
+        context.chunked = chunked;
+        chunk_gear_init();
+        if (find_previous_manifest(argv[4], previous_manifest) == 0) {
+            context.cache = hash_cache_load(previous_manifest);
+            if (context.cache != NULL)
+                fprintf(stderr, "Reusing %d hashes from %s\n", context.cache->count, previous_manifest);
+        }
+
+        FILE *output_manifest = fopen(argv[4], "wb");
+        if (output_manifest == NULL) {
             fprintf(stderr, "Unable to open output file %s\n", argv[4]);
+            hash_cache_free(context.cache);
             return 1;
         }
+        manifest_writer_init(&context.output_manifest);
         mkdir(argv[3], S_IRWXU | S_IRWXG | S_IRWXO);
         realpath(argv[3], context.blob_dir);
         chdir(argv[2]);
-        context.excludes = argv + 5;
+        context.excludes = (const char **) (argv + 5);
         context.exclude_count = argc - 5;
 
-        return store_dir(&context, st, ".");
+        ret = store_tree(&context, st, ".");
+        if (ret == 0 && manifest_writer_finish(&context.output_manifest, output_manifest)) {
+            fprintf(stderr, "Error writing manifest %s\n", argv[4]);
+            ret = 1;
+        }
+        if (fclose(output_manifest) && ret == 0)
+            ret = 1;
+        manifest_writer_free(&context.output_manifest);
+        hash_cache_free(context.cache);
+        return ret;
     }
     else if (strcmp(argv[1], "x") == 0) {
         if (argc != 5) {
@@ -401,9 +1532,9 @@ int dedupe_main(int argc, char** argv) {
             return 1;
         }
 
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
+        struct MANIFEST input_manifest;
+        if (manifest_open(&input_manifest, argv[2])) {
+            fprintf(stderr, "Unable to open input manifest %s (or it is from a newer dedupe)\n", argv[2]);
             return 1;
         }
 
@@ -415,219 +1546,62 @@ int dedupe_main(int argc, char** argv) {
         mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
         if (chdir(output_dir)) {
             fprintf(stderr, "Unable to open output directory %s\n", output_dir);
+            manifest_close(&input_manifest);
             return 1;
         }
 
-        char line[PATH_MAX];
-        fgets(line, PATH_MAX, input_manifest);
-        int version = 1;
-        if (sscanf(line, "dedupe\t%d", &version) != 1) {
-            fseek(input_manifest, 0, SEEK_SET);
-        }
-        if (version > DEDUPE_VERSION) {
-            fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
+        int ret = restore_tree(&input_manifest, blob_dir);
+        manifest_close(&input_manifest);
+        return ret;
+    }
+    else if (strcmp(argv[1], "gc") == 0) {
+        if (argc < 3) {
+            usage(argv);
             return 1;
         }
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char selabel[PATH_MAX];
-            char at[32];
-            char mt[32];
-            char ct[32];
-            char filename[PATH_MAX];
-
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            token = tokenize(selabel, token, '\t');
-            if (version >= 2) {
-                token = tokenize(at, token, '\t');
-                token = tokenize(mt, token, '\t');
-                token = tokenize(ct, token, '\t');
-            }
-            token = tokenize(filename, token, '\t');
-
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            //printf("%s\t%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, selabel, filename);
-            printf("%s\n", filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                // printf("%s\t%d\n", sha256, size);
-
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                // printf("%s\n", link);
-
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                // printf("\n");
-
-                mkdir(filename, mode_oct);
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
+        
+        int dry_run = 0;
+        int force = 0;
+        int arg = 2;
+        for (; arg < argc && argv[arg][0] == '-'; arg++) {
+            if (strcmp(argv[arg], "-n") == 0)
+                dry_run = 1;
+            else if (strcmp(argv[arg], "-f") == 0)
+                force = 1;
             else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
+                usage(argv);
                 return 1;
             }
-            if (lsetfilecon(filename, selabel) < 0) {
-                fprintf(stderr, "Can't setfilecon %s\n", filename);
-            }
-            if (version >= 2) {
-                struct timeval times[2];
-                times[0].tv_sec = atol(at);
-                times[1].tv_sec = atol(mt);
-                utimes(filename, times);
-            }
         }
-
-        fclose(input_manifest);
-        return 0;
-    }
-    else if (strcmp(argv[1], "gc") == 0) {
-        if (argc < 3) {
+        if (arg >= argc) {
             usage(argv);
             return 1;
         }
-        
+
         char blob_dir[PATH_MAX];
-        realpath(argv[2], blob_dir);
+        realpath(argv[arg], blob_dir);
         if (check_file(blob_dir)) {
             fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
             return 1;
         }
 
-        struct array used_files;
-        struct array all_files;
-        array_init(&used_files, ARRAY_CAPACITY);
-        array_init(&all_files, ARRAY_CAPACITY);
-
-        char blob[PATH_MAX];
-        int i;
-        int failure = 0;
-        for (i = 3; i < argc; i++) {
-            FILE *input_manifest = fopen(argv[i], "rb");
-            if (input_manifest == NULL) {
-                fprintf(stderr, "Unable to open input manifest %s\n", argv[i]);
-                failure = 1;
-                goto out;
-            }
-
-            char line[PATH_MAX];
-            fgets(line, PATH_MAX, input_manifest);
-            int version = 1;
-            if (sscanf(line, "dedupe\t%d", &version) != 1) {
-                fseek(input_manifest, 0, SEEK_SET);
-            }
-            if (version > DEDUPE_VERSION) {
-                fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", argv[2]);
-                failure = 1;
-                fclose(input_manifest);
-                break;
-            }
-            while (fgets(line, PATH_MAX, input_manifest)) {
-                char type[4];
-                char mode[8];
-                char uid[32];
-                char gid[32];
-                char selabel[PATH_MAX];
-                char at[32];
-                char mt[32];
-                char ct[32];
-                char filename[PATH_MAX];
-
-                char *token = line;
-                token = tokenize(type, token, '\t');
-                token = tokenize(mode, token, '\t');
-                token = tokenize(uid, token, '\t');
-                token = tokenize(gid, token, '\t');
-                token = tokenize(selabel, token, '\t');
-                if (version >= 2) {
-                    token = tokenize(at, token, '\t');
-                    token = tokenize(mt, token, '\t');
-                    token = tokenize(ct, token, '\t');
-                }
-                token = tokenize(filename, token, '\t');
-
-                int mode_oct = dec_to_oct(atoi(mode));
-                int uid_int = atoi(uid);
-                int gid_int = atoi(gid);
-                int ret;
-                // printf("%s\n", filename);
-                if (strcmp(type, "f") == 0) {
-                    char key[128];
-                    token = tokenize(key, token, '\t');
-                    char sizeStr[32];
-                    token = tokenize(sizeStr, token, '\t');
-                    int size = atoi(sizeStr);
-
-                    sprintf(blob, "%s/%s", blob_dir, key);
-                    array_add(&used_files, strdup(blob));
-                }
-            }
-            fclose(input_manifest);
-        }
-
-        recursive_list_dir(blob_dir, &all_files);
-
-        qsort(used_files.data, used_files.size, sizeof(void*), string_compare);
-        qsort(all_files.data, all_files.size, sizeof(void*), string_compare);
-
-        // Search for unused files
-        int j = 0;
-        for (i = 0; i < all_files.size; i++) {
-            int cmp;
-            while (j < used_files.size &&
-                (cmp = strcmp(used_files.data[j], all_files.data[i])) < 0) {
-                j++;
-            }
-
-            if (cmp > 0 || j >= used_files.size) {
-                if (remove(all_files.data[i])) {
-                    fprintf(stderr, "Error removing: %s\n", all_files.data[i]);
-                }
-                printf("Delete: %s\n", all_files.data[i]);
-            }
+        struct DIGEST_SET used;
+        memset(&used, 0, sizeof(used));
+        int manifests = 0;
+        int failed = 0;
+        for (arg++; arg < argc; arg++)
+            failed += gc_mark(&used, argv[arg], &manifests);
+        printf("%d manifests reference %lu blobs\n", manifests, (unsigned long)(used.count + used.has_zero));
+
+        // blobs only referenced by an unreadable manifest must survive
+        if (failed && !force && !dry_run) {
+            fprintf(stderr, "%d manifests could not be read, only reporting unused blobs (use -f to remove anyway)\n", failed);
+            dry_run = 1;
         }
 
-        out:
-        array_free(&used_files, 1);
-        array_free(&all_files, 1);
-
-        return failure;
+        int ret = gc_sweep(blob_dir, &used, dry_run);
+        free(used.slots);
+        return ret || failed;
     }
     else {
         usage(argv);
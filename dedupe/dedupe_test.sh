@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# Host tests for dedupe.  Backs up trees with files that grow while
+# they are being ingested, with and without -C, and checks that the
+# manifests restore.  Takes the host dedupe binary as argument, e.g.
+#
+#   dedupe/dedupe_test.sh out/host/linux-x86/bin/dedupe
+
+DEDUPE=${1:-dedupe}
+
+# ------------------------
+
+tmpdir=$(mktemp -d)
+
+testname() {
+  echo
+  echo "$1"...
+  testname="$1"
+}
+
+fail() {
+  echo
+  echo FAIL: $testname
+  echo
+  [ "$appender" == "" ] || kill $appender 2>/dev/null
+  rm -rf $tmpdir
+  exit 1
+}
+
+# is $1 the start of $2?
+is_prefix() {
+  local n=$(stat -c %s $1)
+  [ $n -le $(stat -c %s $2) ] && cmp -s -n $n $1 $2
+}
+
+# back up $tmpdir/in with $1 while appending to in/grow, and restore it
+backup_growing() {
+  rm -rf $tmpdir/in $tmpdir/blobs $tmpdir/out $tmpdir/manifest
+  mkdir -p $tmpdir/in
+  # well past INGEST_BUFFER_SIZE, so the workers are still reading it
+  head -c $((64 * 1024 * 1024)) /dev/urandom > $tmpdir/in/grow
+  echo small > $tmpdir/in/small
+
+  (while true; do head -c 65536 /dev/urandom >> $tmpdir/in/grow; done) &
+  appender=$!
+  $DEDUPE c $1 $tmpdir/in $tmpdir/blobs $tmpdir/manifest > /dev/null
+  local ret=$?
+  kill $appender
+  wait $appender 2>/dev/null
+  appender=
+
+  # a file caught changing may fail the backup, but must never make a
+  # manifest that doesn't restore
+  [ $ret == 0 ] || return 0
+  $DEDUPE x $tmpdir/manifest $tmpdir/blobs $tmpdir/out > /dev/null || fail
+  is_prefix $tmpdir/out/grow $tmpdir/in/grow || fail
+  cmp -s $tmpdir/out/small $tmpdir/in/small || fail
+}
+
+testname "file growing while ingested whole"
+backup_growing ""
+
+testname "file growing while chunked"
+backup_growing -C
+
+testname "chunked backup reusing the hash cache"
+$DEDUPE c -C $tmpdir/in $tmpdir/blobs $tmpdir/manifest2 > /dev/null || fail
+rm -rf $tmpdir/out
+$DEDUPE x $tmpdir/manifest2 $tmpdir/blobs $tmpdir/out > /dev/null || fail
+cmp -s $tmpdir/out/grow $tmpdir/in/grow || fail
+
+# -----------------------
+
+echo
+echo PASS
+rm -rf $tmpdir
@@ -0,0 +1,457 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+#define MANIFEST_LINE_MAX (PATH_MAX * 3)
+#define MANIFEST_MAGIC "dedupe\t3\n"
+#define MANIFEST_MAGIC_CHUNKED "dedupe\t4\n"
+
+void manifest_format_key(char *key, const unsigned char *digest) {
+    static const char hex[] = "0123456789abcdef";
+    int i, j = 0;
+    // if a hash is abcdefg,
+    // the output blob name is abc/defg
+    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        key[j++] = hex[digest[i] >> 4];
+        if (j == 3)
+            key[j++] = '/';
+        key[j++] = hex[digest[i] & 0xf];
+    }
+    key[j] = '\0';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int manifest_parse_key(unsigned char *digest, const char *key) {
+    int i = 0;
+    int high = -1;
+    for (; *key; key++) {
+        if (*key == '/')
+            continue;
+        int v = hex_value(*key);
+        if (v < 0 || i == SHA256_DIGEST_LENGTH)
+            return 1;
+        if (high < 0) {
+            high = v;
+        } else {
+            digest[i++] = (high << 4) | v;
+            high = -1;
+        }
+    }
+    return i != SHA256_DIGEST_LENGTH || high >= 0;
+}
+
+// Split a manifest line in place on tabs, returns the number of fields.
+static int split_fields(char *line, char **fields, int max) {
+    int count = 0;
+    while (count < max) {
+        fields[count++] = line;
+        char *sep = strchr(line, '\t');
+        if (sep == NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            break;
+        }
+        *sep = '\0';
+        line = sep + 1;
+    }
+    return count;
+}
+
+static int manifest_open_binary(struct MANIFEST *m, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct dedupe_header)) {
+        close(fd);
+        return 1;
+    }
+    m->map_size = st.st_size;
+    m->map = mmap(NULL, m->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m->map == MAP_FAILED) {
+        m->map = NULL;
+        return 1;
+    }
+    madvise(m->map, m->map_size, MADV_SEQUENTIAL);
+
+    const struct dedupe_header *h = (const struct dedupe_header*) m->map;
+    uint64_t size = m->map_size;
+    uint64_t chunks_offset = h->keys_offset + (uint64_t) h->key_count * SHA256_DIGEST_LENGTH;
+    const char *magic = m->version >= 4 ? MANIFEST_MAGIC_CHUNKED : MANIFEST_MAGIC;
+    if (memcmp(h->magic, magic, strlen(magic)) != 0 ||
+            (m->version < 4 && h->chunk_count != 0) ||
+            h->record_size != sizeof(struct dedupe_record) ||
+            h->records_offset > size ||
+            (size - h->records_offset) / sizeof(struct dedupe_record) < h->record_count ||
+            h->keys_offset > size ||
+            (size - h->keys_offset) / SHA256_DIGEST_LENGTH < h->key_count ||
+            h->strings_offset > size ||
+            h->strings_offset < chunks_offset ||
+            (h->strings_offset - chunks_offset) / sizeof(struct dedupe_chunk) < h->chunk_count ||
+            size - h->strings_offset < h->strings_size ||
+            h->strings_size == 0 ||
+            m->map[h->strings_offset + h->strings_size - 1] != '\0') {
+        munmap(m->map, m->map_size);
+        m->map = NULL;
+        return 1;
+    }
+    m->header = h;
+    m->strings = (const char*) m->map + h->strings_offset;
+    m->chunks = (const struct dedupe_chunk*) (m->map + chunks_offset);
+    m->next = 0;
+    return 0;
+}
+
+int manifest_open(struct MANIFEST *m, const char *path) {
+    memset(m, 0, sizeof(*m));
+    m->file = fopen(path, "rb");
+    if (m->file == NULL)
+        return 1;
+    m->line = malloc(MANIFEST_LINE_MAX);
+    if (m->line == NULL) {
+        manifest_close(m);
+        return 1;
+    }
+
+    m->version = 1;
+    if (fgets(m->line, MANIFEST_LINE_MAX, m->file) == NULL ||
+            sscanf(m->line, "dedupe\t%d", &m->version) != 1) {
+        fseek(m->file, 0, SEEK_SET);
+    }
+    if (m->version < 1 || m->version > DEDUPE_VERSION) {
+        manifest_close(m);
+        return 1;
+    }
+
+    if (m->version >= 3) {
+        fclose(m->file);
+        m->file = NULL;
+        free(m->line);
+        m->line = NULL;
+        if (manifest_open_binary(m, path)) {
+            manifest_close(m);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int manifest_next_text(struct MANIFEST *m, struct MANIFEST_ENTRY *entry) {
+    char *fields[16];
+    int count, i = 0;
+
+    if (fgets(m->line, MANIFEST_LINE_MAX, m->file) == NULL)
+        return 0;
+
+    count = split_fields(m->line, fields, 16);
+    if (count < (m->version >= 2 ? 9 : 6) || strlen(fields[0]) != 1)
+        return -1;
+
+    entry->type = fields[i++][0];
+    entry->mode = strtoul(fields[i++], NULL, 8);
+    entry->uid = strtoul(fields[i++], NULL, 10);
+    entry->gid = strtoul(fields[i++], NULL, 10);
+    entry->selabel = fields[i++];
+    entry->has_times = m->version >= 2;
+    if (entry->has_times) {
+        entry->atime = strtoul(fields[i++], NULL, 10);
+        entry->mtime = strtoul(fields[i++], NULL, 10);
+        entry->ctime = strtoul(fields[i++], NULL, 10);
+    }
+    entry->filename = fields[i++];
+    entry->link = NULL;
+    entry->has_ino = 0;
+    entry->chunks = NULL;
+    entry->chunk_count = 0;
+
+    if (entry->type == 'f') {
+        if (count < i + 2 || strlen(fields[i]) != DEDUPE_KEY_LENGTH)
+            return -1;
+        strcpy(entry->key, fields[i]);
+        if (manifest_parse_key(entry->digest, fields[i++]))
+            return -1;
+        entry->size = strtoull(fields[i++], NULL, 10);
+        if (count > i && fields[i][0] != '\0') {
+            entry->has_ino = 1;
+            entry->ino = strtoul(fields[i], NULL, 10);
+        }
+    } else if (entry->type == 'l') {
+        if (count < i + 1)
+            return -1;
+        entry->link = fields[i];
+    }
+    return 1;
+}
+
+static int manifest_next_binary(struct MANIFEST *m, struct MANIFEST_ENTRY *entry) {
+    const struct dedupe_header *h = m->header;
+    if (m->next >= h->record_count)
+        return 0;
+
+    const struct dedupe_record *r = (const struct dedupe_record*) (m->map + h->records_offset) + m->next++;
+    if (r->selabel >= h->strings_size || r->path >= h->strings_size || r->link >= h->strings_size)
+        return -1;
+
+    entry->type = r->type;
+    entry->mode = r->mode;
+    entry->uid = r->uid;
+    entry->gid = r->gid;
+    entry->selabel = m->strings + r->selabel;
+    entry->has_times = 1;
+    entry->atime = r->atime;
+    entry->mtime = r->mtime;
+    entry->ctime = r->ctime;
+    entry->filename = m->strings + r->path;
+    entry->link = NULL;
+    entry->has_ino = 0;
+    entry->chunks = NULL;
+    entry->chunk_count = 0;
+
+    if (entry->type == 'f') {
+        memcpy(entry->digest, r->digest, SHA256_DIGEST_LENGTH);
+        manifest_format_key(entry->key, r->digest);
+        entry->size = r->size;
+        entry->has_ino = 1;
+        entry->ino = r->ino;
+        if (r->flags & DEDUPE_RECORD_CHUNKED) {
+            uint64_t total = 0;
+            uint32_t i;
+            if (r->chunk > h->chunk_count)
+                return -1;
+            for (i = r->chunk; total < r->size && i < h->chunk_count; i++)
+                total += m->chunks[i].size;
+            if (total != r->size)
+                return -1;
+            entry->chunks = m->chunks + r->chunk;
+            entry->chunk_count = i - r->chunk;
+        }
+    } else if (entry->type == 'l') {
+        entry->link = m->strings + r->link;
+    }
+    return 1;
+}
+
+int manifest_next(struct MANIFEST *m, struct MANIFEST_ENTRY *entry) {
+    if (m->version >= 3)
+        return manifest_next_binary(m, entry);
+    return manifest_next_text(m, entry);
+}
+
+const unsigned char* manifest_keys(struct MANIFEST *m, uint32_t *count) {
+    if (m->version < 3)
+        return NULL;
+    *count = m->header->key_count;
+    return m->map + m->header->keys_offset;
+}
+
+void manifest_close(struct MANIFEST *m) {
+    if (m->file != NULL)
+        fclose(m->file);
+    free(m->line);
+    if (m->map != NULL)
+        munmap(m->map, m->map_size);
+    memset(m, 0, sizeof(*m));
+}
+
+void manifest_writer_init(struct MANIFEST_WRITER *w) {
+    memset(w, 0, sizeof(*w));
+}
+
+static unsigned int hash_string(const char *s) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    while (*s) {
+        hash ^= (unsigned char) *s++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int add_string(struct MANIFEST_WRITER *w, const char *s, uint32_t *offset) {
+    uint32_t len = strlen(s) + 1;
+    while (w->strings_size + len > w->strings_capacity) {
+        uint32_t capacity = w->strings_capacity ? w->strings_capacity * 2 : 64 * 1024;
+        char *strings = realloc(w->strings, capacity);
+        if (strings == NULL)
+            return 1;
+        w->strings = strings;
+        w->strings_capacity = capacity;
+    }
+    memcpy(w->strings + w->strings_size, s, len);
+    *offset = w->strings_size;
+    w->strings_size += len;
+    return 0;
+}
+
+static int add_label(struct MANIFEST_WRITER *w, const char *label, uint32_t *offset) {
+    uint32_t i;
+    if (w->label_capacity == 0) {
+        w->label_capacity = 4096;
+        w->labels = calloc(w->label_capacity, sizeof(uint32_t));
+        if (w->labels == NULL)
+            return 1;
+    }
+
+    // open addressing, slots hold offset + 1
+    uint32_t mask = w->label_capacity - 1;
+    uint32_t slot = hash_string(label) & mask;
+    for (i = 0; i < w->label_capacity; i++, slot = (slot + 1) & mask) {
+        if (w->labels[slot] == 0)
+            break;
+        if (strcmp(w->strings + w->labels[slot] - 1, label) == 0) {
+            *offset = w->labels[slot] - 1;
+            return 0;
+        }
+    }
+    if (i == w->label_capacity) {
+        // more distinct labels than slots; just store it again
+        return add_string(w, label, offset);
+    }
+    if (add_string(w, label, offset))
+        return 1;
+    w->labels[slot] = *offset + 1;
+    return 0;
+}
+
+static int add_chunks(struct MANIFEST_WRITER *w, const struct dedupe_chunk *chunks, uint32_t count, uint32_t *first) {
+    while (w->chunk_count + count > w->chunk_capacity) {
+        uint32_t capacity = w->chunk_capacity ? w->chunk_capacity * 2 : 1024;
+        struct dedupe_chunk *grown = realloc(w->chunks, capacity * sizeof(struct dedupe_chunk));
+        if (grown == NULL)
+            return 1;
+        w->chunks = grown;
+        w->chunk_capacity = capacity;
+    }
+    memcpy(w->chunks + w->chunk_count, chunks, count * sizeof(struct dedupe_chunk));
+    *first = w->chunk_count;
+    w->chunk_count += count;
+    return 0;
+}
+
+int manifest_writer_add(struct MANIFEST_WRITER *w, char type, const struct stat *st, const char *selabel,
+                        const char *path, const unsigned char *digest, const char *link,
+                        const struct dedupe_chunk *chunks, uint32_t chunk_count) {
+    if (w->record_count == w->record_capacity) {
+        uint32_t capacity = w->record_capacity ? w->record_capacity * 2 : 1024;
+        struct dedupe_record *records = realloc(w->records, capacity * sizeof(struct dedupe_record));
+        if (records == NULL)
+            return 1;
+        w->records = records;
+        w->record_capacity = capacity;
+    }
+
+    struct dedupe_record *r = &w->records[w->record_count];
+    memset(r, 0, sizeof(*r));
+    r->type = type;
+    r->mode = st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID);
+    r->uid = st->st_uid;
+    r->gid = st->st_gid;
+    r->atime = st->st_atime;
+    r->mtime = st->st_mtime;
+    r->ctime = st->st_ctime;
+    if (add_label(w, selabel, &r->selabel) || add_string(w, path, &r->path))
+        return 1;
+    if (type == 'f') {
+        r->size = st->st_size;
+        r->ino = st->st_ino;
+        memcpy(r->digest, digest, SHA256_DIGEST_LENGTH);
+        if (chunks != NULL) {
+            r->flags |= DEDUPE_RECORD_CHUNKED;
+            if (add_chunks(w, chunks, chunk_count, &r->chunk))
+                return 1;
+        }
+    } else if (type == 'l') {
+        if (add_string(w, link, &r->link))
+            return 1;
+    }
+    w->record_count++;
+    return 0;
+}
+
+static int digest_compare(const void *a, const void *b) {
+    return memcmp(a, b, SHA256_DIGEST_LENGTH);
+}
+
+int manifest_writer_finish(struct MANIFEST_WRITER *w, FILE *out) {
+    struct dedupe_header h;
+    uint32_t i, key_count = 0;
+    int ret = 0;
+
+    // chunked files reference their chunks, not a blob of the whole file
+    unsigned char *keys = malloc(((size_t) w->record_count + w->chunk_count + 1) * SHA256_DIGEST_LENGTH);
+    if (keys == NULL)
+        return 1;
+    for (i = 0; i < w->record_count; i++) {
+        if (w->records[i].type == 'f' && !(w->records[i].flags & DEDUPE_RECORD_CHUNKED))
+            memcpy(keys + key_count++ * SHA256_DIGEST_LENGTH, w->records[i].digest, SHA256_DIGEST_LENGTH);
+    }
+    for (i = 0; i < w->chunk_count; i++)
+        memcpy(keys + key_count++ * SHA256_DIGEST_LENGTH, w->chunks[i].digest, SHA256_DIGEST_LENGTH);
+    qsort(keys, key_count, SHA256_DIGEST_LENGTH, digest_compare);
+    uint32_t unique = 0;
+    for (i = 0; i < key_count; i++) {
+        if (unique > 0 && memcmp(keys + (unique - 1) * SHA256_DIGEST_LENGTH,
+                                 keys + i * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH) == 0)
+            continue;
+        memmove(keys + unique++ * SHA256_DIGEST_LENGTH, keys + i * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+    }
+
+    // an empty string at offset 0 keeps every string offset valid
+    if (w->strings_size == 0) {
+        uint32_t offset;
+        if (add_string(w, "", &offset)) {
+            free(keys);
+            return 1;
+        }
+    }
+
+    memset(&h, 0, sizeof(h));
+    const char *magic = w->chunk_count ? MANIFEST_MAGIC_CHUNKED : MANIFEST_MAGIC;
+    memcpy(h.magic, magic, strlen(magic));
+    h.record_size = sizeof(struct dedupe_record);
+    h.record_count = w->record_count;
+    h.key_count = unique;
+    h.chunk_count = w->chunk_count;
+    h.records_offset = sizeof(h);
+    h.keys_offset = h.records_offset + (uint64_t) w->record_count * sizeof(struct dedupe_record);
+    h.strings_offset = h.keys_offset + (uint64_t) unique * SHA256_DIGEST_LENGTH +
+                       (uint64_t) w->chunk_count * sizeof(struct dedupe_chunk);
+    h.strings_size = w->strings_size;
+
+    if (fwrite(&h, sizeof(h), 1, out) != 1 ||
+            fwrite(w->records, sizeof(struct dedupe_record), w->record_count, out) != w->record_count ||
+            fwrite(keys, SHA256_DIGEST_LENGTH, unique, out) != unique ||
+            fwrite(w->chunks, sizeof(struct dedupe_chunk), w->chunk_count, out) != w->chunk_count ||
+            fwrite(w->strings, 1, w->strings_size, out) != w->strings_size)
+        ret = 1;
+
+    free(keys);
+    return ret;
+}
+
+void manifest_writer_free(struct MANIFEST_WRITER *w) {
+    free(w->records);
+    free(w->strings);
+    free(w->chunks);
+    free(w->labels);
+    memset(w, 0, sizeof(*w));
+}
@@ -0,0 +1,147 @@
+#ifndef DEDUPE_MANIFEST_H
+#define DEDUPE_MANIFEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#define DEDUPE_VERSION 4
+
+// blob keys are the hex sha256 split as abc/defg...
+#define DEDUPE_KEY_LENGTH (SHA256_DIGEST_LENGTH * 2 + 1)
+
+/*
+ * Version 3 and 4 manifests are binary, little endian:
+ *
+ *   dedupe_header      magic starts with "dedupe\t3\n" so older dedupe
+ *                      binaries refuse it like any newer text manifest
+ *   dedupe_record[]    one per entry, in directory walk order
+ *   digest[]           sorted, unique sha256 of every referenced blob
+ *   dedupe_chunk[]     version 4 only, see below
+ *   string table       NUL terminated paths, selabels and link targets
+ *
+ * Version 4 adds chunked files: their content is stored as a run of blobs
+ * (chunks) instead of a single one. The record's digest is still the
+ * sha256 of the whole file, and its chunks are the entries of the chunk
+ * table starting at record.chunk whose sizes add up to the file size.
+ * Manifests without chunked files are still written as version 3.
+ *
+ * The whole file is mmap()ed on read and entries point into the mapping.
+ */
+struct dedupe_header {
+    char magic[16];
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t key_count;
+    uint32_t chunk_count;
+    uint64_t records_offset;
+    uint64_t keys_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+#define DEDUPE_RECORD_CHUNKED 1
+
+struct dedupe_record {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t reserved[2];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t selabel;
+    uint32_t path;
+    uint32_t link;
+    uint32_t chunk;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint64_t size;
+    uint64_t ino;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+};
+
+struct dedupe_chunk {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    uint64_t size;
+};
+
+struct MANIFEST_ENTRY {
+    char type;              // 'f', 'd' or 'l'
+    unsigned int mode;
+    unsigned long uid;
+    unsigned long gid;
+    const char *selabel;
+    int has_times;          // version 1 manifests carry no times
+    unsigned long atime;
+    unsigned long mtime;
+    unsigned long ctime;
+    const char *filename;
+
+    // regular files
+    char key[DEDUPE_KEY_LENGTH + 1];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned long long size;
+    int has_ino;
+    unsigned long ino;
+    // chunked files, NULL when the whole file is the blob named by key
+    const struct dedupe_chunk *chunks;
+    uint32_t chunk_count;
+
+    // symlinks
+    const char *link;
+};
+
+struct MANIFEST {
+    int version;
+
+    // versions 1 and 2
+    FILE *file;
+    char *line;
+
+    // version 3
+    unsigned char *map;
+    size_t map_size;
+    const struct dedupe_header *header;
+    const char *strings;
+    const struct dedupe_chunk *chunks;
+    uint32_t next;
+};
+
+struct MANIFEST_WRITER {
+    struct dedupe_record *records;
+    uint32_t record_count;
+    uint32_t record_capacity;
+    char *strings;
+    uint32_t strings_size;
+    uint32_t strings_capacity;
+    struct dedupe_chunk *chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    // selabels repeat a lot, so they are stored once
+    uint32_t *labels;
+    uint32_t label_capacity;
+};
+
+void manifest_format_key(char *key, const unsigned char *digest);
+int manifest_parse_key(unsigned char *digest, const char *key);
+
+// Returns 0 on success. Versions 1 to DEDUPE_VERSION are accepted.
+int manifest_open(struct MANIFEST *m, const char *path);
+// Returns 1 and fills entry, 0 at the end of the manifest, -1 if it is corrupt.
+// Strings in entry stay valid until the next call.
+int manifest_next(struct MANIFEST *m, struct MANIFEST_ENTRY *entry);
+// The sorted digests of all blobs a binary manifest references, or NULL.
+const unsigned char* manifest_keys(struct MANIFEST *m, uint32_t *count);
+void manifest_close(struct MANIFEST *m);
+
+void manifest_writer_init(struct MANIFEST_WRITER *w);
+// chunks may be NULL for a file stored as a single blob.
+int manifest_writer_add(struct MANIFEST_WRITER *w, char type, const struct stat *st, const char *selabel,
+                        const char *path, const unsigned char *digest, const char *link,
+                        const struct dedupe_chunk *chunks, uint32_t chunk_count);
+int manifest_writer_finish(struct MANIFEST_WRITER *w, FILE *out);
+void manifest_writer_free(struct MANIFEST_WRITER *w);
+
+#endif
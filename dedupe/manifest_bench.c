@@ -0,0 +1,133 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+// Writes the same synthetic tree as a version 2 text manifest and a version 3
+// binary manifest, then times a full parse of each and the blob key scan gc does.
+
+static long long now_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void fake_entry(int i, struct stat *st, char *path, unsigned char *digest) {
+    int j;
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0644;
+    st->st_uid = 10000 + i % 200;
+    st->st_gid = st->st_uid;
+    st->st_atime = st->st_mtime = st->st_ctime = 1400000000 + i;
+    st->st_size = 4096 + i % 65536;
+    st->st_ino = 100000 + i;
+    sprintf(path, "./data/app%d/files/cache/entry%d.dat", i % 500, i);
+    // one in four files shares its content with another
+    unsigned int seed = (i % 4 == 0 ? i / 4 : i) * 2654435761u;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++) {
+        seed = seed * 1103515245 + 12345;
+        digest[j] = seed >> 16;
+    }
+}
+
+static int write_manifests(const char *text, const char *binary, int count) {
+    struct MANIFEST_WRITER w;
+    struct stat st;
+    char path[PATH_MAX];
+    char key[DEDUPE_KEY_LENGTH + 1];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int i;
+
+    FILE *t = fopen(text, "wb");
+    FILE *b = fopen(binary, "wb");
+    if (t == NULL || b == NULL)
+        return 1;
+    manifest_writer_init(&w);
+    fprintf(t, "dedupe\t2\n");
+    for (i = 0; i < count; i++) {
+        fake_entry(i, &st, path, digest);
+        manifest_format_key(key, digest);
+        fprintf(t, "f\t%o\t%d\t%d\tu:object_r:app_data_file:s0\t%lu\t%lu\t%lu\t%s\t%s\t%d\t%lu\t\n",
+                st.st_mode & 07777, (int) st.st_uid, (int) st.st_gid,
+                (unsigned long) st.st_atime, (unsigned long) st.st_mtime, (unsigned long) st.st_ctime,
+                path, key, (int) st.st_size, (unsigned long) st.st_ino);
+        if (manifest_writer_add(&w, 'f', &st, "u:object_r:app_data_file:s0", path, digest, NULL, NULL, 0))
+            return 1;
+    }
+    int ret = manifest_writer_finish(&w, b);
+    manifest_writer_free(&w);
+    if (fclose(t) || fclose(b))
+        ret = 1;
+    return ret;
+}
+
+static long long time_parse(const char *path, int *entries) {
+    struct MANIFEST m;
+    struct MANIFEST_ENTRY e;
+    long long start = now_us();
+    *entries = 0;
+    if (manifest_open(&m, path))
+        return -1;
+    while (manifest_next(&m, &e) > 0)
+        (*entries)++;
+    manifest_close(&m);
+    return now_us() - start;
+}
+
+static long long time_keys(const char *path, int *keys) {
+    struct MANIFEST m;
+    struct MANIFEST_ENTRY e;
+    uint32_t count;
+    long long start = now_us();
+    *keys = 0;
+    if (manifest_open(&m, path))
+        return -1;
+    if (manifest_keys(&m, &count) != NULL) {
+        *keys = count;
+    } else {
+        while (manifest_next(&m, &e) > 0)
+            if (e.type == 'f')
+                (*keys)++;
+    }
+    manifest_close(&m);
+    return now_us() - start;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 500000;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    char text[PATH_MAX];
+    char binary[PATH_MAX];
+    struct stat st;
+    int n;
+
+    snprintf(text, sizeof(text), "%s/manifest_bench.v2", dir);
+    snprintf(binary, sizeof(binary), "%s/manifest_bench.v3", dir);
+    if (write_manifests(text, binary, count)) {
+        fprintf(stderr, "Unable to write manifests to %s\n", dir);
+        return 1;
+    }
+
+    stat(text, &st);
+    printf("v2 text:   %lld bytes\n", (long long) st.st_size);
+    stat(binary, &st);
+    printf("v3 binary: %lld bytes\n", (long long) st.st_size);
+
+    long long us = time_parse(text, &n);
+    printf("v2 parse: %lld us (%d entries)\n", us, n);
+    us = time_parse(binary, &n);
+    printf("v3 parse: %lld us (%d entries)\n", us, n);
+    us = time_keys(text, &n);
+    printf("v2 keys:  %lld us (%d keys)\n", us, n);
+    us = time_keys(binary, &n);
+    printf("v3 keys:  %lld us (%d unique keys)\n", us, n);
+
+    unlink(text);
+    unlink(binary);
+    return 0;
+}
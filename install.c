@@ -32,6 +32,9 @@
 #include "mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
+#include "update_binary_probe.h"
+#include "update_progress.h"
+#include "updater/progress.h"
 #include "verifier.h"
 #include "recovery_ui.h"
 
@@ -44,6 +47,8 @@
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 #define PUBLIC_KEYS_FILE "/res/keys"
 
+extern UIParameters ui_parameters;    // from ui.c
+
 // The update binary ask us to install a firmware file on reboot.  Set
 // that up.  Takes ownership of type and filename.
 static int
@@ -145,6 +150,28 @@ static int unset_legacy_props() {
     return 0;
 }
 
+typedef struct {
+    int fd;
+    UpdateBinaryProbe* probe;
+} ProbingWriter;
+
+// Writes the update binary out while the probe looks it over.
+static bool
+probe_and_write(const unsigned char* data, int len, void* cookie) {
+    ProbingWriter* writer = (ProbingWriter*) cookie;
+    update_binary_probe_feed(writer->probe, data, len);
+    while (len > 0) {
+        ssize_t written = write(writer->fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
 try_update_binary(const char *path, ZipArchive *zip) {
@@ -173,20 +200,12 @@ try_update_binary(const char *path, ZipArchive *zip) {
 
     char* binary = "/tmp/update_binary";
     unlink(binary);
-    int fd = creat(binary, 0755);
+    int fd = open(binary, O_RDWR | O_CREAT | O_TRUNC, 0755);
     if (fd < 0) {
         mzCloseZipArchive(zip);
         LOGE("Can't make %s\n", binary);
         return 1;
     }
-    bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
-    close(fd);
-
-    if (!ok) {
-        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
-        mzCloseZipArchive(zip);
-        return 1;
-    }
 
     /* Make sure the update binary is compatible with this recovery
      *
@@ -196,46 +215,37 @@ try_update_binary(const char *path, ZipArchive *zip) {
      * one. If "set_metadata_" isn't there, it's pre-4.4, which
      * makes it incompatible.
      *
-     * Also, I hate matching strings in binary blobs */
-
-    FILE *updaterfile = fopen(binary, "rb");
-    char tmpbuf;
-    char setpermmatch[9] = { 's','e','t','_','p','e','r','m','_' };
-    char setmetamatch[13] = { 's','e','t','_','m','e','t','a','d','a','t','a','_' };
-    size_t pos = 0;
-    bool foundsetperm = false;
-    bool foundsetmeta = false;
-
-    if (updaterfile == NULL) {
-        LOGE("Can't find %s for validation\n", ASSUMED_UPDATE_BINARY_NAME);
+     * The probe looks at the bytes as they are extracted. */
+    UpdateBinaryProbe probe;
+    update_binary_probe_init(&probe);
+    ProbingWriter writer = { fd, &probe };
+    bool ok = mzProcessZipEntryContents(zip, binary_entry, probe_and_write,
+                                        &writer);
+    if (ok) {
+        update_binary_probe_finish(&probe, fd);
+    }
+    if (close(fd) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
+        mzCloseZipArchive(zip);
         return 1;
     }
-    fseek(updaterfile, 0, SEEK_SET);
-    while (!feof(updaterfile)) {
-        fread(&tmpbuf, 1, 1, updaterfile);
-        if (!foundsetperm && pos < sizeof(setpermmatch) && tmpbuf == setpermmatch[pos]) {
-            pos++;
-            if (pos == sizeof(setpermmatch)) {
-                foundsetperm = true;
-                pos = 0;
-            }
-            continue;
-        }
-        if (!foundsetmeta && tmpbuf == setmetamatch[pos]) {
-            pos++;
-            if (pos == sizeof(setmetamatch)) {
-                foundsetmeta = true;
-                pos = 0;
-            }
-            continue;
-        }
-        /* None of the match loops got a continuation, reset the counter */
-        pos = 0;
+
+    if (probe.api_from_note) {
+        LOGI("update-binary built for API level %d\n", probe.api_level);
+    } else if (probe.api_level > 0) {
+        LOGI("update-binary from API level %d or later\n", probe.api_level);
+    } else if (probe.has_set_perm) {
+        LOGI("update-binary from before API level 19\n");
+    } else {
+        LOGI("update-binary API level unknown\n");
     }
-    fclose(updaterfile);
 
     /* Set legacy properties */
-    if (foundsetperm && !foundsetmeta) {
+    if (update_binary_needs_legacy_props(&probe)) {
         LOGI("Using legacy property environment for update-binary...\n");
         if (set_legacy_props() != 0) {
             LOGE("Legacy property environment did not init successfully. Properties may not be detected.\n");
@@ -278,6 +288,9 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //        ui_print <string>
     //            display <string> on the screen.
     //
+    //     or, if it finds UPDATER_PROGRESS_PROTOCOL in its environment,
+    //     the same commands as binary frames (see updater/progress.h).
+    //
     //   - the name of the package zip file.
     //
 
@@ -292,6 +305,7 @@ try_update_binary(const char *path, ZipArchive *zip) {
     pid_t pid = fork();
     if (pid == 0) {
         setenv("UPDATE_PACKAGE", path, 1);
+        setenv(UPDATER_PROGRESS_ENV, EXPAND(UPDATER_PROGRESS_PROTOCOL), 1);
         close(pipefd[0]);
         execve(binary, args, environ);
         fprintf(stdout, "E:Can't run %s (%s)\n", binary, strerror(errno));
@@ -299,52 +313,11 @@ try_update_binary(const char *path, ZipArchive *zip) {
     }
     close(pipefd[1]);
 
-    char* firmware_type = NULL;
-    char* firmware_filename = NULL;
-
-    char buffer[1024];
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
-
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
-
-            ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
-                             seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui_set_progress(fraction);
-        } else if (strcmp(command, "firmware") == 0) {
-            char* type = strtok(NULL, " \n");
-            char* filename = strtok(NULL, " \n");
-
-            if (type != NULL && filename != NULL) {
-                if (firmware_type != NULL) {
-                    LOGE("ignoring attempt to do multiple firmware updates");
-                } else {
-                    firmware_type = strdup(type);
-                    firmware_filename = strdup(filename);
-                }
-            }
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str) {
-                ui_print("%s", str);
-            } else {
-                ui_print("\n");
-            }
-        } else {
-            LOGE("unknown command [%s]\n", command);
-        }
-    }
-    fclose(from_child);
+    char* firmware_type;
+    char* firmware_filename;
+    update_progress_read(pipefd[0], ui_parameters.update_fps,
+                         &firmware_type, &firmware_filename);
+    close(pipefd[0]);
 
     int status;
     waitpid(pid, &status, 0);
@@ -411,11 +384,28 @@ really_install_package(const char *path)
 
     int err;
 
+    // The package is mapped once: the signature is checked over the
+    // mapping and the same mapping is handed to the zip parser, so
+    // large packages aren't read from storage twice.
+    MemMapping map;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return INSTALL_CORRUPT;
+    }
+    if (sysMapFileInShmem(fd, &map) != 0) {
+        LOGE("Can't map %s\n", path);
+        close(fd);
+        return INSTALL_CORRUPT;
+    }
+
     if (signature_check_enabled) {
         int numKeys;
         Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
         if (loadedKeys == NULL) {
             LOGE("Failed to load keys\n");
+            sysReleaseShmem(&map);
+            close(fd);
             return INSTALL_CORRUPT;
         }
         LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
@@ -426,23 +416,28 @@ really_install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
+        err = verify_mapped(map.addr, map.length, loadedKeys, numKeys);
         free(loadedKeys);
-        LOGI("verify_file returned %d\n", err);
+        LOGI("verify_mapped returned %d\n", err);
         if (err != VERIFY_SUCCESS) {
             LOGE("signature verification failed\n");
             ui_show_text(1);
-            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip"))
+            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip")) {
+                sysReleaseShmem(&map);
+                close(fd);
                 return INSTALL_CORRUPT;
+            }
         }
     }
 
     /* Try to open the package.
      */
     ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
+    err = mzOpenZipArchiveMapped(fd, &map, &zip);
     if (err != 0) {
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        sysReleaseShmem(&map);
+        close(fd);
         return INSTALL_CORRUPT;
     }
 
@@ -3,11 +3,14 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := events.c resources.c
 ifneq ($(BOARD_CUSTOM_GRAPHICS),)
-  LOCAL_SRC_FILES += $(BOARD_CUSTOM_GRAPHICS)
+  LOCAL_SRC_FILES += $(BOARD_CUSTOM_GRAPHICS) graphics_noclip.c
 else
-  LOCAL_SRC_FILES += graphics.c graphics_overlay.c
+  LOCAL_SRC_FILES += graphics.c graphics_overlay.c graphics_native.c
 endif
 
+# graphics_native.c relies on the compiler vectorizing its row loops
+LOCAL_CFLAGS += -ftree-vectorize
+
 LOCAL_C_INCLUDES +=\
     external/libpng\
     external/zlib
@@ -55,3 +58,35 @@ ifeq ($(TARGET_PREBUILT_KERNEL),)
 endif
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := graphics_bench.c
+
+LOCAL_MODULE := minui_graphics_bench
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libminui libpixelflinger_static libpng libz libcutils liblog libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := res_bundle.c resources.c
+
+LOCAL_MODULE := minui_res_bundle
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_C_INCLUDES +=\
+    external/libpng\
+    external/zlib
+
+LOCAL_STATIC_LIBRARIES := libpng libz
+
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -16,6 +16,7 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <errno.h>
@@ -37,6 +38,7 @@
 #include "font_10x18.h"
 #endif
 
+#include "graphics_native.h"
 #include "minui.h"
 
 #if defined(RECOVERY_BGRA)
@@ -75,6 +77,16 @@ static int overscan_offset_y = 0;
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
+/* rows of gr_mem_surface each framebuffer hasn't been given yet, [top, bottom) */
+static int stale_top[NUM_BUFFERS];
+static int stale_bottom[NUM_BUFFERS];
+/* area drawing is limited to, see gr_clip() */
+static NativeRect clip_rect;
+
+/* draw with graphics_native.c where it can, see gr_init() */
+static int native_backend = 0;
+static unsigned char gr_current_color[4];
+
 static struct fb_var_screeninfo vi;
 static struct fb_fix_screeninfo fi;
 
@@ -276,6 +288,50 @@ static void set_active_framebuffer(unsigned n)
     }
 }
 
+/* Notes that rows y1 to y2 of gr_mem_surface (overscan included) changed. */
+static void gr_damage(int y1, int y2)
+{
+    int i;
+    if (y1 < clip_rect.top) y1 = clip_rect.top;
+    if (y2 > clip_rect.bottom) y2 = clip_rect.bottom;
+    if (y1 >= y2)
+        return;
+    for (i = 0; i < NUM_BUFFERS; i++) {
+        if (stale_top[i] >= stale_bottom[i]) {
+            stale_top[i] = y1;
+            stale_bottom[i] = y2;
+        } else {
+            if (y1 < stale_top[i]) stale_top[i] = y1;
+            if (y2 > stale_bottom[i]) stale_bottom[i] = y2;
+        }
+    }
+}
+
+void gr_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+
+    x += overscan_offset_x;
+    y += overscan_offset_y;
+
+    clip_rect.left = x < 0 ? 0 : x;
+    clip_rect.top = y < 0 ? 0 : y;
+    clip_rect.right = x + w > (int) vi.xres ? (int) vi.xres : x + w;
+    clip_rect.bottom = y + h > (int) vi.yres ? (int) vi.yres : y + h;
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
+}
+
+void gr_noclip(void)
+{
+    GGLContext *gl = gr_context;
+
+    clip_rect.left = clip_rect.top = 0;
+    clip_rect.right = vi.xres;
+    clip_rect.bottom = vi.yres;
+    gl->disable(gl, GGL_SCISSOR_TEST);
+}
+
 void gr_flip(void)
 {
     if (has_overlay) {
@@ -290,14 +346,23 @@ void gr_flip(void)
     } else {
         GGLContext *gl = gr_context;
 
+        /* nothing drawn since the displayed buffer was filled */
+        if (stale_top[gr_active_fb] >= stale_bottom[gr_active_fb])
+            return;
+
         /* swap front and back buffers */
         if (double_buffering)
             gr_active_fb = (gr_active_fb + 1) & 1;
 
-        /* copy data from the in-memory surface to the buffer we're about
-         * to make active. */
-        memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-               fi.line_length * vi.yres);
+        /* copy the rows the buffer we're about to make active is missing
+         * from the in-memory surface; with double buffering, that is what
+         * was drawn for this frame and the one before. */
+        int top = stale_top[gr_active_fb];
+        int bottom = stale_bottom[gr_active_fb];
+        memcpy((char*) gr_framebuffer[gr_active_fb].data + top * fi.line_length,
+               (char*) gr_mem_surface.data + top * fi.line_length,
+               (bottom - top) * fi.line_length);
+        stale_top[gr_active_fb] = stale_bottom[gr_active_fb] = 0;
 
         /* inform the display driver */
         set_active_framebuffer(gr_active_fb);
@@ -313,6 +378,10 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+    gr_current_color[0] = r;
+    gr_current_color[1] = g;
+    gr_current_color[2] = b;
+    gr_current_color[3] = a;
 }
 
 int gr_measure(const char *s)
@@ -336,6 +405,10 @@ int gr_text(int x, int y, const char *s, int bold)
     y += overscan_offset_y;
 
     y -= font->ascent;
+    gr_damage(y, y + font->cheight);
+
+    if (native_backend && native_text_draw(&clip_rect, x, y, s, gr_current_color) == 0)
+        return x + font->cwidth * strlen(s);
 
     gl->bindTexture(gl, &font->texture);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
@@ -364,15 +437,19 @@ void gr_texticon(int x, int y, gr_surface icon) {
     x += overscan_offset_x;
     y += overscan_offset_y;
 
+    int w = gr_get_width(icon);
+    int h = gr_get_height(icon);
+    gr_damage(y, y + h);
+
+    if (native_backend && native_blit(&clip_rect, (GGLSurface*) icon, 0, 0, w, h, x, y) == 0)
+        return;
+
     gl->bindTexture(gl, (GGLSurface*) icon);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->enable(gl, GGL_TEXTURE_2D);
 
-    int w = gr_get_width(icon);
-    int h = gr_get_height(icon);
-
     gl->texCoord2i(gl, -x, -y);
     gl->recti(gl, x, y, x+gr_get_width(icon), y+gr_get_height(icon));
 }
@@ -386,6 +463,13 @@ void gr_fill(int x1, int y1, int x2, int y2)
     y2 += overscan_offset_y;
 
     GGLContext *gl = gr_context;
+    gr_damage(y1, y2);
+
+    if (native_backend) {
+        native_fill(&clip_rect, x1, y1, x2, y2, gr_current_color);
+        return;
+    }
+
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x1, y1, x2, y2);
 }
@@ -399,6 +483,11 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     dx += overscan_offset_x;
     dy += overscan_offset_y;
 
+    gr_damage(dy, dy + h);
+
+    if (native_backend && native_blit(&clip_rect, (GGLSurface*) source, sx, sy, w, h, dx, dy) == 0)
+        return;
+
     gl->bindTexture(gl, (GGLSurface*) source);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -476,8 +565,28 @@ int gr_init(void)
 
     get_memory_surface(&gr_mem_surface);
 
-    fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
-            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
+    /* the framebuffers are cleared, gr_mem_surface isn't */
+    int i;
+    for (i = 0; i < NUM_BUFFERS; i++) {
+        stale_top[i] = 0;
+        stale_bottom[i] = vi.yres;
+    }
+    clip_rect.left = clip_rect.top = 0;
+    clip_rect.right = vi.xres;
+    clip_rect.bottom = vi.yres;
+
+    /* pixelflinger is still there for anything the native backend can't
+     * draw, or for all of it with MINUI_BACKEND=pixelflinger */
+    const char* backend = getenv("MINUI_BACKEND");
+    native_backend = (backend == NULL || strcmp(backend, "pixelflinger") != 0) &&
+            native_init(&gr_mem_surface) == 0;
+    if (native_backend && native_init_font(&gr_font->texture, gr_font->cwidth,
+                                           gr_font->cheight) != 0)
+        fprintf(stderr, "font can't be drawn natively\n");
+
+    fprintf(stderr, "framebuffer: fd %d (%d x %d), %s backend\n",
+            gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height,
+            native_backend ? "native" : "pixelflinger");
 
     /* start with 0 as front (displayed) and 1 as back (drawing) */
     gr_active_fb = 0;
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures minui drawing with the native backend and with pixelflinger,
+// on the device's framebuffer (stop recovery first):
+//
+//   - glyphs/s: screens full of log text, no flips,
+//   - redraws/s: what ui.c draws for a full frame with the log shown
+//     (tiled background, icon, progress bar, menu highlight, text),
+//     flip included.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "minui.h"
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// An image like the ones res_create_surface() loads.
+static gr_surface make_surface(int width, int height, int format) {
+    GGLSurface* surface = malloc(sizeof(GGLSurface) + width * height * 4);
+    unsigned char* data = (unsigned char*) (surface + 1);
+    int i;
+    surface->version = sizeof(GGLSurface);
+    surface->width = width;
+    surface->height = height;
+    surface->stride = width;
+    surface->data = data;
+    surface->format = format;
+    for (i = 0; i < width * height; ++i) {
+        data[4*i] = i * 7;
+        data[4*i+1] = i * 13;
+        data[4*i+2] = i * 29;
+        data[4*i+3] = format == GGL_PIXEL_FORMAT_RGBA_8888 ? (i % 5) * 63 : 255;
+    }
+    return (gr_surface) surface;
+}
+
+static void run(int seconds) {
+    static const char line[] =
+        "I:Backing up /system/app/SomeApplication.apk  /data/data/com.example";
+    gr_surface stitch = make_surface(128, 128, GGL_PIXEL_FORMAT_RGBX_8888);
+    gr_surface icon = make_surface(240, 240, GGL_PIXEL_FORMAT_RGBA_8888);
+    gr_surface progress = make_surface(400, 24, GGL_PIXEL_FORMAT_RGBX_8888);
+    int width = gr_fb_width();
+    int height = gr_fb_height();
+    int cw, ch;
+    gr_font_size(&cw, &ch);
+    int rows = height / ch;
+    int cols = width / cw;
+    char text[256];
+    snprintf(text, sizeof(text), "%.*s", cols < 255 ? cols : 255, line);
+    int glyphs_per_row = strlen(text);
+
+    // glyphs
+    long glyphs = 0;
+    double start = now(), elapsed;
+    do {
+        int r;
+        gr_color(255, 255, 255, 255);
+        for (r = 0; r < rows; ++r) {
+            gr_text(0, (r+1)*ch-1, text, 0);
+        }
+        glyphs += rows * glyphs_per_row;
+    } while ((elapsed = now() - start) < seconds);
+    printf("  %10.0f glyphs/s\n", glyphs / elapsed);
+
+    // full frames
+    long frames = 0;
+    start = now();
+    do {
+        int x, y, r;
+        for (y = 0; y < height; y += 128) {
+            for (x = 0; x < width; x += 128) {
+                gr_blit(stitch, 0, 0, 128, 128, x, y);
+            }
+        }
+        gr_blit(icon, 0, 0, 240, 240, (width - 240) / 2, (height - 240) / 2);
+        gr_blit(progress, 0, 0, 400, 24, (width - 400) / 2, height * 3 / 4);
+        gr_color(0, 191, 255, 127);
+        gr_fill(0, 3 * ch, width, 4 * ch + 1);
+        gr_color(255, 255, 255, 255);
+        for (r = 0; r < rows; ++r) {
+            gr_text(0, (r+1)*ch-1, text, 0);
+        }
+        gr_flip();
+        frames++;
+    } while ((elapsed = now() - start) < seconds);
+    printf("  %10.1f redraws/s\n", frames / elapsed);
+
+    free(stitch);
+    free(icon);
+    free(progress);
+}
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 3;
+    static const char* backends[] = { "native", "pixelflinger" };
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        setenv("MINUI_BACKEND", backends[i], 1);
+        if (gr_init() != 0) {
+            fprintf(stderr, "gr_init failed\n");
+            return 1;
+        }
+        printf("%s, %d x %d:\n", backends[i], gr_fb_width(), gr_fb_height());
+        run(seconds);
+        gr_exit();
+    }
+    return 0;
+}
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graphics_native.h"
+
+/*
+ * The row loops below are kept simple (one store per pixel, no calls,
+ * __restrict pointers) so the compiler turns them into NEON or SSE code
+ * with -ftree-vectorize; see Android.mk.
+ */
+
+static GGLSurface *dst;
+static int dst_bpp;
+// where red and blue go in a 32bpp pixel; green is always bits 8-15
+static int rshift, bshift;
+
+typedef struct {
+    unsigned char row;
+    unsigned char x;
+    unsigned char len;
+} GlyphSpan;
+
+static GlyphSpan *glyph_spans;
+static int glyph_first[97];     // first span of each glyph, 96 glyphs from ' '
+static int glyph_width;
+
+int native_init(GGLSurface *surface)
+{
+    switch (surface->format) {
+        case GGL_PIXEL_FORMAT_RGB_565:
+            dst_bpp = 16;
+            break;
+        case GGL_PIXEL_FORMAT_RGBX_8888:
+        case GGL_PIXEL_FORMAT_RGBA_8888:
+            dst_bpp = 32;
+            rshift = 0;
+            bshift = 16;
+            break;
+        case GGL_PIXEL_FORMAT_BGRA_8888:
+            dst_bpp = 32;
+            rshift = 16;
+            bshift = 0;
+            break;
+        default:
+            return -1;
+    }
+    dst = surface;
+    return 0;
+}
+
+int native_init_font(const GGLSurface *texture, unsigned cwidth, unsigned cheight)
+{
+    const unsigned char *bits = texture->data;
+    unsigned g, y, x;
+    int count = 0, capacity = 256;
+
+    if (texture->format != GGL_PIXEL_FORMAT_A_8 || cwidth > 255 || cheight > 255 ||
+            texture->width < 96 * cwidth || texture->height < cheight)
+        return -1;
+
+    free(glyph_spans);
+    glyph_spans = malloc(capacity * sizeof(GlyphSpan));
+    if (glyph_spans == NULL)
+        return -1;
+
+    for (g = 0; g < 96; g++) {
+        glyph_first[g] = count;
+        for (y = 0; y < cheight; y++) {
+            const unsigned char *row = bits + y * texture->stride + g * cwidth;
+            for (x = 0; x < cwidth; ) {
+                if (row[x] == 0) {
+                    x++;
+                    continue;
+                }
+                unsigned start = x;
+                while (x < cwidth && row[x] == 255)
+                    x++;
+                if (x == start) {
+                    // antialiased; leave it to pixelflinger
+                    free(glyph_spans);
+                    glyph_spans = NULL;
+                    return -1;
+                }
+                if (count == capacity) {
+                    capacity *= 2;
+                    GlyphSpan *spans = realloc(glyph_spans, capacity * sizeof(GlyphSpan));
+                    if (spans == NULL) {
+                        free(glyph_spans);
+                        glyph_spans = NULL;
+                        return -1;
+                    }
+                    glyph_spans = spans;
+                }
+                glyph_spans[count].row = y;
+                glyph_spans[count].x = start;
+                glyph_spans[count].len = x - start;
+                count++;
+            }
+        }
+    }
+    glyph_first[96] = count;
+    glyph_width = cwidth;
+    return 0;
+}
+
+static inline uint16_t pack565(unsigned r, unsigned g, unsigned b)
+{
+    return ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+}
+
+static inline uint32_t pack32(unsigned r, unsigned g, unsigned b)
+{
+    return (r << rshift) | (g << 8) | (b << bshift) | 0xff000000;
+}
+
+// s * a + d * (1 - a), rounded, for 8-bit values
+static inline unsigned mix(unsigned s, unsigned d, unsigned a)
+{
+    unsigned t = s * a + d * (255 - a) + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void fill_row16(uint16_t *__restrict p, int n, uint16_t v)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        p[i] = v;
+}
+
+static void fill_row32(uint32_t *__restrict p, int n, uint32_t v)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        p[i] = v;
+}
+
+static void blend_row16(uint16_t *__restrict p, int n, unsigned r, unsigned g, unsigned b,
+                        unsigned a)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        unsigned v = p[i];
+        unsigned dr = (v >> 8) & 0xf8, dg = (v >> 3) & 0xfc, db = (v << 3) & 0xf8;
+        dr |= dr >> 5;
+        dg |= dg >> 6;
+        db |= db >> 5;
+        p[i] = pack565(mix(r, dr, a), mix(g, dg, a), mix(b, db, a));
+    }
+}
+
+static void blend_row32(uint32_t *__restrict p, int n, unsigned r, unsigned g, unsigned b,
+                        unsigned a)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        uint32_t v = p[i];
+        p[i] = pack32(mix(r, (v >> rshift) & 0xff, a), mix(g, (v >> 8) & 0xff, a),
+                      mix(b, (v >> bshift) & 0xff, a));
+    }
+}
+
+static void *pixel(int x, int y)
+{
+    return (char *) dst->data + (y * dst->stride + x) * (dst_bpp / 8);
+}
+
+// Solid or blended rectangle, already clipped.
+static void fill_rect(int x1, int y1, int x2, int y2, unsigned r, unsigned g, unsigned b,
+                      unsigned a)
+{
+    int y, n = x2 - x1;
+    if (n <= 0 || a == 0)
+        return;
+    if (dst_bpp == 16) {
+        uint16_t v = pack565(r, g, b);
+        for (y = y1; y < y2; y++) {
+            if (a == 255)
+                fill_row16(pixel(x1, y), n, v);
+            else
+                blend_row16(pixel(x1, y), n, r, g, b, a);
+        }
+    } else {
+        uint32_t v = pack32(r, g, b);
+        for (y = y1; y < y2; y++) {
+            if (a == 255)
+                fill_row32(pixel(x1, y), n, v);
+            else
+                blend_row32(pixel(x1, y), n, r, g, b, a);
+        }
+    }
+}
+
+void native_fill(const NativeRect *clip, int x1, int y1, int x2, int y2,
+                 const unsigned char *rgba)
+{
+    if (x1 < clip->left) x1 = clip->left;
+    if (y1 < clip->top) y1 = clip->top;
+    if (x2 > clip->right) x2 = clip->right;
+    if (y2 > clip->bottom) y2 = clip->bottom;
+    if (y1 >= y2)
+        return;
+    fill_rect(x1, y1, x2, y2, rgba[0], rgba[1], rgba[2], rgba[3]);
+}
+
+int native_text_draw(const NativeRect *clip, int x, int y, const char *s,
+                     const unsigned char *rgba)
+{
+    unsigned off;
+
+    if (glyph_spans == NULL)
+        return -1;
+
+    // glyph pixels are opaque: GGL_REPLACE takes alpha from the font
+    for (; (off = (unsigned char) *s) != 0; s++, x += glyph_width) {
+        off -= 32;
+        if (off >= 96 || x >= clip->right || x + glyph_width <= clip->left)
+            continue;
+        int i;
+        for (i = glyph_first[off]; i < glyph_first[off + 1]; i++) {
+            const GlyphSpan *span = &glyph_spans[i];
+            int yy = y + span->row;
+            if (yy < clip->top || yy >= clip->bottom)
+                continue;
+            int x1 = x + span->x;
+            int x2 = x1 + span->len;
+            if (x1 < clip->left) x1 = clip->left;
+            if (x2 > clip->right) x2 = clip->right;
+            fill_rect(x1, yy, x2, yy + 1, rgba[0], rgba[1], rgba[2], 255);
+        }
+    }
+    return 0;
+}
+
+static void copy_row16(uint16_t *__restrict d, const unsigned char *__restrict s, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        d[i] = pack565(s[4 * i], s[4 * i + 1], s[4 * i + 2]);
+}
+
+static void copy_row32(uint32_t *__restrict d, const unsigned char *__restrict s, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        d[i] = pack32(s[4 * i], s[4 * i + 1], s[4 * i + 2]);
+}
+
+static void blend_image_row16(uint16_t *__restrict d, const unsigned char *__restrict s, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        unsigned a = s[4 * i + 3];
+        if (a == 255) {
+            d[i] = pack565(s[4 * i], s[4 * i + 1], s[4 * i + 2]);
+        } else if (a != 0) {
+            blend_row16(&d[i], 1, s[4 * i], s[4 * i + 1], s[4 * i + 2], a);
+        }
+    }
+}
+
+static void blend_image_row32(uint32_t *__restrict d, const unsigned char *__restrict s, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        unsigned a = s[4 * i + 3];
+        if (a == 255) {
+            d[i] = pack32(s[4 * i], s[4 * i + 1], s[4 * i + 2]);
+        } else if (a != 0) {
+            blend_row32(&d[i], 1, s[4 * i], s[4 * i + 1], s[4 * i + 2], a);
+        }
+    }
+}
+
+int native_blit(const NativeRect *clip, const GGLSurface *source,
+                int sx, int sy, int w, int h, int dx, int dy)
+{
+    int y;
+    int opaque;
+
+    if (source->format == GGL_PIXEL_FORMAT_RGBX_8888)
+        opaque = 1;
+    else if (source->format == GGL_PIXEL_FORMAT_RGBA_8888)
+        opaque = 0;
+    else
+        return -1;
+    // pixelflinger would wrap around; the UI never asks for that
+    if (sx < 0 || sy < 0 || w < 0 || h < 0 ||
+            sx + w > (int) source->width || sy + h > (int) source->height)
+        return -1;
+
+    if (dx < clip->left) {
+        sx += clip->left - dx;
+        w -= clip->left - dx;
+        dx = clip->left;
+    }
+    if (dy < clip->top) {
+        sy += clip->top - dy;
+        h -= clip->top - dy;
+        dy = clip->top;
+    }
+    if (dx + w > clip->right) w = clip->right - dx;
+    if (dy + h > clip->bottom) h = clip->bottom - dy;
+    if (w <= 0 || h <= 0)
+        return 0;
+
+    for (y = 0; y < h; y++) {
+        const unsigned char *s = (const unsigned char *) source->data +
+                ((sy + y) * source->stride + sx) * 4;
+        if (dst_bpp == 16) {
+            if (opaque)
+                copy_row16(pixel(dx, dy + y), s, w);
+            else
+                blend_image_row16(pixel(dx, dy + y), s, w);
+        } else {
+            if (opaque)
+                copy_row32(pixel(dx, dy + y), s, w);
+            else
+                blend_image_row32(pixel(dx, dy + y), s, w);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_GRAPHICS_NATIVE_H_
+#define _MINUI_GRAPHICS_NATIVE_H_
+
+#include <pixelflinger/pixelflinger.h>
+
+/*
+ * Drawing straight into gr_mem_surface, for what the recovery UI draws
+ * all the time: solid and translucent fills, text in one color, and
+ * RGBX/RGBA images.  Pixelflinger sets up texture and blending state for
+ * every rectangle, every glyph included; these loops don't.
+ *
+ * Each call draws what pixelflinger would with the state gr_init() sets
+ * up (GGL_REPLACE, SRC_ALPHA / ONE_MINUS_SRC_ALPHA blending), limited to
+ * clip.  The *_draw calls return -1 for anything they don't handle, and
+ * the caller falls back to pixelflinger.
+ */
+
+typedef struct {
+    int left, top, right, bottom;
+} NativeRect;
+
+// Returns 0 if surface (the in-memory surface) has a format the native
+// backend can draw to.
+int native_init(GGLSurface *surface);
+// Turns an A_8 font texture, its glyphs side by side, into the spans
+// native_text_draw() fills.
+int native_init_font(const GGLSurface *texture, unsigned cwidth, unsigned cheight);
+
+void native_fill(const NativeRect *clip, int x1, int y1, int x2, int y2,
+                 const unsigned char *rgba);
+int native_text_draw(const NativeRect *clip, int x, int y, const char *s,
+                     const unsigned char *rgba);
+int native_blit(const NativeRect *clip, const GGLSurface *source,
+                int sx, int sy, int w, int h, int dx, int dy);
+
+#endif
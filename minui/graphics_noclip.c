@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Built instead of graphics.c's clipping for BOARD_CUSTOM_GRAPHICS, which
+// predate gr_clip().  Without it, a clipped redraw simply redraws the
+// whole screen and gr_flip() shows all of it, as it always has.
+
+#include "minui.h"
+
+void gr_clip(int x, int y, int w, int h)
+{
+}
+
+void gr_noclip(void)
+{
+}
@@ -38,6 +38,12 @@ int gr_measure(const char *s);
 void gr_font_size(int *x, int *y);
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
+
+// Limit drawing to a rectangle, to repaint only what changed.  gr_flip()
+// only copies the rows drawn to since the last flip.  Both are hints: with
+// BOARD_CUSTOM_GRAPHICS, drawing isn't clipped and every flip is whole.
+void gr_clip(int x, int y, int w, int h);
+void gr_noclip(void);
 unsigned int gr_get_width(gr_surface surface);
 unsigned int gr_get_height(gr_surface surface);
 
@@ -76,6 +82,12 @@ int res_create_surface(const char* name, gr_surface* pSurface);
 static inline int res_create_display_surface(const char* name, gr_surface* pSurface) {
     return res_create_surface(name, pSurface);
 }
+// Loads count images, names[i] into *surfaces[i], like
+// res_create_surface() would one by one, with results[i] what it would
+// return.  Images not in /res/images.bundle are decoded in parallel.
+// Returns how many came from the bundle.
+int res_create_surfaces(int count, const char* const* names, gr_surface* const* surfaces,
+                        int* results);
 void res_free_surface(gr_surface surface);
 
 #endif
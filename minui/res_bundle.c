@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Builds images.bundle (see res_bundle.h) from the PNGs in a directory.
+//
+//   minui_res_bundle <images dir> <output>
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "res_bundle.h"
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static int write_padding(FILE* f, long to) {
+    while (ftell(f) < to) {
+        if (fputc(0, f) == EOF)
+            return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <images dir> <output>\n", argv[0]);
+        return 2;
+    }
+    const char* dir = argv[1];
+    const char* output = argv[2];
+
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "can't open %s\n", dir);
+        return 1;
+    }
+    char** names = NULL;
+    int count = 0, capacity = 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len <= 4 || strcmp(de->d_name + len - 4, ".png") != 0)
+            continue;
+        if (len - 4 >= sizeof(((ResBundleEntry*) 0)->name)) {
+            fprintf(stderr, "skipping %s: name too long\n", de->d_name);
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            names = realloc(names, capacity * sizeof(char*));
+            if (names == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        names[count] = strndup(de->d_name, len - 4);
+        count++;
+    }
+    closedir(d);
+    // res_create_surface() looks names up with bsearch()
+    qsort(names, count, sizeof(char*), compare_names);
+
+    ResBundleEntry* entries = calloc(count ? count : 1, sizeof(ResBundleEntry));
+    gr_surface* surfaces = calloc(count ? count : 1, sizeof(gr_surface));
+    if (entries == NULL || surfaces == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    int i, kept = 0;
+    for (i = 0; i < count; ++i) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s.png", dir, names[i]);
+        ResBundleEntry* entry = &entries[kept];
+        int result = res_decode_png(path, &surfaces[kept]);
+        if (result < 0) {
+            // recovery will report it when it tries the PNG itself
+            fprintf(stderr, "skipping %s: can't decode (%d)\n", path, result);
+            continue;
+        }
+        if (res_png_checksum(path, &entry->png_size, &entry->png_crc) != 0) {
+            fprintf(stderr, "can't read %s\n", path);
+            return 1;
+        }
+        GGLSurface* surface = (GGLSurface*) surfaces[kept];
+        strcpy(entry->name, names[i]);
+        entry->width = surface->width;
+        entry->height = surface->height;
+        entry->format = surface->format;
+        kept++;
+    }
+
+    long offset = sizeof(ResBundleHeader) + kept * sizeof(ResBundleEntry);
+    for (i = 0; i < kept; ++i) {
+        offset = (offset + 15) & ~15L;
+        entries[i].offset = offset;
+        offset += (long) entries[i].width * entries[i].height * 4;
+    }
+
+    FILE* f = fopen(output, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "can't create %s\n", output);
+        return 1;
+    }
+    ResBundleHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RES_BUNDLE_MAGIC, sizeof(header.magic));
+    header.count = kept;
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(entries, sizeof(ResBundleEntry), kept, f) == (size_t) kept;
+    for (i = 0; ok && i < kept; ++i) {
+        GGLSurface* surface = (GGLSurface*) surfaces[i];
+        ok = write_padding(f, entries[i].offset) == 0 &&
+             fwrite(surface->data, surface->width * 4, surface->height, f) == surface->height;
+        res_free_surface(surfaces[i]);
+    }
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "can't write %s\n", output);
+        unlink(output);
+        return 1;
+    }
+
+    printf("%s: %d images, %ld bytes\n", output, kept, offset);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_RES_BUNDLE_H_
+#define _MINUI_RES_BUNDLE_H_
+
+#include <stdint.h>
+
+#include "minui.h"
+
+/*
+ * /res/images.bundle holds the images of /res/images already decoded, as
+ * the surfaces res_create_surface() would make of them (RGBX_8888 or
+ * RGBA_8888, stride == width), so recovery can map them instead of running
+ * libpng on every start.  minui_res_bundle builds it at build time:
+ *
+ *   ResBundleHeader
+ *   ResBundleEntry[count]      sorted by name
+ *   pixels                     each image at its offset, 16-byte aligned
+ *
+ * Every entry keeps the size and CRC-32 of the PNG it came from; an image
+ * whose PNG no longer matches (a device overriding it, say) is decoded
+ * from the PNG as before.  Fields are in the byte order of the device,
+ * which is little-endian on everything recovery runs on.
+ */
+#define RES_BUNDLE_PATH "/res/images.bundle"
+#define RES_BUNDLE_MAGIC "MRESBDL1"
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+} ResBundleHeader;
+
+typedef struct {
+    char name[48];              // without ".png", NUL-terminated
+    uint32_t png_size;
+    uint32_t png_crc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;            // GGL_PIXEL_FORMAT_RGBX_8888 or _RGBA_8888
+    uint32_t offset;            // of the pixels, from the start of the file
+} ResBundleEntry;
+
+// Decodes the PNG at path into a surface, as res_create_surface() does
+// without a bundle.  Returns 0 if no error, else negative.
+int res_decode_png(const char* path, gr_surface* pSurface);
+
+// Size and CRC-32 of the file at path, as stored in the bundle.  Returns
+// 0 if no error.
+int res_png_checksum(const char* path, uint32_t* size, uint32_t* crc);
+
+#endif
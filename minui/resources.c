@@ -15,13 +15,16 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -30,8 +33,10 @@
 #include <pixelflinger/pixelflinger.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "minui.h"
+#include "res_bundle.h"
 
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
@@ -41,8 +46,7 @@ double pow(double x, double y) {
     return x;
 }
 
-int res_create_surface(const char* name, gr_surface* pSurface) {
-    char resPath[256];
+int res_decode_png(const char* path, gr_surface* pSurface) {
     GGLSurface* surface = NULL;
     int result = 0;
     unsigned char header[8];
@@ -51,9 +55,7 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
 
     *pSurface = NULL;
 
-    snprintf(resPath, sizeof(resPath)-1, "/res/images/%s.png", name);
-    resPath[sizeof(resPath)-1] = '\0';
-    FILE* fp = fopen(resPath, "rb");
+    FILE* fp = fopen(path, "rb");
     if (fp == NULL) {
         result = -1;
         goto exit;
@@ -103,7 +105,7 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
           ((channels == 3 && color_type == PNG_COLOR_TYPE_RGB) ||
            (channels == 4 && color_type == PNG_COLOR_TYPE_RGBA) ||
            (channels == 1 && color_type == PNG_COLOR_TYPE_PALETTE)))) {
-        return -7;
+        result = -7;
         goto exit;
     }
 
@@ -173,6 +175,180 @@ exit:
     return result;
 }
 
+int res_png_checksum(const char* path, uint32_t* size, uint32_t* crc) {
+    unsigned char buf[16384];
+    ssize_t n;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    *size = 0;
+    *crc = crc32(0L, Z_NULL, 0);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        *size += n;
+        *crc = crc32(*crc, buf, n);
+    }
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+// images.bundle, mapped once and for good; surfaces point into it
+static pthread_once_t bundle_once = PTHREAD_ONCE_INIT;
+static const unsigned char* bundle = NULL;
+static size_t bundle_size = 0;
+static const ResBundleEntry* bundle_entries = NULL;
+static uint32_t bundle_count = 0;
+
+static void load_bundle(void) {
+    struct stat st;
+    int fd = open(RES_BUNDLE_PATH, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(ResBundleHeader)) {
+        close(fd);
+        return;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "can't map %s\n", RES_BUNDLE_PATH);
+        return;
+    }
+
+    const ResBundleHeader* header = map;
+    size_t size = st.st_size;
+    if (memcmp(header->magic, RES_BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->count > (size - sizeof(ResBundleHeader)) / sizeof(ResBundleEntry)) {
+        fprintf(stderr, "%s is damaged, ignoring it\n", RES_BUNDLE_PATH);
+        munmap(map, size);
+        return;
+    }
+    bundle = map;
+    bundle_size = size;
+    bundle_entries = (const ResBundleEntry*) (header + 1);
+    bundle_count = header->count;
+}
+
+static int compare_entry(const void* name, const void* entry) {
+    return strncmp(name, ((const ResBundleEntry*) entry)->name,
+                   sizeof(((const ResBundleEntry*) entry)->name));
+}
+
+// Like res_create_surface(), from the bundle.  Returns 0 if the bundle
+// has an up to date copy of the image at path.
+static int surface_from_bundle(const char* name, const char* path, gr_surface* pSurface) {
+    pthread_once(&bundle_once, load_bundle);
+    if (bundle == NULL)
+        return -1;
+
+    const ResBundleEntry* entry = bsearch(name, bundle_entries, bundle_count,
+                                          sizeof(ResBundleEntry), compare_entry);
+    if (entry == NULL)
+        return -1;
+
+    size_t pixelSize = (size_t) entry->width * entry->height * 4;
+    if ((entry->format != GGL_PIXEL_FORMAT_RGBX_8888 &&
+         entry->format != GGL_PIXEL_FORMAT_RGBA_8888) ||
+            entry->width > 16384 || entry->height > 16384 ||
+            entry->offset % 4 != 0 || entry->offset > bundle_size ||
+            pixelSize > bundle_size - entry->offset) {
+        fprintf(stderr, "bad entry for %s in %s\n", name, RES_BUNDLE_PATH);
+        return -1;
+    }
+
+    uint32_t png_size, png_crc;
+    if (res_png_checksum(path, &png_size, &png_crc) != 0 ||
+            png_size != entry->png_size || png_crc != entry->png_crc) {
+        fprintf(stderr, "%s changed since %s was built\n", path, RES_BUNDLE_PATH);
+        return -1;
+    }
+
+    GGLSurface* surface = malloc(sizeof(GGLSurface));
+    if (surface == NULL)
+        return -1;
+    surface->version = sizeof(GGLSurface);
+    surface->width = entry->width;
+    surface->height = entry->height;
+    surface->stride = entry->width;
+    // read-only: nothing draws into images
+    surface->data = (void*) (bundle + entry->offset);
+    surface->format = entry->format;
+    *pSurface = (gr_surface) surface;
+    return 0;
+}
+
+static void res_path(char* path, size_t size, const char* name) {
+    snprintf(path, size, "/res/images/%s.png", name);
+}
+
+int res_create_surface(const char* name, gr_surface* pSurface) {
+    char resPath[256];
+
+    res_path(resPath, sizeof(resPath), name);
+    if (surface_from_bundle(name, resPath, pSurface) == 0)
+        return 0;
+    return res_decode_png(resPath, pSurface);
+}
+
+typedef struct {
+    int count;
+    const char* const* names;
+    gr_surface* const* surfaces;
+    int* results;
+    int next;
+} DecodeJob;
+
+#define DECODE_PENDING 1
+#define MAX_DECODE_THREADS 4
+
+static void* decode_thread(void* cookie) {
+    DecodeJob* job = cookie;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+        if (job->results[i] != DECODE_PENDING)
+            continue;
+        char resPath[256];
+        res_path(resPath, sizeof(resPath), job->names[i]);
+        job->results[i] = res_decode_png(resPath, job->surfaces[i]);
+    }
+    return NULL;
+}
+
+int res_create_surfaces(int count, const char* const* names, gr_surface* const* surfaces,
+                        int* results) {
+    DecodeJob job = { count, names, surfaces, results, 0 };
+    pthread_t threads[MAX_DECODE_THREADS - 1];
+    int i, pending = 0, started = 0;
+
+    for (i = 0; i < count; ++i) {
+        char resPath[256];
+        res_path(resPath, sizeof(resPath), names[i]);
+        if (surface_from_bundle(names[i], resPath, surfaces[i]) == 0) {
+            results[i] = 0;
+        } else {
+            results[i] = DECODE_PENDING;
+            pending++;
+        }
+    }
+
+    // libpng keeps all its state in png_ptr, so the PNGs can be decoded
+    // side by side; this thread takes its share too
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads_wanted = pending < cpus ? pending : cpus;
+    if (threads_wanted > MAX_DECODE_THREADS)
+        threads_wanted = MAX_DECODE_THREADS;
+    while (started < threads_wanted - 1 &&
+           pthread_create(&threads[started], NULL, decode_thread, &job) == 0)
+        started++;
+    decode_thread(&job);
+    for (i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    return count - pending;
+}
+
 void res_free_surface(gr_surface surface) {
     GGLSurface* pSurface = (GGLSurface*) surface;
     if (pSurface) {
@@ -6,6 +6,7 @@ LOCAL_SRC_FILES := \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
+	Inflate.c \
 	Zip.c
 
 LOCAL_C_INCLUDES := \
@@ -18,4 +19,32 @@ LOCAL_MODULE := libminzip
 
 LOCAL_CFLAGS += -Wall
 
+# BOARD_MINZIP_INFLATE := libdeflate inflates entries with libdeflate
+# where it can; anything linking libminzip then needs libdeflate too.
+ifeq ($(BOARD_MINZIP_INFLATE),libdeflate)
+LOCAL_CFLAGS += -DMINZIP_USE_LIBDEFLATE
+LOCAL_C_INCLUDES += external/libdeflate
+endif
+
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := zip_bench.c
+
+LOCAL_C_INCLUDES := \
+	external/zlib \
+	external/safe-iop/include
+
+LOCAL_STATIC_LIBRARIES := libminzip libz libselinux libcutils liblog libc
+ifeq ($(BOARD_MINZIP_INFLATE),libdeflate)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
+
+LOCAL_MODULE := minzip_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_EXECUTABLE)
@@ -23,9 +23,24 @@
 #include <errno.h>
 #include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "DirUtil.h"
 
+static pthread_mutex_t selabelLock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+dirSelabelLookup(struct selabel_handle *sehnd, char **context,
+        const char *path, int mode)
+{
+    int ret;
+
+    pthread_mutex_lock(&selabelLock);
+    ret = selabel_lookup(sehnd, context, path, mode);
+    pthread_mutex_unlock(&selabelLock);
+    return ret;
+}
+
 typedef enum { DMISSING, DDIR, DILLEGAL } DirStatus;
 
 static DirStatus
@@ -148,7 +163,7 @@ dirCreateHierarchy(const char *path, int mode,
             char *secontext = NULL;
 
             if (sehnd) {
-                selabel_lookup(sehnd, &secontext, cpath, mode);
+                dirSelabelLookup(sehnd, &secontext, cpath, mode);
                 setfscreatecon(secontext);
             }
 
@@ -160,6 +175,12 @@ dirCreateHierarchy(const char *path, int mode,
             }
 
             if (err != 0) {
+                /* Someone else may have just made it.
+                 */
+                if (errno == EEXIST && getPathDirStatus(cpath) == DDIR) {
+                    *p = '/';
+                    continue;
+                }
                 free(cpath);
                 return -1;
             }
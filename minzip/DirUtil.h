@@ -44,6 +44,13 @@ int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName,
         struct selabel_handle* sehnd);
 
+/* selabel_lookup(), one caller at a time: the label handle isn't safe
+ * to share between threads, and updater scripts may extract several
+ * directories at once.
+ */
+int dirSelabelLookup(struct selabel_handle *sehnd, char **context,
+        const char *path, int mode);
+
 /* rm -rf <path>
  */
 int dirUnlinkHierarchy(const char *path);
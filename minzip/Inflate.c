@@ -0,0 +1,263 @@
+/*
+ * Copyright 2014 The CyanogenMod Project
+ *
+ * Inflate backends for raw deflate streams.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zlib.h"
+
+#define LOG_TAG "minzip"
+#include "Log.h"
+#include "Inflate.h"
+
+#ifdef MINZIP_USE_LIBDEFLATE
+#include "libdeflate.h"
+
+/* Entries up to this size are inflated in one call into a heap buffer
+ * when streaming; larger ones (system images) go through zlib so memory
+ * use stays at one window.
+ */
+#define ONESHOT_LIMIT (16 * 1024 * 1024)
+
+/* The one-shot buffers of all extraction workers together stay under
+ * this; an entry that doesn't fit next to the others' is streamed.
+ */
+#define ONESHOT_BUDGET (32 * 1024 * 1024)
+
+static pthread_mutex_t oneshotLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t oneshotInUse = 0;
+#endif
+
+static bool zlibInit(z_stream *zstream)
+{
+    int zerr;
+
+    memset(zstream, 0, sizeof(*zstream));
+    zstream->zalloc = Z_NULL;
+    zstream->zfree = Z_NULL;
+    zstream->opaque = Z_NULL;
+    zstream->data_type = Z_UNKNOWN;
+
+    /*
+     * Use the undocumented "negative window bits" feature to tell zlib
+     * that there's no zlib header waiting for it.
+     */
+    zerr = inflateInit2(zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        if (zerr == Z_VERSION_ERROR) {
+            LOGE("Installed zlib is not compatible with linked version (%s)\n",
+                ZLIB_VERSION);
+        } else {
+            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        }
+        return false;
+    }
+    return true;
+}
+
+/* Feed the stream straight from the mapped entry; avail_in is only a
+ * uInt, so very large entries are fed in pieces.
+ */
+static void zlibFeed(z_stream *zstream, const unsigned char **in,
+        size_t *inLeft)
+{
+    if (zstream->avail_in == 0 && *inLeft > 0) {
+        size_t size = *inLeft > UINT_MAX ? UINT_MAX : *inLeft;
+        zstream->next_in = (Bytef *)*in;
+        zstream->avail_in = size;
+        *in += size;
+        *inLeft -= size;
+    }
+}
+
+static long zlibInflateToFunction(const unsigned char *in, size_t inLen,
+        size_t outLen, InflateProcessFunction processFunction, void *cookie)
+{
+    size_t windowSize = outLen < INFLATE_WINDOW_SIZE ?
+            (outLen > 0 ? outLen : 1) : INFLATE_WINDOW_SIZE;
+    unsigned char *window;
+    z_stream zstream;
+    long result = -1;
+    int zerr;
+
+    window = (unsigned char *)malloc(windowSize);
+    if (window == NULL) {
+        LOGE("Can't allocate %zu byte inflate window\n", windowSize);
+        return -1;
+    }
+    if (!zlibInit(&zstream)) {
+        free(window);
+        return -1;
+    }
+    zstream.next_out = window;
+    zstream.avail_out = windowSize;
+
+    do {
+        zlibFeed(&zstream, &in, &inLen);
+
+        zerr = inflate(&zstream, Z_NO_FLUSH);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            goto bail;
+        }
+
+        /* hand over the window when it's full or when we're done */
+        if (zstream.avail_out == 0 ||
+            (zerr == Z_STREAM_END && zstream.avail_out != windowSize))
+        {
+            long procSize = zstream.next_out - window;
+            if (!processFunction(window, procSize, cookie)) {
+                LOGW("Process function elected to fail (in inflate)\n");
+                goto bail;
+            }
+            zstream.next_out = window;
+            zstream.avail_out = windowSize;
+        }
+    } while (zerr == Z_OK);
+
+    result = zstream.total_out;
+
+bail:
+    inflateEnd(&zstream);
+    free(window);
+    return result;
+}
+
+static bool zlibInflateToBuffer(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen)
+{
+    z_stream zstream;
+    bool ok = false;
+    int zerr;
+
+    unsigned char empty;
+
+    if (!zlibInit(&zstream)) {
+        return false;
+    }
+    /* zlib refuses a NULL next_out even when there's no room behind it */
+    zstream.next_out = out != NULL ? out : &empty;
+
+    /* the whole output is one window, also handed over in uInt-sized
+     * pieces; a stream that wants more than outLen stops with
+     * Z_BUF_ERROR
+     */
+    do {
+        zlibFeed(&zstream, &in, &inLen);
+        if (zstream.avail_out == 0 && outLen > 0) {
+            size_t size = outLen > UINT_MAX ? UINT_MAX : outLen;
+            zstream.next_out = out;
+            zstream.avail_out = size;
+            out += size;
+            outLen -= size;
+        }
+        zerr = inflate(&zstream, Z_NO_FLUSH);
+    } while (zerr == Z_OK);
+
+    ok = zerr == Z_STREAM_END && zstream.avail_out == 0 && outLen == 0;
+    if (!ok) {
+        LOGW("Inflate to buffer failed (zerr=%d)\n", zerr);
+    }
+    inflateEnd(&zstream);
+    return ok;
+}
+
+#ifdef MINZIP_USE_LIBDEFLATE
+
+static bool libdeflateInflateToBuffer(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen)
+{
+    struct libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+    enum libdeflate_result r;
+
+    if (d == NULL) {
+        return zlibInflateToBuffer(in, inLen, out, outLen);
+    }
+    r = libdeflate_deflate_decompress(d, in, inLen, out, outLen, NULL);
+    libdeflate_free_decompressor(d);
+    if (r != LIBDEFLATE_SUCCESS) {
+        LOGW("libdeflate failed (%d)\n", r);
+        return false;
+    }
+    return true;
+}
+
+bool mzInflateToBuffer(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen)
+{
+    return libdeflateInflateToBuffer(in, inLen, out, outLen);
+}
+
+static bool oneshotReserve(size_t size)
+{
+    bool ok;
+
+    pthread_mutex_lock(&oneshotLock);
+    ok = size <= ONESHOT_BUDGET - oneshotInUse;
+    if (ok) {
+        oneshotInUse += size;
+    }
+    pthread_mutex_unlock(&oneshotLock);
+    return ok;
+}
+
+static void oneshotRelease(size_t size)
+{
+    pthread_mutex_lock(&oneshotLock);
+    oneshotInUse -= size;
+    pthread_mutex_unlock(&oneshotLock);
+}
+
+long mzInflateToFunction(const unsigned char *in, size_t inLen,
+        size_t outLen, InflateProcessFunction processFunction, void *cookie)
+{
+    if (outLen > 0 && outLen <= ONESHOT_LIMIT && oneshotReserve(outLen)) {
+        unsigned char *out = (unsigned char *)malloc(outLen);
+        if (out == NULL) {
+            oneshotRelease(outLen);
+        } else {
+            long result = -1;
+            if (libdeflateInflateToBuffer(in, inLen, out, outLen)) {
+                result = outLen;
+                if (!processFunction(out, outLen, cookie)) {
+                    LOGW("Process function elected to fail (in inflate)\n");
+                    result = -1;
+                }
+            }
+            free(out);
+            oneshotRelease(outLen);
+            return result;
+        }
+    }
+    return zlibInflateToFunction(in, inLen, outLen, processFunction, cookie);
+}
+
+const char *mzInflateBackendName(void)
+{
+    return "libdeflate";
+}
+
+#else
+
+bool mzInflateToBuffer(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen)
+{
+    return zlibInflateToBuffer(in, inLen, out, outLen);
+}
+
+long mzInflateToFunction(const unsigned char *in, size_t inLen,
+        size_t outLen, InflateProcessFunction processFunction, void *cookie)
+{
+    return zlibInflateToFunction(in, inLen, outLen, processFunction, cookie);
+}
+
+const char *mzInflateBackendName(void)
+{
+    return "zlib";
+}
+
+#endif
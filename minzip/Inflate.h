@@ -0,0 +1,45 @@
+/*
+ * Copyright 2014 The CyanogenMod Project
+ *
+ * Inflate backends for raw deflate streams.
+ *
+ * zlib is always available and streams any size of entry through a large
+ * heap window.  A board can select an optimized implementation at build
+ * time (BOARD_MINZIP_INFLATE := libdeflate); it is used for entries that
+ * can be inflated in one call, and zlib remains the fallback.
+ */
+#ifndef _MINZIP_INFLATE
+#define _MINZIP_INFLATE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Output is handed to the process function in windows of this size. */
+#define INFLATE_WINDOW_SIZE (1024 * 1024)
+
+typedef bool (*InflateProcessFunction)(const unsigned char *data, int dataLen,
+        void *cookie);
+
+/*
+ * Inflate "inLen" bytes of raw deflate data into "out", which must hold
+ * exactly the "outLen" bytes the stream is expected to produce.
+ *
+ * Returns true if the stream inflated to exactly "outLen" bytes.
+ */
+bool mzInflateToBuffer(const unsigned char *in, size_t inLen,
+        unsigned char *out, size_t outLen);
+
+/*
+ * Inflate "inLen" bytes of raw deflate data, expected to produce
+ * "outLen" bytes, calling processFunction on successive pieces of the
+ * output.
+ *
+ * Returns the number of bytes produced, or -1 on error.
+ */
+long mzInflateToFunction(const unsigned char *in, size_t inLen,
+        size_t outLen, InflateProcessFunction processFunction, void *cookie);
+
+/* The name of the backend selected at build time. */
+const char *mzInflateBackendName(void);
+
+#endif /*_MINZIP_INFLATE*/
@@ -9,8 +9,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
 
@@ -19,6 +21,7 @@
 #include "Bits.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "Inflate.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
@@ -177,6 +180,55 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+#if SORT_ENTRIES
+/*
+ * Order entries by name, bytewise.  Names that are equal (a corrupt or
+ * malicious archive) keep their central directory order, which is the
+ * order of their names in the mapping.
+ */
+static int cmpZipEntryName(const void* ventry1, const void* ventry2)
+{
+    const ZipEntry* pEntry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* pEntry2 = (const ZipEntry*) ventry2;
+    unsigned int len = pEntry1->fileNameLen < pEntry2->fileNameLen ?
+            pEntry1->fileNameLen : pEntry2->fileNameLen;
+    int diff = memcmp(pEntry1->fileName, pEntry2->fileName, len);
+
+    if (diff != 0)
+        return diff;
+    if (pEntry1->fileNameLen != pEntry2->fileNameLen)
+        return pEntry1->fileNameLen < pEntry2->fileNameLen ? -1 : 1;
+    if (pEntry1->fileName != pEntry2->fileName)
+        return pEntry1->fileName < pEntry2->fileName ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Return the index of the first entry whose name is not less than
+ * "prefix".  All entries starting with "prefix" follow it contiguously.
+ */
+static unsigned int findFirstZipEntry(const ZipArchive* pArchive,
+    const char* prefix, unsigned int prefixLen)
+{
+    unsigned int low = 0, high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        const ZipEntry* pEntry = &pArchive->pEntries[mid];
+        unsigned int len = pEntry->fileNameLen < prefixLen ?
+                pEntry->fileNameLen : prefixLen;
+        int diff = memcmp(pEntry->fileName, prefix, len);
+
+        if (diff < 0 || (diff == 0 && pEntry->fileNameLen < prefixLen)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+#endif
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
@@ -275,58 +327,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -392,6 +393,18 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     }
 
 #if SORT_ENTRIES
+    /* Sort the entries by name once they are all read.  Signed packages
+     * usually come sorted already, so check before paying for qsort().
+     */
+    for (i = 1; i < numEntries; i++) {
+        if (cmpZipEntryName(&pArchive->pEntries[i - 1],
+                &pArchive->pEntries[i]) > 0) {
+            qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry),
+                    cmpZipEntryName);
+            break;
+        }
+    }
+
     /* If we're sorting, we have to wait until all entries
      * are in their final places, otherwise the pointers will
      * probably point to the wrong things.
@@ -430,48 +443,60 @@ bail:
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
     MemMapping map;
-    int err;
+    int fd, err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
-    map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
 
-    pArchive->fd = open(fileName, O_RDONLY, 0);
-    if (pArchive->fd < 0) {
+    fd = open(fileName, O_RDONLY, 0);
+    if (fd < 0) {
         err = errno ? errno : -1;
         LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
-        goto bail;
+        return err;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
-        err = -1;
+    if (sysMapFileInShmem(fd, &map) != 0) {
         LOGW("Map of '%s' failed\n", fileName);
-        goto bail;
-    }
-
-    if (map.length < ENDHDR) {
-        err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
-        goto bail;
+        close(fd);
+        return -1;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
-        err = -1;
+    err = mzOpenZipArchiveMapped(fd, &map, pArchive);
+    if (err != 0) {
         LOGV("Parsing '%s' failed\n", fileName);
-        goto bail;
+        sysReleaseShmem(&map);
+        close(fd);
     }
+    return err;
+}
+
+/*
+ * Open a Zip archive from a file the caller already mapped, e.g. to check
+ * its signature first.  On success the archive takes over "fd" and "pMap"
+ * and releases them in mzCloseZipArchive; on failure both are left to the
+ * caller.
+ */
+int mzOpenZipArchiveMapped(int fd, const MemMapping* pMap,
+    ZipArchive* pArchive)
+{
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->fd = -1;
 
-    err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
+    if (pMap->length < ENDHDR) {
+        LOGV("File too small to be zip (%zd)\n", pMap->length);
+        return -1;
+    }
 
-bail:
-    if (err != 0)
+    if (!parseZipArchive(pArchive, pMap)) {
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
-    return err;
+        return -1;
+    }
+
+    pArchive->fd = fd;
+    sysCopyMap(&pArchive->map, pMap);
+    return 0;
 }
 
 /*
@@ -529,6 +554,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
     void *cookie)
 {
     size_t bytesLeft = pEntry->compLen;
+    off_t offset = pEntry->offset;
     while (bytesLeft > 0) {
         unsigned char buf[32 * 1024];
         ssize_t n;
@@ -539,7 +565,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
         if (count > sizeof(buf)) {
             count = sizeof(buf);
         }
-        n = read(pArchive->fd, buf, count);
+        n = TEMP_FAILURE_RETRY(pread(pArchive->fd, buf, count, offset));
         if (n < 0 || (size_t)n != count) {
             LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
             return false;
@@ -549,107 +575,24 @@ static bool processStoredEntry(const ZipArchive *pArchive,
             return false;
         }
         bytesLeft -= count;
+        offset += count;
     }
     return true;
 }
 
+/* Inflate a DEFLATED entry straight out of the archive mapping with the
+ * backend selected at build time.
+ */
 static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
-    z_stream zstream;
-    int zerr;
-    long compRemaining;
-
-    compRemaining = pEntry->compLen;
-
-    /*
-     * Initialize the zlib stream.
-     */
-    memset(&zstream, 0, sizeof(zstream));
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
-    zstream.data_type = Z_UNKNOWN;
+    const unsigned char *data =
+            (const unsigned char *)pArchive->map.addr + pEntry->offset;
+    long result;
 
-    /*
-     * Use the undocumented "negative window bits" feature to tell zlib
-     * that there's no zlib header waiting for it.
-     */
-    zerr = inflateInit2(&zstream, -MAX_WBITS);
-    if (zerr != Z_OK) {
-        if (zerr == Z_VERSION_ERROR) {
-            LOGE("Installed zlib is not compatible with linked version (%s)\n",
-                ZLIB_VERSION);
-        } else {
-            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
-        }
-        goto bail;
-    }
-
-    /*
-     * Loop while we have data.
-     */
-    do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
-        /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
-        if (zerr != Z_OK && zerr != Z_STREAM_END) {
-            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
-            goto z_bail;
-        }
-
-        /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
-        {
-            long procSize = zstream.next_out - procBuf;
-            LOGVV("+++ processing %d bytes\n", (int) procSize);
-            bool ret = processFunction(procBuf, procSize, cookie);
-            if (!ret) {
-                LOGW("Process function elected to fail (in inflate)\n");
-                goto z_bail;
-            }
-
-            zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
-        }
-    } while (zerr == Z_OK);
-
-    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
-
-    // success!
-    result = zstream.total_out;
-
-z_bail:
-    inflateEnd(&zstream);        /* free up any allocated structures */
-
-bail:
+    result = mzInflateToFunction(data, pEntry->compLen, pEntry->uncompLen,
+            processFunction, cookie);
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
             LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
@@ -668,19 +611,16 @@ bail:
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * The compressed data is read with pread(), so the archive's file offset
+ * is left alone and several entries may be processed at once from
+ * different threads.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +635,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -795,12 +733,88 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
     }
 }
 
+/* STORED entries are copied straight out of the archive: from the
+ * mapping into memory, or by sendfile() into a file, a large window at a
+ * time.  The CRC, which the streaming path never checks, is computed
+ * over the mapping as each window goes by.
+ */
+#define STORED_WINDOW_SIZE (4 * 1024 * 1024)
+
+static const unsigned char *storedEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    return (const unsigned char *)pArchive->map.addr + pEntry->offset;
+}
+
+static bool checkStoredCrc(const ZipEntry *pEntry, unsigned long crc)
+{
+    if (crc != (unsigned long)pEntry->crc32) {
+        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+        return false;
+    }
+    return true;
+}
+
+static bool extractStoredToFile(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    const unsigned char *data = storedEntryData(pArchive, pEntry);
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    off_t offset = pEntry->offset;
+    size_t done = 0;
+    bool useSendfile = true;
+
+    while (done < (size_t)pEntry->compLen) {
+        size_t count = pEntry->compLen - done;
+        if (count > STORED_WINDOW_SIZE) {
+            count = STORED_WINDOW_SIZE;
+        }
+        crc = crc32(crc, data + done, count);
+
+        size_t written = 0;
+        while (written < count) {
+            ssize_t n = -1;
+            if (useSendfile) {
+                n = sendfile(fd, pArchive->fd, &offset, count - written);
+                if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    /* target can't take sendfile(); write from the map */
+                    useSendfile = false;
+                    continue;
+                }
+            } else {
+                n = write(fd, data + done + written, count - written);
+                if (n > 0) offset += n;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                LOGE("Error writing %zu bytes from zip file: %s\n",
+                     count - written, n < 0 ? strerror(errno) : "short write");
+                return false;
+            }
+            written += n;
+        }
+        done += count;
+    }
+    return checkStoredCrc(pEntry, crc);
+}
+
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
+    if (pEntry->compression == STORED) {
+        if (!extractStoredToFile(pArchive, pEntry, fd)) {
+            LOGE("Can't extract entry to file.\n");
+            return false;
+        }
+        return true;
+    }
+
     bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
                                          (void*)(intptr_t)fd);
     if (!ret) {
@@ -834,6 +848,43 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
     BufferExtractCookie bec;
+
+    if (pEntry->compression == STORED) {
+        const unsigned char *data = storedEntryData(pArchive, pEntry);
+        unsigned long crc = crc32(0L, Z_NULL, 0);
+        size_t done = 0;
+        if (pEntry->compLen != pEntry->uncompLen) {
+            LOGE("Stored entry %.*s has mismatched sizes (%ld vs %ld)\n",
+                    pEntry->fileNameLen, pEntry->fileName,
+                    pEntry->compLen, pEntry->uncompLen);
+            return false;
+        }
+        while (done < (size_t)pEntry->compLen) {
+            size_t count = pEntry->compLen - done;
+            if (count > STORED_WINDOW_SIZE) {
+                count = STORED_WINDOW_SIZE;
+            }
+            memcpy(buffer + done, data + done, count);
+            crc = crc32(crc, buffer + done, count);
+            done += count;
+        }
+        if (!checkStoredCrc(pEntry, crc)) {
+            LOGE("Can't extract entry to memory buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
+    if (pEntry->compression == DEFLATED) {
+        if (!mzInflateToBuffer(
+                (const unsigned char *)pArchive->map.addr + pEntry->offset,
+                pEntry->compLen, buffer, pEntry->uncompLen)) {
+            LOGE("Can't extract entry to memory buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
     bec.buffer = buffer;
     bec.len = mzGetZipEntryUncompLen(pEntry);
 
@@ -907,6 +958,237 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+/* Regular files are inflated by a pool of worker threads.  Everything
+ * that touches the directory tree -- creating directories, symlinks and
+ * the (empty) target files with their selabel -- stays on the calling
+ * thread in archive order; the workers only fill in and close the files
+ * they are handed.  Directories and symlinks go through the queue too,
+ * as jobs that are already done, and jobs are retired in submission
+ * order, so callbacks see entries in archive order, as before.
+ */
+#define MZ_EXTRACT_MAX_THREADS 8
+#define MZ_EXTRACT_QUEUE 64
+
+typedef struct {
+    const ZipEntry *pEntry;     // NULL if there's nothing left to do
+    int fd;
+    char *targetFile;
+    bool done;
+    bool ok;
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    MzExtractJob jobs[MZ_EXTRACT_QUEUE];
+    unsigned int head;      // oldest job not yet retired
+    unsigned int next;      // next job for a worker
+    unsigned int tail;      // next free slot
+    bool quit;
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    int numThreads;
+} MzExtractPool;
+
+/* Fill in and close the target file of a job.
+ */
+static bool extractFileJob(const ZipArchive *pArchive, MzExtractJob *job,
+    const struct utimbuf *timestamp)
+{
+    bool ok = mzExtractZipEntryToFile(pArchive, job->pEntry, job->fd);
+    close(job->fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(job->targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", job->targetFile);
+    return true;
+}
+
+static void *extractThread(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->next == pool->tail && !pool->quit) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->next == pool->tail) {
+            break;
+        }
+        MzExtractJob *job = &pool->jobs[pool->next++ % MZ_EXTRACT_QUEUE];
+        if (job->pEntry == NULL) {
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractFileJob(pool->pArchive, job, pool->timestamp);
+
+        pthread_mutex_lock(&pool->lock);
+        job->ok = ok;
+        job->done = true;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void extractPoolStart(MzExtractPool *pool, const ZipArchive *pArchive,
+    const struct utimbuf *timestamp, bool threaded)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->pArchive = pArchive;
+    pool->timestamp = timestamp;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    if (cpus < 1) cpus = 1;
+    if (cpus > MZ_EXTRACT_MAX_THREADS) cpus = MZ_EXTRACT_MAX_THREADS;
+    /* a single worker would only add hand-off overhead */
+    if (!threaded || cpus == 1) return;
+    for (i = 0; i < cpus; i++) {
+        if (pthread_create(&pool->threads[i], NULL, extractThread, pool) != 0)
+            break;
+        pool->numThreads++;
+    }
+}
+
+/* Retire finished jobs in order.  With "wait" set, block until every
+ * submitted job is retired; otherwise only until there's a free slot.
+ * Returns false if any retired job failed.
+ */
+static bool extractPoolRetire(MzExtractPool *pool, bool wait,
+    void (*callback)(const char *fn, void *), void *cookie)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head != pool->tail) {
+        MzExtractJob *job = &pool->jobs[pool->head % MZ_EXTRACT_QUEUE];
+        if (!job->done) {
+            if (!wait && pool->tail - pool->head < MZ_EXTRACT_QUEUE)
+                break;
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        pool->head++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (job->ok) {
+            if (callback != NULL) callback(job->targetFile, cookie);
+        } else {
+            ok = false;
+        }
+        free(job->targetFile);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+/* Hand a created target file to the pool, or extract it right here if
+ * the pool has no threads.  Takes ownership of "fd".
+ */
+static bool extractPoolSubmit(MzExtractPool *pool, const ZipEntry *pEntry,
+    int fd, const char *targetFile,
+    void (*callback)(const char *fn, void *), void *cookie)
+{
+    MzExtractJob job;
+
+    job.pEntry = pEntry;
+    job.fd = fd;
+    job.done = false;
+    job.ok = false;
+
+    if (pool->numThreads == 0) {
+        job.targetFile = (char *)targetFile;
+        if (!extractFileJob(pool->pArchive, &job, pool->timestamp))
+            return false;
+        if (callback != NULL) callback(targetFile, cookie);
+        return true;
+    }
+
+    job.targetFile = strdup(targetFile);
+    if (job.targetFile == NULL) {
+        close(fd);
+        return false;
+    }
+
+    bool ok = extractPoolRetire(pool, false, callback, cookie);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs[pool->tail++ % MZ_EXTRACT_QUEUE] = job;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+/* Report an entry that's already extracted (a directory or symlink) once
+ * the files submitted before it are.
+ */
+static bool extractPoolNotify(MzExtractPool *pool, const char *targetFile,
+    void (*callback)(const char *fn, void *), void *cookie)
+{
+    MzExtractJob job;
+
+    if (callback == NULL) {
+        return true;
+    }
+    if (pool->numThreads == 0) {
+        callback(targetFile, cookie);
+        return true;
+    }
+
+    job.pEntry = NULL;
+    job.fd = -1;
+    job.done = true;
+    job.ok = true;
+    job.targetFile = strdup(targetFile);
+    if (job.targetFile == NULL) {
+        return false;
+    }
+
+    bool ok = extractPoolRetire(pool, false, callback, cookie);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->jobs[pool->tail++ % MZ_EXTRACT_QUEUE] = job;
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+/* Wait for all queued files and stop the workers.
+ */
+static bool extractPoolFinish(MzExtractPool *pool,
+    void (*callback)(const char *fn, void *), void *cookie)
+{
+    bool ok = extractPoolRetire(pool, true, callback, cookie);
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->numThreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    return ok;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -977,15 +1259,20 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    MzExtractPool pool;
+    extractPoolStart(&pool, pArchive, timestamp,
+            !(flags & MZ_EXTRACT_DRY_RUN));
+
     /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+     * with zpath.  Sorted entries that match form one run, found by
+     * binary search.
      */
-    unsigned int i;
-    bool seenMatch = false;
+    unsigned int i = 0;
     int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
+#if SORT_ENTRIES
+    i = findFirstZipEntry(pArchive, zpath, zipDirLen);
+#endif
+    for (; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
         if (pEntry->fileNameLen < zipDirLen) {
 //TODO: look out for a single empty directory entry that matches zpath, but
@@ -995,32 +1282,29 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* No chance of matching.
              */
 #if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
+            /* The matching run starts at the first entry we looked
+             * at, so the first mismatch ends it.
+             */
+            break;
+#else
             continue;
+#endif
         }
         /* If zpath is empty, this strncmp() will match everything,
          * which is what we want.
          */
         if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
 #if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
+            /* The matching run starts at the first entry we looked
+             * at, so the first mismatch ends it.
+             */
+            break;
+#else
             continue;
+#endif
         }
         /* This entry begins with zipDir, so we'll extract it.
          */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
@@ -1118,7 +1402,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 char *secontext = NULL;
 
                 if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+                    dirSelabelLookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
                     setfscreatecon(secontext);
                 }
 
@@ -1136,25 +1420,25 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                /* The pool calls the callback once the file is written.
+                 */
+                if (!extractPoolSubmit(&pool, pEntry, fd, targetFile,
+                        callback, cookie)) {
                     ok = false;
                     break;
                 }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
+                continue;
             }
         }
 
-        if (callback != NULL) callback(targetFile, cookie);
+        if (!extractPoolNotify(&pool, targetFile, callback, cookie)) {
+            ok = false;
+            break;
+        }
+    }
+
+    if (!extractPoolFinish(&pool, callback, cookie)) {
+        ok = false;
     }
 
     free(helper.buf);
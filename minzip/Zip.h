@@ -70,6 +70,16 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Open a Zip archive from "fd", already mapped in "pMap" by
+ * sysMapFileInShmem.
+ *
+ * On success, returns 0 and the archive owns both "fd" and the mapping.
+ * On failure, returns nonzero and the caller still owns them.
+ */
+int mzOpenZipArchiveMapped(int fd, const MemMapping* pMap,
+    ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -207,7 +217,10 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
- * If callback is non-NULL, it will be invoked with each unpacked file.
+ * If callback is non-NULL, it will be invoked with each unpacked file,
+ * on the calling thread and in archive order.  Files are inflated in
+ * parallel, so the callback for an entry may come a few entries after it
+ * was created; it always comes once the entry is complete.
  *
  * Returns true on success, false on failure.
  */
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2014 The CyanogenMod Project
+ *
+ * Times opening a large synthetic archive and looking up directories in
+ * it the way package_extract_dir does, or with -inflate, how fast the
+ * selected inflate backend gets through the DEFLATED entries of real
+ * archives (APKs, OTA packages with images).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "Inflate.h"
+#include "Zip.h"
+
+#define DEFAULT_ENTRIES 50000
+#define ENTRIES_PER_DIR 100
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void put2(FILE *f, unsigned int v)
+{
+    fputc(v & 0xff, f);
+    fputc((v >> 8) & 0xff, f);
+}
+
+static void put4(FILE *f, unsigned int v)
+{
+    put2(f, v & 0xffff);
+    put2(f, v >> 16);
+}
+
+static void entryName(char *name, size_t size, unsigned int n)
+{
+    snprintf(name, size, "system/dir%04u/file%06u",
+            n / ENTRIES_PER_DIR, n);
+}
+
+/* Write an archive of "count" empty STORED entries, in name order or
+ * shuffled.
+ */
+static bool writeArchive(const char *path, unsigned int count, bool shuffle)
+{
+    unsigned int *order = malloc(count * sizeof(*order));
+    unsigned int *offsets = malloc(count * sizeof(*offsets));
+    FILE *f = fopen(path, "wb");
+    char name[64];
+    unsigned int i;
+
+    if (order == NULL || offsets == NULL || f == NULL) {
+        free(order);
+        free(offsets);
+        if (f != NULL) fclose(f);
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    if (shuffle) {
+        srand(1);
+        for (i = count - 1; i > 0; i--) {
+            unsigned int j = rand() % (i + 1);
+            unsigned int t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        entryName(name, sizeof(name), order[i]);
+        offsets[i] = ftell(f);
+        put4(f, 0x04034b50);            /* LOCSIG */
+        put2(f, 10); put2(f, 0); put2(f, 0);
+        put2(f, 0); put2(f, 0);         /* time, date */
+        put4(f, 0); put4(f, 0); put4(f, 0);
+        put2(f, strlen(name)); put2(f, 0);
+        fputs(name, f);
+    }
+
+    long cdOffset = ftell(f);
+    for (i = 0; i < count; i++) {
+        entryName(name, sizeof(name), order[i]);
+        put4(f, 0x02014b50);            /* CENSIG */
+        put2(f, 3 << 8); put2(f, 10);   /* made by unix, needed */
+        put2(f, 0); put2(f, 0);
+        put2(f, 0); put2(f, 0);
+        put4(f, 0); put4(f, 0); put4(f, 0);
+        put2(f, strlen(name)); put2(f, 0); put2(f, 0);
+        put2(f, 0); put2(f, 0);
+        put4(f, 0100644u << 16);
+        put4(f, offsets[i]);
+        fputs(name, f);
+    }
+    long cdSize = ftell(f) - cdOffset;
+
+    put4(f, 0x06054b50);                /* ENDSIG */
+    put2(f, 0); put2(f, 0);
+    put2(f, count); put2(f, count);
+    put4(f, cdSize); put4(f, cdOffset);
+    put2(f, 0);
+
+    free(order);
+    free(offsets);
+    return fclose(f) == 0;
+}
+
+static void countEntry(const char *fn, void *cookie)
+{
+    (*(unsigned int *)cookie)++;
+}
+
+static bool sinkProcessFunction(const unsigned char *data, int dataLen,
+    void *cookie)
+{
+    (*(unsigned long long *)cookie) += dataLen;
+    return true;
+}
+
+/* Inflate every DEFLATED entry of each archive to memory and through a
+ * process function, as mzExtractZipEntryToBuffer and
+ * mzExtractZipEntryToFile would.
+ */
+static int benchInflate(int argc, char **argv)
+{
+    unsigned long long total = 0, sunk = 0;
+    double toBuffer = 0, toFunction = 0;
+    unsigned int entries = 0;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        ZipArchive za;
+        unsigned int e;
+
+        if (mzOpenZipArchive(argv[i], &za) != 0) {
+            fprintf(stderr, "can't open %s\n", argv[i]);
+            return 1;
+        }
+        for (e = 0; e < mzZipEntryCount(&za); e++) {
+            const ZipEntry *pEntry = mzGetZipEntryAt(&za, e);
+            if (pEntry->compression != 8) continue;     /* DEFLATED */
+
+            long len = mzGetZipEntryUncompLen(pEntry);
+            unsigned char *buf = malloc(len > 0 ? len : 1);
+            if (buf == NULL) {
+                fprintf(stderr, "can't allocate %ld bytes\n", len);
+                return 1;
+            }
+            double start = now();
+            if (!mzExtractZipEntryToBuffer(&za, pEntry, buf)) {
+                fprintf(stderr, "%s: %.*s failed\n", argv[i],
+                        pEntry->fileNameLen, pEntry->fileName);
+                return 1;
+            }
+            double mid = now();
+            if (!mzProcessZipEntryContents(&za, pEntry, sinkProcessFunction,
+                    &sunk)) {
+                fprintf(stderr, "%s: %.*s failed\n", argv[i],
+                        pEntry->fileNameLen, pEntry->fileName);
+                return 1;
+            }
+            double end = now();
+            free(buf);
+
+            toBuffer += mid - start;
+            toFunction += end - mid;
+            total += len;
+            entries++;
+        }
+        mzCloseZipArchive(&za);
+    }
+
+    if (entries == 0 || sunk != total) {
+        fprintf(stderr, "no deflated entries or short output\n");
+        return 1;
+    }
+    printf("%s: %u entries, %llu MB: to buffer %.1f MB/s, streamed %.1f MB/s\n",
+            mzInflateBackendName(), entries, total >> 20,
+            total / toBuffer / (1 << 20), total / toFunction / (1 << 20));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int count = DEFAULT_ENTRIES;
+    const char *path = "/tmp/zip_bench.zip";
+    int i;
+
+    if (argc > 2 && strcmp(argv[1], "-inflate") == 0) {
+        return benchInflate(argc - 2, argv + 2);
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = strtoul(argv[++i], NULL, 10);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (count == 0 || count > 65535) {
+        /* no zip64 here */
+        fprintf(stderr, "entry count must be between 1 and 65535\n");
+        return 2;
+    }
+
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        bool shuffle = pass == 1;
+        if (!writeArchive(path, count, shuffle)) {
+            fprintf(stderr, "can't write %s\n", path);
+            return 1;
+        }
+
+        ZipArchive za;
+        double start = now();
+        if (mzOpenZipArchive(path, &za) != 0) {
+            fprintf(stderr, "can't open %s\n", path);
+            return 1;
+        }
+        double opened = now();
+
+        /* one package_extract_dir per directory, plus the whole tree */
+        unsigned int dirs = (count + ENTRIES_PER_DIR - 1) / ENTRIES_PER_DIR;
+        unsigned int found = 0, d;
+        char dir[64];
+        for (d = 0; d < dirs; d++) {
+            snprintf(dir, sizeof(dir), "system/dir%04u", d);
+            mzExtractRecursive(&za, dir, "/", MZ_EXTRACT_DRY_RUN, NULL,
+                    countEntry, &found, NULL);
+        }
+        mzExtractRecursive(&za, "system", "/", MZ_EXTRACT_DRY_RUN, NULL,
+                countEntry, &found, NULL);
+        double done = now();
+
+        printf("%s %u entries: open %.1f ms, %u dir lookups %.1f ms (%u files)\n",
+                shuffle ? "shuffled" : "sorted  ", count,
+                (opened - start) * 1000, dirs + 1, (done - opened) * 1000,
+                found);
+        mzCloseZipArchive(&za);
+    }
+    unlink(path);
+    return 0;
+}
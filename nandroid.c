@@ -47,7 +47,9 @@
 #include "minzip/DirUtil.h"
 #include "mounts.h"
 #include "nandroid.h"
+#include "nandroid_chunks.h"
 #include "nandroid_md5.h"
+#include "nandroid_tar.h"
 #include "recovery_settings.h"
 #include "recovery_ui.h"
 #include "roots.h"
@@ -61,6 +63,8 @@ typedef int (*nandroid_restore_handler)(const char* backup_file_image, const cha
 static int nandroid_backup_bitfield = 0;
 static unsigned int nandroid_files_total = 0;
 static unsigned int nandroid_files_count = 0;
+static unsigned long long nandroid_bytes_total = 0;
+static unsigned long long nandroid_bytes_count = 0;
 
 static void nandroid_generate_timestamp_path(char* backup_path) {
     time_t t = time(NULL);
@@ -91,6 +95,21 @@ static int print_and_error(const char* message, int ret) {
     return ret;
 }
 
+// Progress is whichever of the file and byte estimates is further along:
+// handlers that only report names move the bar per file, the tar engine
+// also reports how many bytes it has archived.
+static void nandroid_update_progress() {
+    float progress_decimal = 0;
+    if (nandroid_files_total != 0)
+        progress_decimal = (float)((double)nandroid_files_count / (double)nandroid_files_total);
+    if (nandroid_bytes_total != 0) {
+        float bytes_decimal = (float)((double)nandroid_bytes_count / (double)nandroid_bytes_total);
+        if (bytes_decimal > progress_decimal)
+            progress_decimal = bytes_decimal;
+    }
+    ui_set_progress(progress_decimal);
+}
+
 static void nandroid_callback(const char* filename) {
     if (filename == NULL)
         return;
@@ -103,39 +122,49 @@ static void nandroid_callback(const char* filename) {
 
     if (nandroid_files_total != 0) {
         nandroid_files_count++;
-        float progress_decimal = (float)((double)nandroid_files_count /
-                                         (double)nandroid_files_total);
-        ui_set_progress(progress_decimal);
+        nandroid_update_progress();
+    }
+}
+
+static void nandroid_bytes_callback(unsigned long long bytes) {
+    if (nandroid_bytes_total != 0) {
+        nandroid_bytes_count = bytes;
+        nandroid_update_progress();
     }
 }
 
+static int is_mount_point(const char* directory) {
+    char parent[PATH_MAX];
+    struct stat st, parent_st;
+    snprintf(parent, PATH_MAX, "%s/..", directory);
+    return stat(directory, &st) == 0 && stat(parent, &parent_st) == 0 &&
+           (st.st_dev != parent_st.st_dev || st.st_ino == parent_st.st_ino);
+}
+
+// Estimate the work from the filesystem usage when directory is the whole
+// of its filesystem; usage counts a little metadata too, so the bar may
+// stop just short of the end. Otherwise (.android_secure on the sdcard,
+// /data without /data/media) the usage would count data that isn't backed
+// up, and only walking the tree a second time could tell how much is:
+// show an indeterminate bar instead.
 static void compute_directory_stats(const char* directory) {
-    char tmp[PATH_MAX];
-    char count_text[100];
+    struct statfs sfs;
 
-    // reset file count if we ever return before setting it
+    // reset counts if we ever return before setting them
     nandroid_files_count = 0;
     nandroid_files_total = 0;
+    nandroid_bytes_count = 0;
+    nandroid_bytes_total = 0;
 
-    sprintf(tmp, "find %s | %s wc -l > /tmp/dircount", directory, strcmp(directory, "/data") == 0 && is_data_media() ? "grep -v /data/media |" : "");
-    __system(tmp);
-
-    FILE* f = fopen("/tmp/dircount", "r");
-    if (f == NULL)
-        return;
-
-    if (fgets(count_text, sizeof(count_text), f) == NULL) {
-        fclose(f);
+    ui_reset_progress();
+    if ((strcmp(directory, "/data") == 0 && is_data_media()) || !is_mount_point(directory) ||
+            statfs(directory, &sfs) != 0) {
+        ui_show_indeterminate_progress();
         return;
     }
-
-    size_t len = strlen(count_text);
-    if (count_text[len - 1] == '\n')
-        count_text[len - 1] = '\0';
-
-    fclose(f);
-    nandroid_files_total = atoi(count_text);
-    ui_reset_progress();
+    nandroid_bytes_total = (unsigned long long)(sfs.f_blocks - sfs.f_bfree) * sfs.f_bsize;
+    if (sfs.f_files > sfs.f_ffree)
+        nandroid_files_total = sfs.f_files - sfs.f_ffree;
     ui_show_progress(1, 0);
 }
 
@@ -158,39 +187,31 @@ static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_fil
     return __pclose(fp);
 }
 
-static int do_tar_compress(char* command, int callback) {
-    char buf[PATH_MAX];
+static int do_tar_compress(const char* backup_path, const char* archive, int compress, int callback) {
+    const char* excludes[] = { "data/data/com.google.android.music/files/*", NULL, NULL };
+    if (strcmp(backup_path, "/data") == 0 && is_data_media())
+        excludes[1] = "data/media";
 
     set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar command!\n");
-        set_perf_mode(0);
-        return -1;
-    }
-
-    while (fgets(buf, PATH_MAX, fp) != NULL) {
-        buf[PATH_MAX - 1] = '\0';
-        if (callback)
-            nandroid_callback(buf);
-    }
-
+    int ret = nandroid_tar_create(backup_path, archive, excludes, compress,
+                                  callback ? nandroid_callback : NULL,
+                                  callback ? nandroid_bytes_callback : NULL);
     set_perf_mode(0);
-    return __pclose(fp);
+    return ret;
 }
 
 static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar ; set -o pipefail ; (tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path, backup_file_image);
+    sprintf(tmp, "%s.tar", backup_file_image);
 
-    return do_tar_compress(tmp, callback);
+    return do_tar_compress(backup_path, tmp, 0, callback);
 }
 
 static int tar_gzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar.gz ; set -o pipefail ; (tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | pigz -c | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.gz.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path, backup_file_image);
+    sprintf(tmp, "%s.tar.gz", backup_file_image);
 
-    return do_tar_compress(tmp, callback);
+    return do_tar_compress(backup_path, tmp, 1, callback);
 }
 
 static int tar_dump_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
@@ -208,7 +229,9 @@ void nandroid_dedupe_gc(const char* blob_dir) {
     strcat(backup_dir, "/backup");
     ui_print("Freeing space...\n");
     char tmp[PATH_MAX];
-    sprintf(tmp, "dedupe gc %s $(find %s -name '*.dup')", blob_dir, backup_dir);
+    // dedupe finds the manifests itself, so the command line stays short
+    // no matter how many backups there are
+    sprintf(tmp, "dedupe gc %s %s", blob_dir, backup_dir);
     __system(tmp);
     ui_print("Done freeing space.\n");
 }
@@ -408,6 +431,7 @@ static int nandroid_backup_partition(const char* backup_path, const char* root)
 int nandroid_backup(const char* backup_path) {
     nandroid_backup_bitfield = 0;
     refresh_default_backup_handler();
+    nandroid_md5_forget_recorded();
 
     if (ensure_path_mounted(backup_path) != 0) {
         return print_and_error("Can't mount backup path.\n", NANDROID_ERROR_GENERAL);
@@ -588,18 +612,41 @@ static int do_tar_extract(char* command, int callback) {
     return __pclose(fp);
 }
 
-static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+// With a nandroid.chunks, the volumes are fed to the extractor through a
+// pipe and checked chunk by chunk on the way; see nandroid_chunks.h.
+static int do_fed_tar_extract(const char* backup_file_image, const char* backup_path,
+                              const char* decompress, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | pigz -d -c | tar -xpv ; exit $?", backup_path, backup_file_image);
+    int fd;
+    NandroidFeed* feed = nandroid_feed_start(backup_file_image, &fd);
+    if (feed == NULL) {
+        // nothing checks the volumes on the way, so they must match now
+        if (nandroid_md5_check_deferred(backup_file_image) != 0) {
+            ui_print("%s is damaged, not restoring it!\n", backup_file_image);
+            return -1;
+        }
+        sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | %star -xpv ; exit $?",
+                backup_path, backup_file_image, decompress);
+        return do_tar_extract(tmp, callback);
+    }
 
-    return do_tar_extract(tmp, callback);
+    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; exec <&%d ; %star -xpv ; exit $?",
+            backup_path, fd, decompress);
+    int ret = do_tar_extract(tmp, callback);
+    close(fd);
+    if (nandroid_feed_finish(feed) != 0) {
+        ui_print("%s is damaged, restore incomplete!\n", backup_file_image);
+        return -1;
+    }
+    return ret;
 }
 
-static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | tar -xpv ; exit $?", backup_path, backup_file_image);
+static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_fed_tar_extract(backup_file_image, backup_path, "pigz -d -c | ", callback);
+}
 
-    return do_tar_extract(tmp, callback);
+static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_fed_tar_extract(backup_file_image, backup_path, "", callback);
 }
 
 static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
@@ -824,6 +871,7 @@ int nandroid_restore(const char* backup_path, unsigned char flags) {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_show_indeterminate_progress();
     nandroid_files_total = 0;
+    nandroid_bytes_total = 0;
     int ret;
 
     int restore_boot = ((flags & NANDROID_BOOT) == NANDROID_BOOT);
@@ -898,6 +946,7 @@ int nandroid_restore(const char* backup_path, unsigned char flags) {
 
 static int nandroid_undump(const char* partition) {
     nandroid_files_total = 0;
+    nandroid_bytes_total = 0;
 
     int ret;
 
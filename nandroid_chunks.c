@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <openssl/md5.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nandroid_chunks.h"
+#include "nandroid_md5.h"
+
+#define HASH_LENGTH 2*MD5_DIGEST_LENGTH
+
+typedef struct {
+    char *filename;
+    unsigned long long size;
+    int count;
+    unsigned char *digests;
+} ChunkEntry;
+
+struct NandroidChunks {
+    ChunkEntry *entries;
+    int count;
+    int capacity;
+};
+
+struct NandroidFeed {
+    NandroidChunks *chunks;
+    char **paths;
+    char **names;
+    int count;
+    int fd;
+    pthread_t thread;
+    int ret;
+};
+
+static void to_hex(char *str, const unsigned char *md) {
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(&str[2*i], "%02x", (unsigned int)md[i]);
+    str[HASH_LENGTH] = '\0';
+}
+
+static int from_hex(unsigned char *md, const char *str) {
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+        unsigned int byte;
+        if (sscanf(&str[2*i], "%2x", &byte) != 1)
+            return -1;
+        md[i] = byte;
+    }
+    return 0;
+}
+
+static int chunk_count(unsigned long long size) {
+    return (size + NANDROID_CHUNK_SIZE - 1) / NANDROID_CHUNK_SIZE;
+}
+
+void nandroid_chunks_write_header(FILE *f) {
+    fprintf(f, "chunks %d\n", NANDROID_CHUNK_SIZE);
+}
+
+void nandroid_chunks_write_entry(FILE *f, const char *filename, unsigned long long size,
+                                 const unsigned char *digests, int count) {
+    unsigned char root[MD5_DIGEST_LENGTH];
+    char hex[HASH_LENGTH+1];
+    int i;
+
+    MD5(digests, count * MD5_DIGEST_LENGTH, root);
+    to_hex(hex, root);
+    fprintf(f, "%s  %llu  %d  %s\n", hex, size, count, filename);
+    for (i = 0; i < count; i++) {
+        to_hex(hex, digests + i * MD5_DIGEST_LENGTH);
+        fprintf(f, "%s\n", hex);
+    }
+}
+
+void nandroid_chunks_free(NandroidChunks *chunks) {
+    int i;
+    if (chunks == NULL)
+        return;
+    for (i = 0; i < chunks->count; i++) {
+        free(chunks->entries[i].filename);
+        free(chunks->entries[i].digests);
+    }
+    free(chunks->entries);
+    free(chunks);
+}
+
+NandroidChunks *nandroid_chunks_load(const char *backup_path) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    unsigned int chunk_size;
+
+    snprintf(path, PATH_MAX, "%s/%s", backup_path, NANDROID_CHUNKS_FILE);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    if (fgets(line, sizeof(line), f) == NULL ||
+            sscanf(line, "chunks %u", &chunk_size) != 1 ||
+            chunk_size != NANDROID_CHUNK_SIZE) {
+        LOGI("Ignoring %s: unknown format\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    NandroidChunks *chunks = calloc(1, sizeof(NandroidChunks));
+    if (chunks == NULL) {
+        fclose(f);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char root_hex[HASH_LENGTH+1];
+        unsigned char root[MD5_DIGEST_LENGTH];
+        unsigned char check[MD5_DIGEST_LENGTH];
+        unsigned long long size;
+        int count, offset = 0, i;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%32s %llu %d %n", root_hex, &size, &count, &offset) != 3 ||
+                offset == 0 || line[offset] == '\0' || from_hex(root, root_hex) != 0 ||
+                count != chunk_count(size))
+            break;
+
+        ChunkEntry entry;
+        entry.filename = strdup(line + offset);
+        entry.size = size;
+        entry.count = count;
+        entry.digests = malloc(count * MD5_DIGEST_LENGTH + 1);
+        if (entry.filename == NULL || entry.digests == NULL) {
+            free(entry.filename);
+            free(entry.digests);
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            if (fgets(line, sizeof(line), f) == NULL ||
+                    from_hex(entry.digests + i * MD5_DIGEST_LENGTH, line) != 0)
+                break;
+        }
+        MD5(entry.digests, count * MD5_DIGEST_LENGTH, check);
+        if (i < count || memcmp(root, check, MD5_DIGEST_LENGTH) != 0) {
+            LOGI("Ignoring damaged %s entry for %s\n", NANDROID_CHUNKS_FILE, entry.filename);
+            free(entry.filename);
+            free(entry.digests);
+            if (i < count)
+                break;
+            continue;
+        }
+
+        if (chunks->count == chunks->capacity) {
+            int capacity = chunks->capacity ? 2 * chunks->capacity : 16;
+            ChunkEntry *entries = realloc(chunks->entries, capacity * sizeof(ChunkEntry));
+            if (entries == NULL) {
+                free(entry.filename);
+                free(entry.digests);
+                break;
+            }
+            chunks->entries = entries;
+            chunks->capacity = capacity;
+        }
+        chunks->entries[chunks->count++] = entry;
+    }
+    fclose(f);
+    return chunks;
+}
+
+static ChunkEntry *find_entry(NandroidChunks *chunks, const char *filename,
+                              unsigned long long size) {
+    int i;
+    for (i = 0; i < chunks->count; i++) {
+        if (strcmp(chunks->entries[i].filename, filename) == 0)
+            return chunks->entries[i].size == size ? &chunks->entries[i] : NULL;
+    }
+    return NULL;
+}
+
+int nandroid_chunks_covers(NandroidChunks *chunks, const char *filename, unsigned long long size) {
+    return chunks != NULL && find_entry(chunks, filename, size) != NULL;
+}
+
+static int read_full(int fd, unsigned char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? -1 : (int)done;
+        done += n;
+    }
+    return done;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Streams one file into the pipe, checking it if it is listed.  Returns
+// 1 if nobody is reading the pipe anymore.
+static int feed_file(NandroidFeed *feed, int i, unsigned char *buf, int *checked) {
+    int fd = open(feed->paths[i], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        LOGE("Unable to read %s\n", feed->paths[i]);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    ChunkEntry *entry = find_entry(feed->chunks, feed->names[i], st.st_size);
+    if (entry == NULL && nandroid_md5_deferred(feed->paths[i])) {
+        // its MD5 was left for us to check
+        LOGE("%s is no longer listed in %s\n", feed->names[i], NANDROID_CHUNKS_FILE);
+        close(fd);
+        return -1;
+    }
+    if (entry == NULL && st.st_size > 0)
+        LOGI("%s isn't listed in %s, not checking it\n", feed->names[i], NANDROID_CHUNKS_FILE);
+
+    int chunk = 0;
+    int ret = 0;
+    for (;;) {
+        int n = read_full(fd, buf, NANDROID_CHUNK_SIZE);
+        if (n < 0) {
+            LOGE("Error reading %s (%s)\n", feed->paths[i], strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        if (entry != NULL) {
+            unsigned char digest[MD5_DIGEST_LENGTH];
+            MD5(buf, n, digest);
+            if (chunk >= entry->count ||
+                    memcmp(digest, entry->digests + chunk * MD5_DIGEST_LENGTH, MD5_DIGEST_LENGTH) != 0) {
+                LOGE("MD5 mismatch for %s at %lluMB\n", feed->names[i],
+                     (unsigned long long)chunk * NANDROID_CHUNK_SIZE >> 20);
+                ret = -1;
+                break;
+            }
+            (*checked)++;
+        }
+        chunk++;
+        if (write_all(feed->fd, buf, n) != 0) {
+            // The extractor is gone, possibly without reading the padding
+            // after the end of the archive; its exit status decides.
+            ret = 1;
+            break;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+static void *feed_thread(void *cookie) {
+    NandroidFeed *feed = (NandroidFeed *)cookie;
+    int checked = 0;
+    int i;
+
+    // a failed write to the pipe should fail, not kill recovery
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    unsigned char *buf = malloc(NANDROID_CHUNK_SIZE);
+    feed->ret = buf == NULL ? -1 : 0;
+    for (i = 0; i < feed->count && feed->ret == 0; i++)
+        feed->ret = feed_file(feed, i, buf, &checked);
+    if (feed->ret > 0)
+        feed->ret = 0;
+    free(buf);
+
+    close(feed->fd);
+    LOGI("Checked %d chunks while restoring\n", checked);
+    return NULL;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void feed_free(NandroidFeed *feed) {
+    int i;
+    for (i = 0; i < feed->count; i++) {
+        free(feed->paths[i]);
+        free(feed->names[i]);
+    }
+    free(feed->paths);
+    free(feed->names);
+    nandroid_chunks_free(feed->chunks);
+    free(feed);
+}
+
+NandroidFeed *nandroid_feed_start(const char *archive, int *fd) {
+    char tmp[PATH_MAX];
+    char dir[PATH_MAX];
+    char base[PATH_MAX];
+    int pipefd[2];
+
+    // dirname() and basename() may modify their argument or return static storage
+    snprintf(tmp, PATH_MAX, "%s", archive);
+    snprintf(dir, PATH_MAX, "%s", dirname(tmp));
+    snprintf(tmp, PATH_MAX, "%s", archive);
+    snprintf(base, PATH_MAX, "%s", basename(tmp));
+
+    NandroidChunks *chunks = nandroid_chunks_load(dir);
+    if (chunks == NULL)
+        return NULL;
+
+    NandroidFeed *feed = calloc(1, sizeof(NandroidFeed));
+    if (feed == NULL) {
+        nandroid_chunks_free(chunks);
+        return NULL;
+    }
+    feed->chunks = chunks;
+
+    // the files "cat archive*" would read, in the same order
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        feed_free(feed);
+        return NULL;
+    }
+    struct dirent *ep;
+    size_t len = strlen(base);
+    int capacity = 0;
+    while ((ep = readdir(dp)) != NULL) {
+        if (strncmp(ep->d_name, base, len) != 0)
+            continue;
+        if (feed->count == capacity) {
+            capacity = capacity ? 2 * capacity : 32;
+            char **names = realloc(feed->names, capacity * sizeof(char *));
+            if (names == NULL)
+                break;
+            feed->names = names;
+        }
+        feed->names[feed->count] = strdup(ep->d_name);
+        if (feed->names[feed->count] == NULL)
+            break;
+        feed->count++;
+    }
+    closedir(dp);
+    if (ep != NULL) {
+        feed_free(feed);
+        return NULL;
+    }
+    qsort(feed->names, feed->count, sizeof(char *), compare_names);
+
+    feed->paths = calloc(feed->count, sizeof(char *));
+    if (feed->paths == NULL) {
+        feed_free(feed);
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < feed->count; i++) {
+        feed->paths[i] = malloc(strlen(dir) + strlen(feed->names[i]) + 2);
+        if (feed->paths[i] == NULL) {
+            feed_free(feed);
+            return NULL;
+        }
+        sprintf(feed->paths[i], "%s/%s", dir, feed->names[i]);
+    }
+
+    // The extractor inherits the read end; the write end stays here.
+    if (pipe(pipefd) != 0) {
+        feed_free(feed);
+        return NULL;
+    }
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    feed->fd = pipefd[1];
+    if (pthread_create(&feed->thread, NULL, feed_thread, feed) != 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        feed_free(feed);
+        return NULL;
+    }
+    *fd = pipefd[0];
+    return feed;
+}
+
+int nandroid_feed_finish(NandroidFeed *feed) {
+    pthread_join(feed->thread, NULL);
+    int ret = feed->ret;
+    feed_free(feed);
+    return ret;
+}
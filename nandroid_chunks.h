@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_CHUNKS_H
+#define _NANDROID_CHUNKS_H
+
+#include <stdio.h>
+
+/*
+ * nandroid.chunks sits next to nandroid.md5 and lists, for the backup
+ * files hashed while they were written (the tar volumes), the MD5 of every
+ * 1MB chunk.  Restore checks those files chunk by chunk while it streams
+ * them into the extractor instead of reading everything twice, and stops
+ * at the first bad chunk.
+ *
+ *   chunks 1048576
+ *   <root>  <size>  <chunk count>  <filename>
+ *   <chunk md5>
+ *   ...
+ *
+ * root is the MD5 of the entry's binary chunk digests, one after the
+ * other; an entry whose root doesn't match is ignored.
+ */
+#define NANDROID_CHUNKS_FILE "nandroid.chunks"
+#define NANDROID_CHUNK_SIZE (1024 * 1024)
+
+void nandroid_chunks_write_header(FILE *f);
+void nandroid_chunks_write_entry(FILE *f, const char *filename, unsigned long long size,
+                                 const unsigned char *digests, int count);
+
+typedef struct NandroidChunks NandroidChunks;
+
+// NULL if the backup has no usable nandroid.chunks.
+NandroidChunks *nandroid_chunks_load(const char *backup_path);
+// Whether filename is listed with the given size.
+int nandroid_chunks_covers(NandroidChunks *chunks, const char *filename, unsigned long long size);
+void nandroid_chunks_free(NandroidChunks *chunks);
+
+typedef struct NandroidFeed NandroidFeed;
+
+// Start streaming archive* (what "cat archive*" would) into a pipe, and
+// return its read end in *fd for the extractor to inherit.  Listed files
+// are checked chunk by chunk; a bad chunk is never passed on and ends the
+// stream early.  Returns NULL if the backup has no nandroid.chunks or the
+// stream can't be started; run nandroid_md5_check_deferred() before
+// reading the files any other way.
+NandroidFeed *nandroid_feed_start(const char *archive, int *fd);
+// Call once the extractor is done, after closing *fd.  Returns 0 if all
+// data was checked and passed on.
+int nandroid_feed_finish(NandroidFeed *feed);
+
+#endif
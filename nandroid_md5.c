@@ -15,59 +15,297 @@
  */
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <limits.h>
 #include <openssl/md5.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "extendedcommands.h"
 #include "nandroid.h"
+#include "nandroid_chunks.h"
 #include "nandroid_md5.h"
 #include "recovery_ui.h"
 
-#define MAX_FILES_CHECKED 20
 #define HASH_LENGTH 2*MD5_DIGEST_LENGTH
-#define BUFSIZE 1024
+#define READ_SIZE (1024 * 1024)
+#define MAX_MD5_WORKERS 4
 
 typedef struct {
     int is_missing;
     char *filename;
 } MissingFiles;
 
-static void to_md5_hash(char *str, unsigned char* md) {
+typedef struct {
+    char **items;
+    int count;
+    int capacity;
+} StringList;
+
+// Takes ownership of str.
+static int list_add(StringList *list, char *str) {
+    if (str == NULL)
+        return -1;
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? 2 * list->capacity : 16;
+        char **items = realloc(list->items, capacity * sizeof(char *));
+        if (items == NULL) {
+            free(str);
+            return -1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = str;
+    return 0;
+}
+
+static void list_free(StringList *list) {
+    int i;
+    for (i = 0; i < list->count; i++)
+        free(list->items[i]);
+    free(list->items);
+    list->items = NULL;
+    list->count = list->capacity = 0;
+}
+
+static char *path_join(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path != NULL)
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static void to_md5_hash(char *str, const unsigned char* md) {
     int i;
     for (i = 0; i < MD5_DIGEST_LENGTH; i++)
         sprintf(&str[2*i], "%02x", (unsigned int)md[i]);
     str[HASH_LENGTH] = '\0';
 }
 
-static int calculate_md5(char *str, const char *path) {
-    FILE *fd;
-    fd = fopen(path, "r");
-    if (fd != NULL) {
-        MD5_CTX c;
-        size_t i;
-        static unsigned char buf[BUFSIZE];
-        unsigned char md5dig[MD5_DIGEST_LENGTH];
-        MD5_Init(&c);
-        while ((i = fread(buf, 1, BUFSIZE, fd)) > 0)
-            MD5_Update(&c, buf, i);
-        MD5_Final(&(md5dig[0]), &c);
-        fclose(fd);
-        to_md5_hash(str, md5dig);
+// Digests of backup files taken while they were written, by inode.  They
+// are only trusted while the file still has the size and mtime it had then.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    char hash[HASH_LENGTH+1];
+    unsigned char *chunks;
+    int chunk_count;
+} RecordedMD5;
+
+static pthread_mutex_t recorded_lock = PTHREAD_MUTEX_INITIALIZER;
+static RecordedMD5 *recorded;
+static int recorded_count;
+static int recorded_capacity;
+
+void nandroid_md5_record(const char *path, const unsigned char *digest,
+                         const unsigned char *chunks, int chunk_count) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return;
+
+    unsigned char *copy = NULL;
+    if (chunks != NULL && chunk_count > 0) {
+        copy = malloc(chunk_count * MD5_DIGEST_LENGTH);
+        if (copy != NULL)
+            memcpy(copy, chunks, chunk_count * MD5_DIGEST_LENGTH);
+    }
+
+    pthread_mutex_lock(&recorded_lock);
+    int i;
+    for (i = 0; i < recorded_count; i++) {
+        if (recorded[i].dev == st.st_dev && recorded[i].ino == st.st_ino)
+            break;
+    }
+    if (i == recorded_count) {
+        if (recorded_count == recorded_capacity) {
+            int capacity = recorded_capacity ? 2 * recorded_capacity : 16;
+            RecordedMD5 *r = realloc(recorded, capacity * sizeof(RecordedMD5));
+            if (r == NULL) {
+                LOGI("Not keeping MD5 of %s\n", path);
+                free(copy);
+                goto out;
+            }
+            recorded = r;
+            recorded_capacity = capacity;
+        }
+        recorded_count++;
     } else {
-       return 1;
+        free(recorded[i].chunks);
     }
+    recorded[i].dev = st.st_dev;
+    recorded[i].ino = st.st_ino;
+    recorded[i].size = st.st_size;
+    recorded[i].mtime = st.st_mtime;
+    to_md5_hash(recorded[i].hash, digest);
+    recorded[i].chunks = copy;
+    recorded[i].chunk_count = copy != NULL ? chunk_count : 0;
+out:
+    pthread_mutex_unlock(&recorded_lock);
+}
+
+static int find_recorded_md5(char *str, const char *path) {
+    struct stat st;
+    int ret = 1;
+    if (stat(path, &st) != 0)
+        return 1;
+
+    pthread_mutex_lock(&recorded_lock);
+    int i;
+    for (i = 0; i < recorded_count; i++) {
+        if (recorded[i].dev == st.st_dev && recorded[i].ino == st.st_ino) {
+            if (recorded[i].size == st.st_size && recorded[i].mtime == st.st_mtime) {
+                strcpy(str, recorded[i].hash);
+                ret = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&recorded_lock);
+    return ret;
+}
+
+// Adds the chunk digests recorded for path, if still valid, to nandroid.chunks.
+static void write_recorded_chunks(FILE *f, const char *path, const char *filename) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return;
+
+    pthread_mutex_lock(&recorded_lock);
+    int i;
+    for (i = 0; i < recorded_count; i++) {
+        if (recorded[i].dev == st.st_dev && recorded[i].ino == st.st_ino) {
+            if (recorded[i].size == st.st_size && recorded[i].mtime == st.st_mtime &&
+                    recorded[i].chunks != NULL)
+                nandroid_chunks_write_entry(f, filename, st.st_size, recorded[i].chunks,
+                                            recorded[i].chunk_count);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&recorded_lock);
+}
 
+void nandroid_md5_forget_recorded() {
+    int i;
+    pthread_mutex_lock(&recorded_lock);
+    for (i = 0; i < recorded_count; i++)
+        free(recorded[i].chunks);
+    free(recorded);
+    recorded = NULL;
+    recorded_count = recorded_capacity = 0;
+    pthread_mutex_unlock(&recorded_lock);
+}
+
+// Files are hashed by a few workers at once: one stream is rarely enough
+// to keep eMMC or a fast card busy.
+typedef struct {
+    const char *path;
+    const char *expected;   // stop all workers if the hash isn't this
+    char hash[HASH_LENGTH+1];
+    int ret;                // 0 hashed (or known), 1 unreadable, -1 to do
+} MD5Job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    MD5Job *jobs;
+    int count;
+    int next;
+    volatile int stop;
+} MD5Pool;
+
+static int calculate_md5(char *str, const char *path, unsigned char *buf,
+                         volatile int *stop) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    MD5_CTX c;
+    unsigned char md5dig[MD5_DIGEST_LENGTH];
+    ssize_t n;
+    MD5_Init(&c);
+    while ((n = read(fd, buf, READ_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return 1;
+        }
+        if (*stop) {
+            close(fd);
+            return -1;
+        }
+        MD5_Update(&c, buf, n);
+    }
+    close(fd);
+    MD5_Final(md5dig, &c);
+    to_md5_hash(str, md5dig);
     return 0;
 }
 
+static void *md5_worker(void *cookie) {
+    MD5Pool *pool = (MD5Pool *)cookie;
+    unsigned char *buf = malloc(READ_SIZE);
+    if (buf == NULL)
+        return NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < pool->count && pool->jobs[pool->next].ret == 0)
+            pool->next++;
+        int i = pool->next < pool->count && !pool->stop ? pool->next++ : -1;
+        pthread_mutex_unlock(&pool->lock);
+        if (i < 0)
+            break;
+
+        MD5Job *job = &pool->jobs[i];
+        job->ret = calculate_md5(job->hash, job->path, buf, &pool->stop);
+        if (job->ret == 0 && job->expected != NULL && strcmp(job->hash, job->expected) != 0)
+            pool->stop = 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Hashes the jobs with ret -1.  Those left undone because a worker found
+// a mismatch keep it.
+static void calculate_md5s(MD5Job *jobs, int count) {
+    MD5Pool pool;
+    pthread_t threads[MAX_MD5_WORKERS];
+    int i, nthreads;
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.jobs = jobs;
+    pool.count = count;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus < 1 ? 1 : (cpus > MAX_MD5_WORKERS ? MAX_MD5_WORKERS : cpus);
+    if (nthreads > count)
+        nthreads = count;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, md5_worker, &pool) != 0)
+            break;
+    }
+    nthreads = i;
+    if (nthreads == 0)
+        md5_worker(&pool);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+}
+
 static int is_selected_for_restore(const char *file, const unsigned char flags) {
     int check_boot = ((flags & NANDROID_BOOT) == NANDROID_BOOT);
     int check_system = ((flags & NANDROID_SYSTEM) == NANDROID_SYSTEM);
@@ -92,18 +330,138 @@ static int is_selected_for_restore(const char *file, const unsigned char flags)
     return 0;
 }
 
+// Files whose MD5 nandroid_restore_md5_check() left to be checked chunk
+// by chunk while they are restored, by inode.  If that can't happen, the
+// restore has to check them some other way first.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    char hash[HASH_LENGTH+1];
+} DeferredMD5;
+
+static DeferredMD5 *deferred_md5s;
+static int deferred_count;
+
+static void forget_deferred() {
+    free(deferred_md5s);
+    deferred_md5s = NULL;
+    deferred_count = 0;
+}
+
+static int defer_md5(const struct stat *st, const char *hash, int capacity) {
+    if (deferred_md5s == NULL) {
+        deferred_md5s = malloc(capacity * sizeof(DeferredMD5));
+        if (deferred_md5s == NULL)
+            return -1;
+    }
+    deferred_md5s[deferred_count].dev = st->st_dev;
+    deferred_md5s[deferred_count].ino = st->st_ino;
+    strcpy(deferred_md5s[deferred_count].hash, hash);
+    deferred_count++;
+    return 0;
+}
+
+static const char *find_deferred(const struct stat *st) {
+    int i;
+    for (i = 0; i < deferred_count; i++) {
+        if (deferred_md5s[i].dev == st->st_dev && deferred_md5s[i].ino == st->st_ino)
+            return deferred_md5s[i].hash;
+    }
+    return NULL;
+}
+
+int nandroid_md5_deferred(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && find_deferred(&st) != NULL;
+}
+
+int nandroid_md5_check_deferred(const char *archive) {
+    char tmp[PATH_MAX];
+    char dir[PATH_MAX];
+    char base[PATH_MAX];
+    StringList paths = { NULL, 0, 0 };
+    MD5Job *jobs = NULL;
+    int ret = 0;
+    int i;
+
+    if (deferred_count == 0)
+        return 0;
+
+    // dirname() and basename() may modify their argument or return static storage
+    snprintf(tmp, PATH_MAX, "%s", archive);
+    snprintf(dir, PATH_MAX, "%s", dirname(tmp));
+    snprintf(tmp, PATH_MAX, "%s", archive);
+    snprintf(base, PATH_MAX, "%s", basename(tmp));
+
+    // the files "cat archive*" would read
+    DIR *dp = opendir(dir);
+    if (dp == NULL) {
+        LOGE("Unable to open %s\n", dir);
+        return -1;
+    }
+    struct dirent *ep;
+    size_t len = strlen(base);
+    while ((ep = readdir(dp)) != NULL) {
+        if (strncmp(ep->d_name, base, len) != 0)
+            continue;
+        if (list_add(&paths, path_join(dir, ep->d_name)) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    closedir(dp);
+
+    if (ret == 0 && paths.count > 0 && (jobs = calloc(paths.count, sizeof(MD5Job))) == NULL)
+        ret = -1;
+    if (ret != 0) {
+        LOGE("Out of memory for MD5 check\n");
+        goto out;
+    }
+
+    int count = 0;
+    for (i = 0; i < paths.count; i++) {
+        struct stat st;
+        const char *expected;
+        if (stat(paths.items[i], &st) != 0 || (expected = find_deferred(&st)) == NULL)
+            continue;
+        jobs[count].path = paths.items[i];
+        jobs[count].expected = expected;
+        jobs[count].ret = -1;
+        count++;
+    }
+    if (count == 0)
+        goto out;
+
+    ui_print("Checking MD5 sums before restoring %s...\n", base);
+    calculate_md5s(jobs, count);
+    for (i = 0; i < count; i++) {
+        if (jobs[i].ret > 0) {
+            LOGE("Unable to check MD5 of %s\n", jobs[i].path);
+            ret = -1;
+        } else if (jobs[i].ret < 0 || strcmp(jobs[i].hash, jobs[i].expected) != 0) {
+            // not hashed when another file already didn't match
+            if (jobs[i].ret == 0)
+                LOGE("MD5 mismatch for %s\n", jobs[i].path);
+            ret = -1;
+        }
+    }
+
+out:
+    free(jobs);
+    list_free(&paths);
+    return ret;
+}
+
 int nandroid_backup_md5_gen(const char *backup_path) {
     DIR *dp;
     FILE *fd;
     int i = 0;
-    int j = 0;
     int len = 0;
     int ret = 0;
-    int filecount = 0;
-
-    // Dynamically allocated, free them at the end
-    char *filenames[MAX_FILES_CHECKED];
-    char *filepaths[MAX_FILES_CHECKED];
+    int hashed = 0;
+    StringList filenames = { NULL, 0, 0 };
+    StringList filepaths = { NULL, 0, 0 };
+    MD5Job *jobs = NULL;
 
     char path[PATH_MAX];
     snprintf(path, PATH_MAX, "%s", backup_path);
@@ -117,29 +475,44 @@ int nandroid_backup_md5_gen(const char *backup_path) {
     dp = opendir(path);
     if (dp != NULL) {
         struct dirent *ep;
-        while ((ep = readdir(dp)) && i < MAX_FILES_CHECKED) {
+        while ((ep = readdir(dp))) {
             if (strcmp(ep->d_name, ".") != 0 && strcmp(ep->d_name, "..") != 0
                     && strcmp(ep->d_name, "recovery.log") != 0
-                    && strcmp(ep->d_name, "nandroid.md5") != 0) {
-                len = strlen(ep->d_name);
-                filenames[i] = malloc(sizeof(char[len+1]));
-                snprintf(filenames[i], len+1, "%s", ep->d_name);
-
-                len += 1 + strlen(path);
-                filepaths[i] = malloc(sizeof(char[len+1]));
-                snprintf(filepaths[i], len+1, "%s/%s", path, ep->d_name);
-                i++;
+                    && strcmp(ep->d_name, "nandroid.md5") != 0
+                    && strcmp(ep->d_name, NANDROID_CHUNKS_FILE) != 0) {
+                if (list_add(&filenames, strdup(ep->d_name)) != 0 ||
+                        list_add(&filepaths, path_join(path, ep->d_name)) != 0) {
+                    ret = -1;
+                    LOGE("Out of memory listing %s\n", path);
+                    closedir(dp);
+                    goto out;
+                }
             }
         }
         closedir(dp);
-        filecount = i;
     }
-    if (filecount == 0) {
+    if (filenames.count == 0) {
         ret = -1;
         LOGE("No files found in %s for MD5 generation\n", path);
         goto out;
     }
 
+    // Most files were hashed as they were written; read back the rest
+    jobs = calloc(filenames.count, sizeof(MD5Job));
+    if (jobs == NULL) {
+        ret = -1;
+        LOGE("Out of memory for MD5 generation\n");
+        goto out;
+    }
+    for (i = 0; i < filenames.count; i++) {
+        jobs[i].path = filepaths.items[i];
+        jobs[i].ret = find_recorded_md5(jobs[i].hash, filepaths.items[i]) == 0 ? 0 : -1;
+        if (jobs[i].ret != 0)
+            hashed++;
+    }
+    if (hashed > 0)
+        calculate_md5s(jobs, filenames.count);
+
     // Prepare backup_path/nandroid.md5 for writing
     char md5path[PATH_MAX];
     snprintf(md5path, PATH_MAX, "%s/%s", path, "nandroid.md5");
@@ -150,26 +523,39 @@ int nandroid_backup_md5_gen(const char *backup_path) {
         goto out;
     }
 
-    // Generate MD5s and save to nandroid.md5
-    char md5calc[HASH_LENGTH+1];
-    char tmp[PATH_MAX];
-    for (i = 0; i < filecount; i++) {
-        if (calculate_md5(md5calc, filepaths[i]) != 0) {
-            LOGE("Unable to generate MD5 for %s\n", filenames[i]);
+    // Save MD5s to nandroid.md5
+    for (i = 0; i < filenames.count; i++) {
+        if (jobs[i].ret != 0) {
+            LOGE("Unable to generate MD5 for %s\n", filenames.items[i]);
             // Attempt to continue for other files
         } else {
-            snprintf(tmp, PATH_MAX, "%s  %s\n", md5calc, filenames[i]);
-            fputs(tmp, fd);
+            fprintf(fd, "%s  %s\n", jobs[i].hash, filenames.items[i]);
         }
     }
     fclose(fd);
+
+    // Tar volumes also get their chunk digests, so restore can check them
+    // as it reads them
+    snprintf(md5path, PATH_MAX, "%s/%s", path, NANDROID_CHUNKS_FILE);
+    fd = fopen(md5path, "w");
+    if (fd == NULL) {
+        LOGI("Unable to create %s\n", NANDROID_CHUNKS_FILE);
+    } else {
+        nandroid_chunks_write_header(fd);
+        for (i = 0; i < filenames.count; i++) {
+            if (jobs[i].ret == 0)
+                write_recorded_chunks(fd, filepaths.items[i], filenames.items[i]);
+        }
+        fclose(fd);
+    }
+    LOGI("MD5: %d of %d files read back\n", hashed, filenames.count);
     ui_print("MD5 checksums generated\n");
 
 out:
-    for (i = 0; i < filecount; i++) {
-        free(filenames[i]);
-        free(filepaths[i]);
-    }
+    free(jobs);
+    list_free(&filenames);
+    list_free(&filepaths);
+    nandroid_md5_forget_recorded();
 
     return ret;
 }
@@ -183,18 +569,22 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
     int ret = 0;
     int filecount = 0;
     int md5count = 0;
+    MD5Job *jobs = NULL;
+    NandroidChunks *chunks = NULL;
     int use_ui = is_ui_initialized();
 
+    forget_deferred();
     if (empty_nandroid_bitmask(flags)) {
         LOGE("Nothing selected for restore.\n");
         return -1;
     }
 
     // Dynamically allocated, free them at the end
-    char *filenames[MAX_FILES_CHECKED];
-    char *filepaths[MAX_FILES_CHECKED];
-    char *md5files[MAX_FILES_CHECKED];
-    char *md5hashes[MAX_FILES_CHECKED];
+    StringList filenames_list = { NULL, 0, 0 };
+    StringList filepaths_list = { NULL, 0, 0 };
+    StringList md5files_list = { NULL, 0, 0 };
+    StringList md5hashes_list = { NULL, 0, 0 };
+    char **filenames, **filepaths, **md5files, **md5hashes;
     int mf_allocated = 0; // for MissingFiles *mf
     int mm_allocated = 0; // for MissingFiles *mm
 
@@ -210,21 +600,22 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
     dp = opendir(path);
     if (dp != NULL) {
         struct dirent *ep;
-        while ((ep = readdir(dp)) && i < MAX_FILES_CHECKED) {
+        while ((ep = readdir(dp))) {
             if (is_selected_for_restore(ep->d_name, flags)) {
-                len = strlen(ep->d_name);
-                filenames[i] = malloc(sizeof(char[len+1]));
-                snprintf(filenames[i], len+1, "%s", ep->d_name);
-
-                len += 1 + strlen(path);
-                filepaths[i] = malloc(sizeof(char[len+1]));
-                snprintf(filepaths[i], len+1, "%s/%s", path, ep->d_name);
-                i++;
+                if (list_add(&filenames_list, strdup(ep->d_name)) != 0 ||
+                        list_add(&filepaths_list, path_join(path, ep->d_name)) != 0) {
+                    ret = -1;
+                    LOGE("Out of memory listing %s\n", path);
+                    closedir(dp);
+                    goto out;
+                }
             }
         }
         closedir(dp);
-        filecount = i;
     }
+    filecount = filenames_list.count;
+    filenames = filenames_list.items;
+    filepaths = filepaths_list.items;
     if (filecount == 0) {
         ret = -1;
         LOGE("No backup files found in %s\n", path);
@@ -238,23 +629,27 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
     fd = fopen(md5path, "r");
     if (fd != NULL) {
         char tmp[PATH_MAX];
-        while (fgets(tmp, PATH_MAX, fd) && i < MAX_FILES_CHECKED) {
+        while (fgets(tmp, PATH_MAX, fd)) {
             if (tmp[strlen(tmp)-1] == '\n')
                 tmp[strlen(tmp)-1] = '\0';
+            // md5 hash is followed by two spaces
+            if (strlen(tmp) <= HASH_LENGTH+2)
+                continue;
             if (is_selected_for_restore(tmp, flags)) {
-                md5hashes[i] = malloc(sizeof(char[HASH_LENGTH+1]));
-                snprintf(md5hashes[i], HASH_LENGTH+1, "%s", tmp);
-
-                // md5 hash is followed by two spaces
-                len = strlen(tmp) - (HASH_LENGTH+2);
-                md5files[i] = malloc(sizeof(char[len+1]));
-                snprintf(md5files[i], len+1, "%s", &tmp[HASH_LENGTH+2]);
-                i++;
+                if (list_add(&md5hashes_list, strndup(tmp, HASH_LENGTH)) != 0 ||
+                        list_add(&md5files_list, strdup(&tmp[HASH_LENGTH+2])) != 0) {
+                    ret = -1;
+                    LOGE("Out of memory reading %s\n", md5path);
+                    fclose(fd);
+                    goto out;
+                }
             }
         }
         fclose(fd);
-        md5count = i;
     }
+    md5count = md5files_list.count;
+    md5files = md5files_list.items;
+    md5hashes = md5hashes_list.items;
 
 #if DEBUG_MD5_CHECKER
     LOGI("[MD5] backup_path: %s\n", path);
@@ -393,48 +788,77 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
         goto out;
     }
 
-    // Compare MD5s of non-missing files that are selected for restore
+    // Compare MD5s of non-missing files that are selected for restore.
+    // Those listed in nandroid.chunks are checked while they are restored.
     int md5matches = 0;
-    char md5calc[HASH_LENGTH+1];
+    int deferred = 0;
+    chunks = nandroid_chunks_load(path);
+    jobs = calloc(filecount, sizeof(MD5Job));
+    if (jobs == NULL) {
+        ret = -1;
+        LOGE("Out of memory for MD5 check\nAborting\n");
+        goto out;
+    }
     for (i = 0; i < filecount; i++) {
+        jobs[i].path = filepaths[i];
+        jobs[i].ret = 0;
         if (!is_selected_for_restore(filenames[i], flags))
             continue;
         for (j = 0; j < md5count; j++) {
             if (strcmp(filenames[i], md5files[j]) == 0) {
-                if (calculate_md5(md5calc, filepaths[i]) != 0) {
-                    ret = -1;
-                    LOGE("Unable to check MD5 of %s\nAborting\n", filenames[i]);
-                    goto out;
-                }
-                if (strcmp(md5calc, md5hashes[j]) != 0) {
-                    ret = -1;
-                    LOGE("MD5 mismatch for %s\nAborting\n", filenames[i]);
-                    goto out;
-                } else {
-                    md5matches++;
-                }
+                jobs[i].expected = md5hashes[j];
+                jobs[i].ret = -1;
             }
         }
+        struct stat st;
+        if (jobs[i].expected != NULL && chunks != NULL && stat(filepaths[i], &st) == 0 &&
+                nandroid_chunks_covers(chunks, filenames[i], st.st_size) &&
+                defer_md5(&st, jobs[i].expected, filecount) == 0) {
+            jobs[i].expected = NULL;
+            jobs[i].ret = 0;
+            deferred++;
+        }
     }
-    if (md5matches) {
+    calculate_md5s(jobs, filecount);
+    for (i = 0; i < filecount; i++) {
+        if (jobs[i].expected == NULL)
+            continue;
+        if (jobs[i].ret > 0) {
+            ret = -1;
+            LOGE("Unable to check MD5 of %s\nAborting\n", filenames[i]);
+            goto out;
+        }
+        if (jobs[i].ret < 0) {
+            // skipped after another file failed
+            continue;
+        }
+        if (strcmp(jobs[i].hash, jobs[i].expected) != 0) {
+            ret = -1;
+            LOGE("MD5 mismatch for %s\nAborting\n", filenames[i]);
+            goto out;
+        } else {
+            md5matches++;
+        }
+    }
+    if (deferred) {
+        ui_print("MD5 checksums verified, %d files to check while restoring\n", deferred);
+    } else if (md5matches) {
         ui_print("All MD5 checksums verified\n");
     } else {
         ui_print("No MD5 verification performed\n");
     }
 
 out:
+    nandroid_chunks_free(chunks);
     if (mf_allocated)
         free(mf);
     if (mm_allocated)
         free(mm);
-    for (i = 0; i < filecount; i++) {
-        free(filenames[i]);
-        free(filepaths[i]);
-    }
-    for (i = 0; i < md5count; i++) {
-        free(md5files[i]);
-        free(md5hashes[i]);
-    }
+    free(jobs);
+    list_free(&filenames_list);
+    list_free(&filepaths_list);
+    list_free(&md5files_list);
+    list_free(&md5hashes_list);
 
     return ret;
 }
@@ -19,7 +19,23 @@
 
 #define DEBUG_MD5_CHECKER 0
 
+// Remember the MD5 of a backup file computed while it was written, so
+// nandroid_backup_md5_gen() doesn't have to read it back.  Called once the
+// whole file is written; safe to call from any thread.  chunks, if not
+// NULL, holds the digests of its NANDROID_CHUNK_SIZE pieces for
+// nandroid.chunks.
+void nandroid_md5_record(const char *path, const unsigned char *digest,
+                         const unsigned char *chunks, int chunk_count);
+// Drop digests left over from a backup that never got to its nandroid.md5.
+void nandroid_md5_forget_recorded();
+
 int nandroid_backup_md5_gen(const char *backup_path);
 int nandroid_restore_md5_check(const char *backup_path, unsigned char flags);
+// Whether the last nandroid_restore_md5_check() left path to be checked
+// while it is restored (see nandroid_chunks.h).
+int nandroid_md5_deferred(const char *path);
+// Checks the whole-file MD5 of those of archive* it left, for restoring
+// them without the chunk by chunk check.  Returns 0 if they all match.
+int nandroid_md5_check_deferred(const char *archive);
 
 #endif
@@ -0,0 +1,979 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-process replacement for the tar | pigz | split pipeline used by
+ * nandroid backups.
+ *
+ * The calling thread walks the directory and serializes a GNU tar stream
+ * into fixed size chunks.  When compressing, a pool of workers deflates
+ * the chunks in parallel the way pigz does: every chunk is a raw deflate
+ * stream primed with the last 32k of the previous chunk and terminated
+ * with a sync flush, so the concatenation is one valid gzip member.  A
+ * single writer thread emits the chunks in order into 1GB split volumes,
+ * and a hasher thread trailing it takes the MD5 of every volume for
+ * nandroid.md5, so the volumes never have to be read back.  On a single
+ * CPU the calling thread does all of this itself, chunk by chunk.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <openssl/md5.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "common.h"
+#include "nandroid_chunks.h"
+#include "nandroid_md5.h"
+#include "nandroid_tar.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_RECORD_SIZE (20 * TAR_BLOCK_SIZE)
+#define TAR_VOLUME_SIZE 1000000000LL
+#define TAR_MAX_VOLUMES 26
+
+#define CHUNK_SIZE (128 * 1024)
+#define DICT_SIZE 32768
+#define COMPRESS_LEVEL 6
+#define MAX_WORKERS 8
+
+enum {
+    CHUNK_FREE,
+    CHUNK_FILLED,
+    CHUNK_BUSY,
+    CHUNK_DONE,
+    CHUNK_WRITTEN
+};
+
+typedef struct {
+    unsigned char* in;
+    size_t in_len;
+    unsigned char* dict;
+    size_t dict_len;
+    unsigned char* out;
+    size_t out_len;
+    size_t out_cap;
+    unsigned long check;
+    int last;
+    int state;
+} TarChunk;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+} TarLink;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    TarChunk* chunks;
+    int nchunks;
+    long long produced;     // chunks handed off by the walker
+    long long claimed;      // chunks picked up by a compression worker
+    long long written;      // chunks emitted by the writer
+    long long hashed;       // chunks the hasher is done with
+    int writer_done;
+    int finished;
+    int error;
+    int compress;
+    int single;             // no threads: the walker compresses, writes and hashes
+    z_stream strm;          // the walker's deflate stream when single
+
+    // walker state
+    TarChunk* cur;
+    size_t name_offset;
+    const char** excludes;
+    tar_event_callback callback;
+    tar_progress_callback progress;
+    TarLink* links;
+    int link_count;
+    int link_capacity;
+    int warnings;
+
+    // writer state
+    const char* archive;
+    int volume;
+    int volume_fd;
+    long long volume_bytes;
+    unsigned long crc;
+    unsigned long long total_in;
+    unsigned long long total_out;
+    unsigned char gzip_header[10];
+    unsigned char gzip_trailer[8];
+
+    // hasher state
+    MD5_CTX md5;
+    int md5_volume;
+    long long md5_bytes;
+    MD5_CTX chunk_md5;
+    long long chunk_bytes;
+    unsigned char* chunk_digests;   // this volume's, for nandroid.chunks
+    int chunk_count;
+    int chunk_capacity;
+    int chunks_lost;
+} TarStream;
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+static int write_all(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Runs on the writer thread only.
+static int tar_volume_write(TarStream* s, const unsigned char* data, size_t len) {
+    char path[PATH_MAX];
+    while (len > 0) {
+        if (s->volume_fd < 0) {
+            if (s->volume >= TAR_MAX_VOLUMES) {
+                LOGE("Too many volumes for %s\n", s->archive);
+                return -1;
+            }
+            snprintf(path, PATH_MAX, "%s.%c", s->archive, 'a' + s->volume);
+            s->volume_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (s->volume_fd < 0) {
+                LOGE("Unable to create %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+            s->volume++;
+            s->volume_bytes = 0;
+        }
+
+        size_t n = len;
+        if ((long long)n > TAR_VOLUME_SIZE - s->volume_bytes)
+            n = TAR_VOLUME_SIZE - s->volume_bytes;
+        if (write_all(s->volume_fd, data, n) != 0) {
+            LOGE("Error writing %s volume %c (%s)\n", s->archive, 'a' + s->volume - 1, strerror(errno));
+            return -1;
+        }
+        data += n;
+        len -= n;
+        s->volume_bytes += n;
+        s->total_out += n;
+
+        if (s->volume_bytes == TAR_VOLUME_SIZE) {
+            if (close(s->volume_fd) != 0)
+                return -1;
+            s->volume_fd = -1;
+        }
+    }
+    return 0;
+}
+
+static int tar_write_gzip_header(TarStream* s) {
+    unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    unsigned long mtime = time(NULL);
+    header[4] = mtime & 0xff;
+    header[5] = (mtime >> 8) & 0xff;
+    header[6] = (mtime >> 16) & 0xff;
+    header[7] = (mtime >> 24) & 0xff;
+    memcpy(s->gzip_header, header, sizeof(header));
+    return tar_volume_write(s, header, sizeof(header));
+}
+
+static int tar_write_gzip_trailer(TarStream* s) {
+    unsigned char trailer[8];
+    unsigned long isize = (unsigned long)(s->total_in & 0xffffffff);
+    int i;
+    for (i = 0; i < 4; i++) {
+        trailer[i] = (s->crc >> (8 * i)) & 0xff;
+        trailer[i + 4] = (isize >> (8 * i)) & 0xff;
+    }
+    memcpy(s->gzip_trailer, trailer, sizeof(trailer));
+    return tar_volume_write(s, trailer, sizeof(trailer));
+}
+
+static int tar_write_chunk(TarStream* s, TarChunk* c) {
+    int ret;
+    s->total_in += c->in_len;
+    if (s->compress) {
+        ret = tar_volume_write(s, c->out, c->out_len);
+        s->crc = crc32_combine(s->crc, c->check, c->in_len);
+        if (ret == 0 && c->last)
+            ret = tar_write_gzip_trailer(s);
+    } else {
+        ret = tar_volume_write(s, c->in, c->in_len);
+    }
+    return ret;
+}
+
+static void* tar_writer_thread(void* cookie) {
+    TarStream* s = (TarStream*)cookie;
+    int ret = 0;
+
+    if (s->compress)
+        ret = tar_write_gzip_header(s);
+
+    pthread_mutex_lock(&s->lock);
+    while (ret == 0 && !s->error) {
+        TarChunk* c = &s->chunks[s->written % s->nchunks];
+        if (s->written == s->produced) {
+            if (s->finished)
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        if (c->state != CHUNK_DONE) {
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        ret = tar_write_chunk(s, c);
+
+        pthread_mutex_lock(&s->lock);
+        c->state = CHUNK_WRITTEN;
+        s->written++;
+        pthread_cond_broadcast(&s->cond);
+    }
+    if (ret != 0)
+        s->error = 1;
+    s->writer_done = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    if (s->volume_fd >= 0) {
+        if (close(s->volume_fd) != 0 && ret == 0) {
+            pthread_mutex_lock(&s->lock);
+            s->error = 1;
+            pthread_mutex_unlock(&s->lock);
+        }
+        s->volume_fd = -1;
+    }
+    return NULL;
+}
+
+static void tar_md5_chunk_done(TarStream* s) {
+    if (s->chunk_count == s->chunk_capacity && !s->chunks_lost) {
+        int capacity = s->chunk_capacity ? 2 * s->chunk_capacity : 256;
+        unsigned char* digests = realloc(s->chunk_digests, capacity * MD5_DIGEST_LENGTH);
+        if (digests == NULL) {
+            // the volume is then checked as a whole on restore
+            s->chunks_lost = 1;
+        } else {
+            s->chunk_digests = digests;
+            s->chunk_capacity = capacity;
+        }
+    }
+    if (!s->chunks_lost)
+        MD5_Final(s->chunk_digests + s->chunk_count * MD5_DIGEST_LENGTH, &s->chunk_md5);
+    s->chunk_count++;
+    s->chunk_bytes = 0;
+    MD5_Init(&s->chunk_md5);
+}
+
+// Volume bytes split exactly as tar_volume_write() splits them.
+static void tar_md5_volume_done(TarStream* s) {
+    char path[PATH_MAX];
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    if (s->chunk_bytes > 0)
+        tar_md5_chunk_done(s);
+    MD5_Final(digest, &s->md5);
+    snprintf(path, PATH_MAX, "%s.%c", s->archive, 'a' + s->md5_volume);
+    nandroid_md5_record(path, digest, s->chunks_lost ? NULL : s->chunk_digests,
+                        s->chunk_count);
+    s->md5_volume++;
+    s->md5_bytes = 0;
+    MD5_Init(&s->md5);
+    s->chunk_count = 0;
+    s->chunks_lost = 0;
+}
+
+static void tar_md5_update(TarStream* s, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        size_t n = len;
+        if ((long long)n > TAR_VOLUME_SIZE - s->md5_bytes)
+            n = TAR_VOLUME_SIZE - s->md5_bytes;
+        if ((long long)n > NANDROID_CHUNK_SIZE - s->chunk_bytes)
+            n = NANDROID_CHUNK_SIZE - s->chunk_bytes;
+        MD5_Update(&s->md5, data, n);
+        MD5_Update(&s->chunk_md5, data, n);
+        data += n;
+        len -= n;
+        s->md5_bytes += n;
+        s->chunk_bytes += n;
+        if (s->chunk_bytes == NANDROID_CHUNK_SIZE)
+            tar_md5_chunk_done(s);
+        if (s->md5_bytes == TAR_VOLUME_SIZE)
+            tar_md5_volume_done(s);
+    }
+}
+
+static void tar_hash_chunk(TarStream* s, TarChunk* c) {
+    if (s->compress) {
+        if (s->hashed == 0)
+            tar_md5_update(s, s->gzip_header, sizeof(s->gzip_header));
+        tar_md5_update(s, c->out, c->out_len);
+        if (c->last)
+            tar_md5_update(s, s->gzip_trailer, sizeof(s->gzip_trailer));
+    } else {
+        tar_md5_update(s, c->in, c->in_len);
+    }
+}
+
+static void tar_hash_finish(TarStream* s, int error) {
+    if (!error && s->md5_bytes > 0)
+        tar_md5_volume_done(s);
+    free(s->chunk_digests);
+    s->chunk_digests = NULL;
+}
+
+// Hashes every chunk once it has been written, then recycles it.  A
+// volume's digest is recorded only after all of it has been written.
+static void* tar_hash_thread(void* cookie) {
+    TarStream* s = (TarStream*)cookie;
+
+    MD5_Init(&s->md5);
+    MD5_Init(&s->chunk_md5);
+    pthread_mutex_lock(&s->lock);
+    while (!s->error) {
+        if (s->hashed == s->written) {
+            if (s->writer_done)
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        TarChunk* c = &s->chunks[s->hashed % s->nchunks];
+        pthread_mutex_unlock(&s->lock);
+
+        tar_hash_chunk(s, c);
+
+        pthread_mutex_lock(&s->lock);
+        c->state = CHUNK_FREE;
+        s->hashed++;
+        pthread_cond_broadcast(&s->cond);
+    }
+    int error = s->error;
+    pthread_mutex_unlock(&s->lock);
+
+    tar_hash_finish(s, error);
+    return NULL;
+}
+
+static int tar_compress_chunk(z_stream* strm, TarChunk* c) {
+    int ret;
+
+    c->check = crc32(crc32(0L, Z_NULL, 0), c->in, c->in_len);
+
+    deflateReset(strm);
+    if (c->dict_len > 0)
+        deflateSetDictionary(strm, c->dict, c->dict_len);
+    strm->next_in = c->in;
+    strm->avail_in = c->in_len;
+    strm->next_out = c->out;
+    strm->avail_out = c->out_cap;
+    ret = deflate(strm, c->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (c->last ? ret != Z_STREAM_END : (ret != Z_OK || strm->avail_in != 0))
+        return -1;
+
+    c->out_len = c->out_cap - strm->avail_out;
+    return 0;
+}
+
+static void* tar_compress_thread(void* cookie) {
+    TarStream* s = (TarStream*)cookie;
+    z_stream strm;
+    int ret = 0;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, COMPRESS_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        pthread_mutex_lock(&s->lock);
+        s->error = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->error) {
+        if (s->claimed == s->produced) {
+            if (s->finished)
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        TarChunk* c = &s->chunks[s->claimed % s->nchunks];
+        s->claimed++;
+        c->state = CHUNK_BUSY;
+        pthread_mutex_unlock(&s->lock);
+
+        ret = tar_compress_chunk(&strm, c);
+
+        pthread_mutex_lock(&s->lock);
+        if (ret != 0)
+            s->error = 1;
+        c->state = CHUNK_DONE;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    deflateEnd(&strm);
+    return NULL;
+}
+
+// With a single CPU the threads would only take turns on it, and the
+// hand-offs between them cost more than they overlap: do the work of
+// all of them in turn, on the one chunk.
+static int tar_stream_process(TarStream* s, TarChunk* c) {
+    if ((s->compress && tar_compress_chunk(&s->strm, c) != 0) || tar_write_chunk(s, c) != 0) {
+        s->error = 1;
+        return -1;
+    }
+    tar_hash_chunk(s, c);
+    s->written++;
+    s->hashed++;
+    return 0;
+}
+
+// Hand the current chunk to the workers (or straight to the writer) and
+// wait for the next slot to be recycled.
+static int tar_stream_submit(TarStream* s, int last) {
+    TarChunk* prev = s->cur;
+    TarChunk* next = prev;
+
+    if (s->single) {
+        prev->last = last;
+        s->produced++;
+        if (last)
+            s->finished = 1;
+        if (tar_stream_process(s, prev) != 0)
+            return -1;
+        if (last)
+            return 0;
+        goto recycle;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    prev->last = last;
+    prev->state = s->compress ? CHUNK_FILLED : CHUNK_DONE;
+    s->produced++;
+    if (last)
+        s->finished = 1;
+    pthread_cond_broadcast(&s->cond);
+    if (last) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    next = &s->chunks[s->produced % s->nchunks];
+    while (!s->error && next->state != CHUNK_FREE)
+        pthread_cond_wait(&s->cond, &s->lock);
+    int error = s->error;
+    pthread_mutex_unlock(&s->lock);
+    if (error)
+        return -1;
+
+recycle:
+    if (s->progress)
+        s->progress(s->produced * (unsigned long long)CHUNK_SIZE);
+
+    // Only the walker refills chunks, so prev->in is stable while we copy.
+    // When single, prev is next: take the dictionary before emptying it.
+    size_t dict_len = 0;
+    if (s->compress) {
+        dict_len = prev->in_len < DICT_SIZE ? prev->in_len : DICT_SIZE;
+        memcpy(next->dict, prev->in + prev->in_len - dict_len, dict_len);
+    }
+    next->dict_len = dict_len;
+    next->in_len = 0;
+    s->cur = next;
+    return 0;
+}
+
+static unsigned char* tar_stream_space(TarStream* s, size_t* room) {
+    if (s->cur->in_len == CHUNK_SIZE && tar_stream_submit(s, 0) != 0)
+        return NULL;
+    *room = CHUNK_SIZE - s->cur->in_len;
+    return s->cur->in + s->cur->in_len;
+}
+
+static int tar_stream_write(TarStream* s, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    while (len > 0) {
+        size_t room;
+        unsigned char* dst = tar_stream_space(s, &room);
+        if (dst == NULL)
+            return -1;
+        if (room > len)
+            room = len;
+        if (p != NULL) {
+            memcpy(dst, p, room);
+            p += room;
+        } else {
+            memset(dst, 0, room);
+        }
+        s->cur->in_len += room;
+        len -= room;
+    }
+    return 0;
+}
+
+static int tar_stream_pad(TarStream* s, unsigned long long size) {
+    size_t rem = size % TAR_BLOCK_SIZE;
+    if (rem == 0)
+        return 0;
+    return tar_stream_write(s, NULL, TAR_BLOCK_SIZE - rem);
+}
+
+static void tar_octal(char* field, int size, unsigned long long value) {
+    if ((value >> (3 * (size - 1))) != 0) {
+        // GNU base-256 encoding for values that do not fit in octal
+        int i;
+        for (i = size - 1; i > 0; i--) {
+            field[i] = value & 0xff;
+            value >>= 8;
+        }
+        field[0] = (char)0x80;
+        return;
+    }
+    char tmp[24];
+    snprintf(tmp, sizeof(tmp), "%0*llo", size - 1, value);
+    memcpy(field, tmp, size);
+}
+
+static int tar_write_header(TarStream* s, const char* name, const struct stat* st,
+                            char type, unsigned long long size, const char* linkname);
+
+static int tar_write_long_name(TarStream* s, const char* name, char type) {
+    struct stat st;
+    size_t len = strlen(name) + 1;
+    memset(&st, 0, sizeof(st));
+    if (tar_write_header(s, "././@LongLink", &st, type, len, NULL) != 0)
+        return -1;
+    if (tar_stream_write(s, name, len) != 0)
+        return -1;
+    return tar_stream_pad(s, len);
+}
+
+static int tar_write_header(TarStream* s, const char* name, const struct stat* st,
+                            char type, unsigned long long size, const char* linkname) {
+    struct tar_header h;
+    unsigned int sum = 0;
+    size_t i;
+
+    if (strlen(name) >= sizeof(h.name) && tar_write_long_name(s, name, 'L') != 0)
+        return -1;
+    if (linkname != NULL && strlen(linkname) >= sizeof(h.linkname) && tar_write_long_name(s, linkname, 'K') != 0)
+        return -1;
+
+    memset(&h, 0, sizeof(h));
+    strncpy(h.name, name, sizeof(h.name));
+    tar_octal(h.mode, sizeof(h.mode), st->st_mode & 07777);
+    tar_octal(h.uid, sizeof(h.uid), st->st_uid);
+    tar_octal(h.gid, sizeof(h.gid), st->st_gid);
+    tar_octal(h.size, sizeof(h.size), size);
+    tar_octal(h.mtime, sizeof(h.mtime), st->st_mtime);
+    h.typeflag = type;
+    if (linkname != NULL)
+        strncpy(h.linkname, linkname, sizeof(h.linkname));
+    memcpy(h.magic, "ustar ", 6);
+    memcpy(h.version, " ", 2);
+    if (type == '3' || type == '4') {
+        tar_octal(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+        tar_octal(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+    }
+
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    for (i = 0; i < sizeof(h); i++)
+        sum += ((unsigned char*)&h)[i];
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+    h.chksum[7] = ' ';
+
+    return tar_stream_write(s, &h, sizeof(h));
+}
+
+static int tar_write_file_data(TarStream* s, const char* path, unsigned long long size) {
+    unsigned long long remaining = size;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Unable to open %s (%s)\n", path, strerror(errno));
+        s->warnings++;
+    } else {
+        while (remaining > 0) {
+            size_t room;
+            unsigned char* dst = tar_stream_space(s, &room);
+            if (dst == NULL) {
+                close(fd);
+                return -1;
+            }
+            if (room > remaining)
+                room = remaining;
+            ssize_t n = read(fd, dst, room);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            s->cur->in_len += n;
+            remaining -= n;
+        }
+        close(fd);
+        if (remaining > 0) {
+            LOGE("%s: file shrank by %llu bytes; padding with zeros\n", path, remaining);
+            s->warnings++;
+        }
+    }
+
+    // The header already promised size bytes, so keep the archive consistent.
+    if (remaining > 0 && tar_stream_write(s, NULL, remaining) != 0)
+        return -1;
+    return tar_stream_pad(s, size);
+}
+
+static int tar_is_excluded(TarStream* s, const char* name) {
+    const char** pattern;
+    if (s->excludes == NULL)
+        return 0;
+    for (pattern = s->excludes; *pattern != NULL; pattern++) {
+        if (fnmatch(*pattern, name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Returns the member name of an earlier link to the same inode, or records
+// this one so later links can refer to it.
+static const char* tar_find_hardlink(TarStream* s, const struct stat* st, const char* name) {
+    int i;
+    for (i = 0; i < s->link_count; i++) {
+        if (s->links[i].dev == st->st_dev && s->links[i].ino == st->st_ino)
+            return s->links[i].name;
+    }
+
+    if (s->link_count == s->link_capacity) {
+        int capacity = s->link_capacity ? s->link_capacity * 2 : 16;
+        TarLink* links = realloc(s->links, capacity * sizeof(TarLink));
+        if (links == NULL)
+            return NULL;
+        s->links = links;
+        s->link_capacity = capacity;
+    }
+    s->links[s->link_count].dev = st->st_dev;
+    s->links[s->link_count].ino = st->st_ino;
+    s->links[s->link_count].name = strdup(name);
+    s->link_count++;
+    return NULL;
+}
+
+static int tar_add_path(TarStream* s, char* path, size_t len) {
+    const char* name = path + s->name_offset;
+    char member[PATH_MAX];
+    struct stat st;
+
+    if (tar_is_excluded(s, name))
+        return 0;
+
+    if (lstat(path, &st) != 0) {
+        LOGE("Unable to stat %s (%s)\n", path, strerror(errno));
+        s->warnings++;
+        return 0;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        snprintf(member, PATH_MAX, "%s/", name);
+        if (s->callback)
+            s->callback(member);
+        if (tar_write_header(s, member, &st, '5', 0, NULL) != 0)
+            return -1;
+
+        DIR* dp = opendir(path);
+        if (dp == NULL) {
+            LOGE("Unable to open directory %s (%s)\n", path, strerror(errno));
+            s->warnings++;
+            return 0;
+        }
+        struct dirent* ep;
+        int ret = 0;
+        while (ret == 0 && (ep = readdir(dp)) != NULL) {
+            if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+                continue;
+            size_t child_len = len + 1 + strlen(ep->d_name);
+            if (child_len >= PATH_MAX) {
+                LOGE("Path too long: %s/%s\n", path, ep->d_name);
+                s->warnings++;
+                continue;
+            }
+            path[len] = '/';
+            strcpy(path + len + 1, ep->d_name);
+            ret = tar_add_path(s, path, child_len);
+            path[len] = '\0';
+        }
+        closedir(dp);
+        return ret;
+    }
+
+    if (s->callback)
+        s->callback(name);
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_nlink > 1) {
+            const char* target = tar_find_hardlink(s, &st, name);
+            if (target != NULL)
+                return tar_write_header(s, name, &st, '1', 0, target);
+        }
+        if (tar_write_header(s, name, &st, '0', st.st_size, NULL) != 0)
+            return -1;
+        return tar_write_file_data(s, path, st.st_size);
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(path, target, PATH_MAX - 1);
+        if (n < 0) {
+            LOGE("Unable to read link %s (%s)\n", path, strerror(errno));
+            s->warnings++;
+            return 0;
+        }
+        target[n] = '\0';
+        return tar_write_header(s, name, &st, '2', 0, target);
+    }
+
+    if (S_ISCHR(st.st_mode))
+        return tar_write_header(s, name, &st, '3', 0, NULL);
+    if (S_ISBLK(st.st_mode))
+        return tar_write_header(s, name, &st, '4', 0, NULL);
+    if (S_ISFIFO(st.st_mode))
+        return tar_write_header(s, name, &st, '6', 0, NULL);
+
+    // tar ignores sockets as well
+    LOGI("%s: socket ignored\n", path);
+    return 0;
+}
+
+static int tar_stream_init(TarStream* s, int nchunks, int compress) {
+    int i;
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->compress = compress;
+    s->volume_fd = -1;
+    s->crc = crc32(0L, Z_NULL, 0);
+    s->nchunks = nchunks;
+    s->chunks = calloc(nchunks, sizeof(TarChunk));
+    if (s->chunks == NULL)
+        return -1;
+    for (i = 0; i < nchunks; i++) {
+        TarChunk* c = &s->chunks[i];
+        c->in = malloc(CHUNK_SIZE);
+        if (c->in == NULL)
+            return -1;
+        if (compress) {
+            c->out_cap = compressBound(CHUNK_SIZE) + 64;
+            c->dict = malloc(DICT_SIZE);
+            c->out = malloc(c->out_cap);
+            if (c->dict == NULL || c->out == NULL)
+                return -1;
+        }
+    }
+    s->cur = &s->chunks[0];
+    return 0;
+}
+
+static void tar_stream_free(TarStream* s) {
+    int i;
+    if (s->chunks != NULL) {
+        for (i = 0; i < s->nchunks; i++) {
+            free(s->chunks[i].in);
+            free(s->chunks[i].dict);
+            free(s->chunks[i].out);
+        }
+        free(s->chunks);
+    }
+    for (i = 0; i < s->link_count; i++)
+        free(s->links[i].name);
+    free(s->links);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+}
+
+int nandroid_tar_create(const char* directory, const char* archive, const char** excludes,
+                        int compress, tar_event_callback callback, tar_progress_callback progress) {
+    TarStream s;
+    pthread_t workers[MAX_WORKERS];
+    pthread_t writer;
+    pthread_t hasher;
+    int nworkers = 0;
+    int ret = 0;
+    int i;
+    struct timeval start, end;
+
+    gettimeofday(&start, NULL);
+
+    char path[PATH_MAX];
+    size_t len = strlen(directory);
+    if (len == 0 || len >= PATH_MAX || directory[0] != '/') {
+        LOGE("Invalid backup directory %s\n", directory);
+        return -1;
+    }
+    strcpy(path, directory);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+
+    // restore looks for the (empty) archive itself, the data lives in the volumes
+    int fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE("Unable to create %s (%s)\n", archive, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5(NULL, 0, digest);
+    nandroid_md5_record(archive, digest, NULL, 0);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int single = cpus <= 1;
+    if (compress && !single)
+        nworkers = cpus > MAX_WORKERS ? MAX_WORKERS : cpus;
+
+    if (tar_stream_init(&s, single ? 1 : 2 * nworkers + 3, compress) != 0) {
+        LOGE("Out of memory for tar buffers\n");
+        tar_stream_free(&s);
+        return -1;
+    }
+    s.single = single;
+    s.archive = archive;
+    s.excludes = excludes;
+    s.callback = callback;
+    s.progress = progress;
+    s.name_offset = strrchr(path, '/') - path + 1;
+
+    if (single) {
+        MD5_Init(&s.md5);
+        MD5_Init(&s.chunk_md5);
+        if (compress && (deflateInit2(&s.strm, COMPRESS_LEVEL, Z_DEFLATED, -15, 8,
+                                      Z_DEFAULT_STRATEGY) != Z_OK ||
+                         tar_write_gzip_header(&s) != 0))
+            ret = -1;
+    } else {
+        if (pthread_create(&hasher, NULL, tar_hash_thread, &s) != 0) {
+            LOGE("Unable to start tar hasher\n");
+            tar_stream_free(&s);
+            return -1;
+        }
+        if (pthread_create(&writer, NULL, tar_writer_thread, &s) != 0) {
+            LOGE("Unable to start tar writer\n");
+            pthread_mutex_lock(&s.lock);
+            s.error = 1;
+            pthread_cond_broadcast(&s.cond);
+            pthread_mutex_unlock(&s.lock);
+            pthread_join(hasher, NULL);
+            tar_stream_free(&s);
+            return -1;
+        }
+        for (i = 0; i < nworkers; i++) {
+            if (pthread_create(&workers[i], NULL, tar_compress_thread, &s) != 0)
+                break;
+        }
+        nworkers = i;
+        if (compress && nworkers == 0) {
+            pthread_mutex_lock(&s.lock);
+            s.error = 1;
+            pthread_cond_broadcast(&s.cond);
+            pthread_mutex_unlock(&s.lock);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0)
+        ret = tar_add_path(&s, path, len);
+
+    // two zero blocks end the archive, padded to a full record like tar does
+    if (ret == 0) {
+        unsigned long long total = s.produced * (unsigned long long)CHUNK_SIZE + s.cur->in_len;
+        size_t trailer = 2 * TAR_BLOCK_SIZE;
+        trailer += (TAR_RECORD_SIZE - (total + trailer) % TAR_RECORD_SIZE) % TAR_RECORD_SIZE;
+        ret = tar_stream_write(&s, NULL, trailer);
+    }
+
+    if (ret == 0) {
+        ret = tar_stream_submit(&s, 1);
+    } else {
+        pthread_mutex_lock(&s.lock);
+        s.error = 1;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+    }
+
+    if (single) {
+        if (compress)
+            deflateEnd(&s.strm);
+        if (s.volume_fd >= 0 && close(s.volume_fd) != 0)
+            s.error = 1;
+        s.volume_fd = -1;
+        tar_hash_finish(&s, s.error);
+    } else {
+        for (i = 0; i < nworkers; i++)
+            pthread_join(workers[i], NULL);
+        pthread_join(writer, NULL);
+        pthread_join(hasher, NULL);
+    }
+
+    if (s.error)
+        ret = -1;
+    if (ret == 0 && s.warnings > 0) {
+        LOGE("%d errors while archiving %s\n", s.warnings, directory);
+        ret = 1;
+    }
+
+    gettimeofday(&end, NULL);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+    LOGI("%s: %llu bytes -> %llu bytes in %ld ms (%d compression threads)\n",
+         archive, s.total_in, s.total_out, ms, single && compress ? 1 : nworkers);
+
+    tar_stream_free(&s);
+    return ret;
+}
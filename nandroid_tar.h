@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_TAR_H
+#define _NANDROID_TAR_H
+
+typedef void (*tar_event_callback)(const char* filename);
+typedef void (*tar_progress_callback)(unsigned long long bytes);
+
+// Archive the absolute directory the way
+//   cd $(dirname directory) ; tar -cp $(basename directory) | [pigz -c |] split -a 1 -b 1000000000
+// did: member names are relative to the parent of directory, and the stream
+// is split into archive.a, archive.b, ...  archive itself is created empty so
+// restore can find the backup.  excludes is a NULL terminated list of
+// fnmatch() patterns matched against member names.  callback is called on
+// the calling thread with the name of every member as it is added, and
+// progress with the number of archive bytes produced so far.
+int nandroid_tar_create(const char* directory, const char* archive, const char** excludes,
+                        int compress, tar_event_callback callback, tar_progress_callback progress);
+
+#endif
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares nandroid_tar_create() with the pipeline it replaced,
+//
+//   cd $(dirname dir) ; tar -cp $(basename dir) | [pigz -c |] split -a 1 -b 1000000000
+//
+// followed by reading the volumes back for nandroid.md5, as a backup did,
+// for .tar and .tar.gz.  Run from recovery (for pigz and busybox tar):
+//
+//   nandroid_tar_bench [-g <MB>] [-z <compressor>] <directory> <scratch dir>
+//
+// -g first fills directory with a made-up /data of about that size: app
+// directories of small files, some compressible and some not, and a few
+// large ones.  -z replaces "pigz -c".  The page cache is dropped before
+// every run when possible, so each one reads the tree from storage.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <openssl/md5.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "nandroid_tar.h"
+
+void ui_print(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+// nandroid_tar_create() hands the digests it takes to nandroid.md5; the
+// bench has no use for them.
+void nandroid_md5_record(const char *path, const unsigned char *digest,
+                         const unsigned char *chunks, int chunk_count) {
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static unsigned int seed = 12345;
+
+static unsigned int next_random() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+// Half of the files are text-like and compress well, half look like
+// already compressed data (apks, images).
+static int write_file(const char *path, size_t size, unsigned char *buf, size_t buf_size) {
+    static const char words[] = "package com.example.app; value=1234 <string name=\"label\">data</string>\n";
+    int compressible = next_random() & 1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    while (size > 0) {
+        size_t n = size < buf_size ? size : buf_size;
+        size_t i;
+        for (i = 0; i < n; i++)
+            buf[i] = compressible ? words[(i + (next_random() & 3)) % (sizeof(words) - 1)]
+                                  : (unsigned char)next_random();
+        if (write(fd, buf, n) != (ssize_t)n) {
+            close(fd);
+            return -1;
+        }
+        size -= n;
+    }
+    return close(fd);
+}
+
+static int generate_tree(const char *dir, unsigned long long megabytes) {
+    unsigned long long total = megabytes << 20;
+    unsigned long long small = total * 2 / 5;
+    unsigned long long written = 0;
+    size_t buf_size = 1 << 20;
+    unsigned char *buf = malloc(buf_size);
+    char path[PATH_MAX];
+    int app = 0, files = 0;
+
+    if (buf == NULL)
+        return -1;
+    mkdir(dir, 0755);
+    snprintf(path, PATH_MAX, "%s/data", dir);
+    mkdir(path, 0755);
+    snprintf(path, PATH_MAX, "%s/app", dir);
+    mkdir(path, 0755);
+
+    // app data: directories of files between 512 bytes and 64k
+    while (written < small) {
+        if (files % 50 == 0) {
+            app++;
+            snprintf(path, PATH_MAX, "%s/data/com.example.app%d", dir, app);
+            mkdir(path, 0755);
+        }
+        size_t size = 512 + next_random() % (64 * 1024);
+        snprintf(path, PATH_MAX, "%s/data/com.example.app%d/file%d", dir, app, files);
+        if (write_file(path, size, buf, buf_size) != 0)
+            goto error;
+        written += size;
+        files++;
+    }
+    // apks, databases, dalvik-cache: files between 1MB and 64MB
+    while (written < total) {
+        size_t size = (1 + next_random() % 64) << 20;
+        if (size > total - written)
+            size = total - written;
+        snprintf(path, PATH_MAX, "%s/app/big%d", dir, files);
+        if (write_file(path, size, buf, buf_size) != 0)
+            goto error;
+        written += size;
+        files++;
+    }
+    free(buf);
+    fprintf(stderr, "generated %d files, %llu MB in %s\n", files, written >> 20, dir);
+    return 0;
+
+error:
+    fprintf(stderr, "can't write %s (%s)\n", path, strerror(errno));
+    free(buf);
+    return -1;
+}
+
+static void drop_caches() {
+    static int warned = 0;
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd >= 0 && write(fd, "3", 1) == 1) {
+        close(fd);
+        return;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (!warned) {
+        fprintf(stderr, "can't drop the page cache; runs after the first are warm\n");
+        warned = 1;
+    }
+}
+
+// Size of archive.a, archive.b, ...; with md5 set, also reads them back
+// the way nandroid_backup_md5_gen() does for volumes it has no digest of.
+static unsigned long long volumes(const char *archive, int md5, int remove) {
+    unsigned long long size = 0;
+    unsigned char *buf = md5 ? malloc(1 << 20) : NULL;
+    char path[PATH_MAX];
+    char c;
+    for (c = 'a'; c <= 'z'; c++) {
+        struct stat st;
+        snprintf(path, PATH_MAX, "%s.%c", archive, c);
+        if (stat(path, &st) != 0)
+            break;
+        size += st.st_size;
+        if (buf != NULL) {
+            MD5_CTX ctx;
+            unsigned char digest[MD5_DIGEST_LENGTH];
+            ssize_t n;
+            int fd = open(path, O_RDONLY);
+            MD5_Init(&ctx);
+            while (fd >= 0 && (n = read(fd, buf, 1 << 20)) > 0)
+                MD5_Update(&ctx, buf, n);
+            MD5_Final(digest, &ctx);
+            if (fd >= 0)
+                close(fd);
+        }
+        if (remove)
+            unlink(path);
+    }
+    free(buf);
+    if (remove)
+        unlink(archive);
+    return size;
+}
+
+static void report(const char *what, double seconds, unsigned long long in,
+                   unsigned long long out) {
+    fprintf(stderr, "  %-28s %8.1f s %8.1f MB/s  %6.1f%% of input\n", what, seconds,
+            in / seconds / (1 << 20), in ? 100.0 * out / in : 0);
+}
+
+int main(int argc, char **argv) {
+    const char *compressor = "pigz -c";
+    unsigned long long generate = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:z:")) != -1) {
+        switch (opt) {
+        case 'g':
+            generate = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            compressor = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 2)
+        goto usage;
+
+    char directory[PATH_MAX];
+    char scratch[PATH_MAX];
+    if (generate && generate_tree(argv[optind], generate) != 0)
+        return 1;
+    mkdir(argv[optind + 1], 0755);
+    if (realpath(argv[optind], directory) == NULL || realpath(argv[optind + 1], scratch) == NULL) {
+        fprintf(stderr, "can't find %s or %s\n", argv[optind], argv[optind + 1]);
+        return 1;
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s", directory);
+    char parent[PATH_MAX];
+    snprintf(parent, PATH_MAX, "%s", dirname(tmp));
+    snprintf(tmp, PATH_MAX, "%s", directory);
+    char base[PATH_MAX];
+    snprintf(base, PATH_MAX, "%s", basename(tmp));
+
+    const char *excludes[] = { NULL };
+    int compress;
+    for (compress = 0; compress <= 1; compress++) {
+        char archive[PATH_MAX];
+        char command[PATH_MAX * 3];
+        unsigned long long in, out;
+        double start, piped, seconds;
+
+        fprintf(stderr, "%s:\n", compress ? ".tar.gz" : ".tar");
+
+        // the tar stream's size, to report throughput in input bytes
+        snprintf(archive, PATH_MAX, "%s/engine%s", scratch, compress ? ".tar.gz" : ".tar");
+        drop_caches();
+        start = now();
+        if (nandroid_tar_create(directory, archive, excludes, compress, NULL, NULL) != 0) {
+            fprintf(stderr, "nandroid_tar_create failed\n");
+            return 1;
+        }
+        seconds = now() - start;
+        out = volumes(archive, 0, 1);
+        if (!compress)
+            in = out;
+        else {
+            snprintf(archive, PATH_MAX, "%s/size.tar", scratch);
+            nandroid_tar_create(directory, archive, excludes, 0, NULL, NULL);
+            in = volumes(archive, 0, 1);
+        }
+        report("nandroid_tar_create", seconds, in, out);
+
+        snprintf(archive, PATH_MAX, "%s/pipeline%s", scratch, compress ? ".tar.gz" : ".tar");
+        snprintf(command, sizeof(command),
+                 "cd %s ; tar -cp %s | %s%ssplit -a 1 -b 1000000000 - %s.",
+                 parent, base, compress ? compressor : "", compress ? " | " : "", archive);
+        drop_caches();
+        start = now();
+        if (system(command) != 0) {
+            fprintf(stderr, "%s failed\n", command);
+            return 1;
+        }
+        piped = now() - start;
+        out = volumes(archive, 1, 1);
+        seconds = now() - start;
+        report("pipeline", piped, in, out);
+        report("pipeline + md5 read back", seconds, in, out);
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-g <MB>] [-z <compressor>] <directory> <scratch dir>\n", argv[0]);
+    return 2;
+}
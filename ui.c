@@ -124,6 +124,9 @@ static double gProgressScopeDuration;
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
 
+// First pixel row of the log, as last drawn
+static int log_top_y = 0;
+
 // Log text overlay, displayed when a magic key is pressed
 static char text[MAX_ROWS][MAX_COLS];
 static int text_cols = 0;
@@ -134,6 +137,21 @@ static int text_top = 0;
 static int show_text = 0;
 static int show_text_ever = 0; // i.e. has show_text ever been 1?
 
+// ui_print() output on its way to text[].  Any thread may add to it
+// without locking; whoever holds gUpdateMutex moves it into text[], and
+// progress_thread puts it on screen.  A print that finds the ring full
+// drains it itself.
+#define LOG_RING_SLOTS 128
+#define LOG_SLOT_SIZE 256
+static struct {
+    volatile unsigned int seq;  // == position once free, position + 1 once filled
+    int len;
+    char data[LOG_SLOT_SIZE];
+} log_ring[LOG_RING_SLOTS];
+static volatile unsigned int log_head = 0;  // next position to fill
+static unsigned int log_tail = 0;           // next position to drain, under gUpdateMutex
+static int log_dirty = 0;                   // text[] changed since the last frame
+
 static char menu[MENU_MAX_ROWS][MENU_MAX_COLS];
 static int menuTextColor[4] = {MENU_TEXT_COLOR};
 static int show_menu = 0;
@@ -156,6 +174,7 @@ static volatile char key_pressed[KEY_MAX + 1];
 
 // Prototypes for static functions that are used before defined
 static void update_screen_locked(void);
+static int drain_log_locked(void);
 static int ui_wait_key_with_repeat();
 static void ui_rainbow_mode();
 
@@ -289,6 +308,9 @@ static void draw_screen_locked(void) {
     if (!ui_has_initialized)
         return;
 
+    drain_log_locked();
+    log_dirty = 0;
+
     draw_background_locked(gCurrentIcon);
     draw_progress_locked();
 
@@ -344,6 +366,7 @@ static void draw_screen_locked(void) {
             cur_row = (cur_row + (MAX_ROWS - available_rows)) % MAX_ROWS;
         else
             start_row = total_rows - MAX_ROWS;
+        log_top_y = start_row > 0 ? start_row * CHAR_HEIGHT : 0;
 
         int r;
         for (r = 0; r < (available_rows < MAX_ROWS ? available_rows : MAX_ROWS); r++) {
@@ -352,6 +375,49 @@ static void draw_screen_locked(void) {
     }
 }
 
+// Milliseconds since this process was started, or -1 if unknown.
+static long ms_since_process_start(void) {
+    char buf[512];
+    FILE *f = fopen("/proc/self/stat", "r");
+    if (f == NULL)
+        return -1;
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    // starttime is field 22, in clock ticks since boot; the command name
+    // (field 2) may contain spaces, so count from its closing ')'
+    char *p = strrchr(buf, ')');
+    unsigned long long start_ticks;
+    int field;
+    for (field = 2; p != NULL && field < 22; field++)
+        p = strchr(p + 1, ' ');
+    if (p == NULL || sscanf(p, " %llu", &start_ticks) != 1)
+        return -1;
+
+    struct timespec ts;
+#ifdef CLOCK_BOOTTIME
+    if (clock_gettime(CLOCK_BOOTTIME, &ts) != 0)
+#endif
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now_ms = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    return now_ms - start_ticks * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+// Flip the screen, noting in the log when the first frame went up.
+// Should only be called with gUpdateMutex locked.
+static void flip_locked(void) {
+    static int first_frame_shown = 0;
+
+    gr_flip();
+    if (!first_frame_shown) {
+        first_frame_shown = 1;
+        long ms = ms_since_process_start();
+        if (ms >= 0)
+            LOGI("First frame %ldms after start\n", ms);
+    }
+}
+
 // Redraw everything on the screen and flip the screen (make it visible).
 // Should only be called with gUpdateMutex locked.
 static void update_screen_locked(void) {
@@ -359,7 +425,37 @@ static void update_screen_locked(void) {
         return;
 
     draw_screen_locked();
-    gr_flip();
+    flip_locked();
+}
+
+// Redraw only rows top to bottom of the screen, without flipping.  Anything
+// outside is left as it is.
+// Should only be called with gUpdateMutex locked.
+static void draw_rows_locked(int top, int bottom) {
+    if (top >= bottom)
+        return;
+    int identical = gPagesIdentical;
+    gr_clip(0, top, gr_fb_width(), bottom - top);
+    draw_screen_locked();
+    gr_noclip();
+    gPagesIdentical = identical;
+}
+
+// The rows draw_progress_locked() draws to.
+static void get_progress_rows_locked(int *top, int *bottom) {
+    *top = gr_fb_height();
+    *bottom = 0;
+    if (gCurrentIcon == BACKGROUND_ICON_INSTALLING && gInstallationOverlay != NULL) {
+        *top = ui_parameters.install_overlay_offset_y;
+        *bottom = *top + gr_get_height(gInstallationOverlay[gInstallingFrame]);
+    }
+    if (gProgressBarType != PROGRESSBAR_TYPE_NONE) {
+        int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
+        int height = gr_get_height(gProgressBarEmpty);
+        int dy = (3*gr_fb_height() + iconHeight - 2*height)/4;
+        if (dy < *top) *top = dy;
+        if (dy + height > *bottom) *bottom = dy + height;
+    }
 }
 
 // Updates only the progress bar, if possible, otherwise redraws the screen.
@@ -378,16 +474,22 @@ static void update_progress_locked(void) {
         return;
     }
 
-    if (show_text || !gPagesIdentical) {
+    if (!gPagesIdentical) {
         draw_screen_locked();    // Must redraw the whole screen
         gPagesIdentical = 1;
+    } else if (show_text) {
+        // Redraw the rows with the progress bar, text and all
+        int top, bottom;
+        get_progress_rows_locked(&top, &bottom);
+        draw_rows_locked(top, bottom);
     } else {
         draw_progress_locked();  // Draw only the progress bar and overlays
     }
-    gr_flip();
+    flip_locked();
 }
 
-// Keeps the progress bar updated, even when the process is otherwise busy.
+// Keeps the progress bar and the log updated, even when the process is
+// otherwise busy.
 static void *progress_thread(void *cookie) {
     double interval = 1.0 / ui_parameters.update_fps;
     for (;;) {
@@ -417,7 +519,15 @@ static void *progress_thread(void *cookie) {
             }
         }
 
-        if (redraw) update_progress_locked();
+        // new log text is only worth a frame if it can be seen
+        drain_log_locked();
+        if (log_dirty && show_text) {
+            draw_rows_locked(log_top_y, gr_fb_height());
+            flip_locked();
+        } else if (redraw) {
+            update_progress_locked();
+        }
+        log_dirty = 0;
 
         pthread_mutex_unlock(&gUpdateMutex);
         double end = now();
@@ -519,6 +629,69 @@ static void *input_thread(void *cookie) {
     return NULL;
 }
 
+// Loads BITMAPS, the indeterminate progress frames and the installation
+// overlay frames in one go, so the PNGs not in the image bundle can be
+// decoded in parallel.
+static void load_bitmaps(void) {
+    int bitmaps, i;
+    for (bitmaps = 0; BITMAPS[bitmaps].name != NULL; ++bitmaps)
+        ;
+
+    gProgressBarIndeterminate = malloc(ui_parameters.indeterminate_frames *
+                                       sizeof(gr_surface));
+    if (ui_parameters.installing_frames > 0) {
+        gInstallationOverlay = malloc(ui_parameters.installing_frames *
+                                      sizeof(gr_surface));
+    } else {
+        gInstallationOverlay = NULL;
+    }
+
+    int count = bitmaps + ui_parameters.indeterminate_frames;
+    if (gInstallationOverlay != NULL)
+        count += ui_parameters.installing_frames;
+    const char **names = malloc(count * sizeof(char*));
+    gr_surface **surfaces = malloc(count * sizeof(gr_surface*));
+    int *results = malloc(count * sizeof(int));
+    char (*filenames)[40] = malloc(count * sizeof(*filenames));
+
+    int n = 0;
+    for (i = 0; i < bitmaps; ++i, ++n) {
+        names[n] = BITMAPS[i].name;
+        surfaces[n] = BITMAPS[i].surface;
+    }
+    for (i = 0; i < ui_parameters.indeterminate_frames; ++i, ++n) {
+        // "indeterminate01.png", "indeterminate02.png", ...
+        sprintf(filenames[n], "indeterminate%02d", i+1);
+        names[n] = filenames[n];
+        surfaces[n] = gProgressBarIndeterminate+i;
+    }
+    for (i = 0; gInstallationOverlay != NULL && i < ui_parameters.installing_frames; ++i, ++n) {
+        // "icon_installing_overlay01.png",
+        // "icon_installing_overlay02.png", ...
+        sprintf(filenames[n], "icon_installing_overlay%02d", i+1);
+        names[n] = filenames[n];
+        surfaces[n] = gInstallationOverlay+i;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    int bundled = res_create_surfaces(count, names, surfaces, results);
+    gettimeofday(&end, NULL);
+    LOGI("Loaded %d images in %ldms, %d from the image bundle\n",
+         count, delta_milliseconds(start, end), bundled);
+
+    for (i = 0; i < count; ++i) {
+        if (results[i] < 0) {
+            LOGE("Missing bitmap %s\n(Code %d)\n", names[i], results[i]);
+        }
+    }
+
+    free(names);
+    free(surfaces);
+    free(results);
+    free(filenames);
+}
+
 void ui_init(void) {
     ui_has_initialized = 1;
     gr_init();
@@ -527,6 +700,11 @@ void ui_init(void) {
     touch_init();
 #endif
 
+    int i;
+    for (i = 0; i < LOG_RING_SLOTS; ++i)
+        log_ring[i].seq = i;
+    __sync_synchronize();
+
     text_col = text_row = 0;
     text_rows = gr_fb_height() / CHAR_HEIGHT;
     max_menu_rows = text_rows - MIN_LOG_ROWS;
@@ -541,40 +719,9 @@ void ui_init(void) {
     text_cols = gr_fb_width() / CHAR_WIDTH;
     if (text_cols > MAX_COLS - 1) text_cols = MAX_COLS - 1;
 
-    int i;
-    for (i = 0; BITMAPS[i].name != NULL; ++i) {
-        int result = res_create_surface(BITMAPS[i].name, BITMAPS[i].surface);
-        if (result < 0) {
-            LOGE("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
-        }
-    }
-
-    gProgressBarIndeterminate = malloc(ui_parameters.indeterminate_frames *
-                                       sizeof(gr_surface));
-    for (i = 0; i < ui_parameters.indeterminate_frames; ++i) {
-        char filename[40];
-        // "indeterminate01.png", "indeterminate02.png", ...
-        sprintf(filename, "indeterminate%02d", i+1);
-        int result = res_create_surface(filename, gProgressBarIndeterminate+i);
-        if (result < 0) {
-            LOGE("Missing bitmap %s\n(Code %d)\n", filename, result);
-        }
-    }
-
-    if (ui_parameters.installing_frames > 0) {
-        gInstallationOverlay = malloc(ui_parameters.installing_frames *
-                                      sizeof(gr_surface));
-        for (i = 0; i < ui_parameters.installing_frames; ++i) {
-            char filename[40];
-            // "icon_installing_overlay01.png",
-            // "icon_installing_overlay02.png", ...
-            sprintf(filename, "icon_installing_overlay%02d", i+1);
-            int result = res_create_surface(filename, gInstallationOverlay+i);
-            if (result < 0) {
-                LOGE("Missing bitmap %s\n(Code %d)\n", filename, result);
-            }
-        }
+    load_bitmaps();
 
+    if (gInstallationOverlay != NULL) {
         // Adjust the offset to account for the positioning of the
         // base image on the screen.
         if (gBackgroundIcon[BACKGROUND_ICON_INSTALLING] != NULL) {
@@ -584,8 +731,6 @@ void ui_init(void) {
             ui_parameters.install_overlay_offset_y +=
                 (gr_fb_height() - gr_get_height(bg)) / 2;
         }
-    } else {
-        gInstallationOverlay = NULL;
     }
 
     char enable_key_repeat[PROPERTY_VALUE_MAX];
@@ -710,26 +855,87 @@ void ui_print(const char *fmt, ...) {
     vsnprintf(buf, 256, fmt, ap);
     va_end(ap);
 
+    ui_print_str(buf);
+}
+
+// Should only be called with gUpdateMutex locked.
+static void append_text_locked(const char *str, int len) {
+    int i;
+    for (i = 0; i < len; ++i) {
+        if (str[i] == '\n' || text_col >= text_cols) {
+            text[text_row][text_col] = '\0';
+            text_col = 0;
+            text_row = (text_row + 1) % text_rows;
+            if (text_row == text_top) text_top = (text_top + 1) % text_rows;
+        }
+        if (str[i] != '\n') text[text_row][text_col++] = str[i];
+    }
+    text[text_row][text_col] = '\0';
+    log_dirty = 1;
+}
+
+// Moves everything printed so far into text[].  Returns 1 if there was
+// anything.  Should only be called with gUpdateMutex locked.
+static int drain_log_locked(void) {
+    int drained = 0;
+    if (text_rows <= 0 || text_cols <= 0)
+        return 0;
+    for (;;) {
+        int slot = log_tail % LOG_RING_SLOTS;
+        if (log_ring[slot].seq != log_tail + 1)
+            break;
+        __sync_synchronize();
+        append_text_locked(log_ring[slot].data, log_ring[slot].len);
+        __sync_synchronize();
+        log_ring[slot].seq = log_tail + LOG_RING_SLOTS;
+        log_tail++;
+        drained = 1;
+    }
+    return drained;
+}
+
+// Claims the next free slot and fills it.  Returns -1 if the ring is full.
+static int log_ring_put(const char *str, int len) {
+    unsigned int pos = log_head;
+    for (;;) {
+        int slot = pos % LOG_RING_SLOTS;
+        int diff = (int) (log_ring[slot].seq - pos);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&log_head, pos, pos + 1)) {
+                memcpy(log_ring[slot].data, str, len);
+                log_ring[slot].len = len;
+                __sync_synchronize();
+                log_ring[slot].seq = pos + 1;
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        }
+        pos = log_head;
+    }
+}
+
+void ui_print_str(const char *str) {
     if (ui_log_stdout)
-        fputs(buf, stdout);
+        fputs(str, stdout);
 
     // This can get called before ui_init(), so be careful.
-    pthread_mutex_lock(&gUpdateMutex);
-    if (text_rows > 0 && text_cols > 0) {
-        char *ptr;
-        for (ptr = buf; *ptr != '\0'; ++ptr) {
-            if (*ptr == '\n' || text_col >= text_cols) {
-                text[text_row][text_col] = '\0';
-                text_col = 0;
-                text_row = (text_row + 1) % text_rows;
-                if (text_row == text_top) text_top = (text_top + 1) % text_rows;
-            }
-            if (*ptr != '\n') text[text_row][text_col++] = *ptr;
+    if (text_rows <= 0 || text_cols <= 0)
+        return;
+
+    int len = strlen(str);
+    while (len > 0) {
+        int n = len < LOG_SLOT_SIZE ? len : LOG_SLOT_SIZE;
+        if (log_ring_put(str, n) != 0) {
+            // printing faster than frames can drain it
+            pthread_mutex_lock(&gUpdateMutex);
+            drain_log_locked();
+            pthread_mutex_unlock(&gUpdateMutex);
+            continue;
         }
-        text[text_row][text_col] = '\0';
-        update_screen_locked();
+        str += n;
+        len -= n;
     }
-    pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_printlogtail(int nb_lines) {
@@ -790,10 +996,11 @@ int ui_start_menu(const char** headers, char** items, int initial_selection) {
 }
 
 int ui_menu_select(int sel) {
-    int old_sel;
+    int old_sel, old_show_start;
     pthread_mutex_lock(&gUpdateMutex);
     if (show_menu > 0) {
         old_sel = menu_sel;
+        old_show_start = menu_show_start;
         menu_sel = sel;
 
         if (menu_sel < 0) menu_sel = menu_items + menu_sel;
@@ -810,6 +1017,16 @@ int ui_menu_select(int sel) {
 
         sel = menu_sel;
 
+#ifndef BOARD_TOUCH_RECOVERY
+        if (menu_sel != old_sel && menu_show_start == old_show_start) {
+            // only the two highlighted rows change
+            int old_y = (menu_top + old_sel - menu_show_start) * CHAR_HEIGHT;
+            int new_y = (menu_top + menu_sel - menu_show_start) * CHAR_HEIGHT;
+            draw_rows_locked(old_y, old_y + CHAR_HEIGHT + 1);
+            draw_rows_locked(new_y, new_y + CHAR_HEIGHT + 1);
+            flip_locked();
+        } else
+#endif
         if (menu_sel != old_sel) update_screen_locked();
     }
     pthread_mutex_unlock(&gUpdateMutex);
@@ -1059,6 +1276,7 @@ int ui_handle_key(int key, int visible) {
 
 void ui_delete_line() {
     pthread_mutex_lock(&gUpdateMutex);
+    drain_log_locked();
     text[text_row][0] = '\0';
     text_row = (text_row - 1 + text_rows) % text_rows;
     text_col = 0;
@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <elf.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "update_binary_probe.h"
+
+// Names of edify functions an updater registers, and the API level of the
+// first release whose updater had them.  They live in .rodata as plain
+// strings, so finding one says which updater the package was built with.
+static const struct {
+    const char* name;
+    int api_level;
+} patterns[PROBE_PATTERN_COUNT] = {
+    { "set_perm_",          0 },    // set_perm_recursive, any release
+    { "set_metadata_",      19 },   // 4.4
+    { "block_image_update", 21 },   // 5.0
+    { "block_image_verify", 23 },   // 6.0
+};
+
+enum { PATTERN_SET_PERM, PATTERN_SET_METADATA };
+
+// For each byte, a mask of the patterns starting with it.
+static unsigned char first_byte[256];
+static size_t pattern_len[PROBE_PATTERN_COUNT];
+static size_t longest;
+
+void update_binary_probe_init(UpdateBinaryProbe* probe) {
+    memset(probe, 0, sizeof(*probe));
+    if (longest == 0) {
+        int p;
+        for (p = 0; p < PROBE_PATTERN_COUNT; ++p) {
+            pattern_len[p] = strlen(patterns[p].name);
+            first_byte[(unsigned char)patterns[p].name[0]] |= 1 << p;
+            if (pattern_len[p] > longest) longest = pattern_len[p];
+        }
+    }
+}
+
+static void add_hit(UpdateBinaryProbe* probe, int p, unsigned long long offset) {
+    if (probe->hit_count[p] < PROBE_MAX_HITS) {
+        probe->hits[p][probe->hit_count[p]] = offset;
+    }
+    // keep counting, so finish() knows some hits were never recorded
+    if (probe->hit_count[p] <= PROBE_MAX_HITS) {
+        probe->hit_count[p]++;
+    }
+}
+
+// Look for patterns starting at buf[0..starts) that end no earlier than
+// buf[min_end] and fit in buf[0..len).  buf[0] is at offset in the binary.
+static void scan(UpdateBinaryProbe* probe, const unsigned char* buf, size_t len,
+                 size_t starts, size_t min_end, unsigned long long offset) {
+    size_t i;
+    for (i = 0; i < starts; ++i) {
+        unsigned int mask = first_byte[buf[i]];
+        while (mask != 0) {
+            int p = __builtin_ctz(mask);
+            mask &= mask - 1;
+            size_t end = i + pattern_len[p];
+            if (end <= len && end > min_end &&
+                memcmp(buf + i + 1, patterns[p].name + 1, pattern_len[p] - 1) == 0) {
+                add_hit(probe, p, offset + i);
+            }
+        }
+    }
+}
+
+void update_binary_probe_feed(UpdateBinaryProbe* probe,
+                              const unsigned char* data, size_t len) {
+    if (len == 0) return;
+
+    // Matches straddling the previous chunk and this one.  Those that fit
+    // in the tail alone were found with the previous chunk.
+    unsigned char joined[2 * (PROBE_MAX_PATTERN - 1)];
+    size_t head = len < longest - 1 ? len : longest - 1;
+    memcpy(joined, probe->tail, probe->tail_len);
+    memcpy(joined + probe->tail_len, data, head);
+    scan(probe, joined, probe->tail_len + head, probe->tail_len,
+         probe->tail_len, probe->offset - probe->tail_len);
+
+    scan(probe, data, len, len, 0, probe->offset);
+    probe->offset += len;
+
+    if (len >= longest - 1) {
+        probe->tail_len = longest - 1;
+        memcpy(probe->tail, data + len - probe->tail_len, probe->tail_len);
+    } else {
+        size_t total = probe->tail_len + head;
+        size_t keep = total < longest - 1 ? total : longest - 1;
+        memcpy(probe->tail, joined + total - keep, keep);
+        probe->tail_len = keep;
+    }
+}
+
+typedef struct {
+    unsigned long long offset;
+    unsigned long long size;
+} Range;
+
+#define MAX_RANGES 16
+
+// Pull the API level out of an Android ident note, if this is one.
+static void read_notes(UpdateBinaryProbe* probe, const unsigned char* p, size_t size) {
+    while (size >= 12) {
+        Elf32_Word namesz, descsz, type;
+        memcpy(&namesz, p, 4);
+        memcpy(&descsz, p + 4, 4);
+        memcpy(&type, p + 8, 4);
+        size_t name_space = (namesz + 3) & ~3u;
+        size_t desc_space = (descsz + 3) & ~3u;
+        if (name_space > size - 12 || desc_space > size - 12 - name_space) {
+            return;
+        }
+        if (type == 1 && namesz == 8 && memcmp(p + 12, "Android", 8) == 0 &&
+                descsz >= 4) {
+            Elf32_Word api;
+            memcpy(&api, p + 12 + name_space, 4);
+            probe->api_level = api;
+            probe->api_from_note = true;
+            return;
+        }
+        p += 12 + name_space + desc_space;
+        size -= 12 + name_space + desc_space;
+    }
+}
+
+// Collect the file ranges of the sections holding strings the updater
+// registers: .dynstr and .rodata (and .rodata.*, for unmerged strings).
+// Returns the number of ranges, or -1 if there is no usable section table.
+static int string_sections(UpdateBinaryProbe* probe, const unsigned char* map,
+                           size_t size, Range* ranges) {
+    if (size < EI_NIDENT || memcmp(map, ELFMAG, SELFMAG) != 0 ||
+            map[EI_DATA] != ELFDATA2LSB) {
+        return -1;
+    }
+
+    unsigned long long shoff;
+    size_t shentsize, shnum, shstrndx;
+    if (map[EI_CLASS] == ELFCLASS32 && size >= sizeof(Elf32_Ehdr)) {
+        const Elf32_Ehdr* ehdr = (const Elf32_Ehdr*) map;
+        shoff = ehdr->e_shoff;
+        shentsize = ehdr->e_shentsize;
+        shnum = ehdr->e_shnum;
+        shstrndx = ehdr->e_shstrndx;
+        if (shentsize < sizeof(Elf32_Shdr)) return -1;
+    } else if (map[EI_CLASS] == ELFCLASS64 && size >= sizeof(Elf64_Ehdr)) {
+        const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*) map;
+        shoff = ehdr->e_shoff;
+        shentsize = ehdr->e_shentsize;
+        shnum = ehdr->e_shnum;
+        shstrndx = ehdr->e_shstrndx;
+        if (shentsize < sizeof(Elf64_Shdr)) return -1;
+    } else {
+        return -1;
+    }
+    if (shoff == 0 || shnum == 0 || shstrndx >= shnum ||
+            shoff > size || (size - shoff) / shentsize < shnum) {
+        return -1;
+    }
+
+    // Normalize the 32 and 64 bit headers.
+    Range names = { 0, 0 };
+    int pass, count = 0;
+    for (pass = 0; pass < 2; ++pass) {
+        size_t i;
+        for (i = 0; i < shnum; ++i) {
+            const unsigned char* sh = map + shoff + i * shentsize;
+            unsigned long long offset, sh_size;
+            Elf32_Word name, type;
+            if (map[EI_CLASS] == ELFCLASS32) {
+                const Elf32_Shdr* s = (const Elf32_Shdr*) sh;
+                name = s->sh_name; type = s->sh_type;
+                offset = s->sh_offset; sh_size = s->sh_size;
+            } else {
+                const Elf64_Shdr* s = (const Elf64_Shdr*) sh;
+                name = s->sh_name; type = s->sh_type;
+                offset = s->sh_offset; sh_size = s->sh_size;
+            }
+            if (type == SHT_NOBITS || offset > size || sh_size > size - offset) {
+                continue;
+            }
+
+            if (pass == 0) {
+                // first find the section name table
+                if (i == shstrndx) {
+                    names.offset = offset;
+                    names.size = sh_size;
+                }
+                continue;
+            }
+
+            if (name >= names.size) continue;
+            const char* section = (const char*) map + names.offset + name;
+            size_t room = names.size - name;
+            if (strnlen(section, room) == room) continue;
+
+            if (type == SHT_NOTE && strcmp(section, ".note.android.ident") == 0) {
+                read_notes(probe, map + offset, sh_size);
+            } else if (strcmp(section, ".dynstr") == 0 ||
+                       strcmp(section, ".rodata") == 0 ||
+                       strncmp(section, ".rodata.", 8) == 0) {
+                if (count < MAX_RANGES) {
+                    ranges[count].offset = offset;
+                    ranges[count].size = sh_size;
+                    count++;
+                }
+            }
+        }
+        if (pass == 0 && names.size == 0) return -1;
+    }
+    return count;
+}
+
+static bool found(const UpdateBinaryProbe* probe, int p,
+                  const Range* ranges, int range_count) {
+    int h;
+    if (probe->hit_count[p] == 0) return false;
+    // Without string sections to go by, or with too many hits to check,
+    // any hit counts.
+    if (range_count <= 0 || probe->hit_count[p] > PROBE_MAX_HITS) return true;
+
+    for (h = 0; h < probe->hit_count[p]; ++h) {
+        unsigned long long offset = probe->hits[p][h];
+        int r;
+        for (r = 0; r < range_count; ++r) {
+            if (offset >= ranges[r].offset &&
+                    offset + pattern_len[p] <= ranges[r].offset + ranges[r].size) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void update_binary_probe_finish(UpdateBinaryProbe* probe, int fd) {
+    Range ranges[MAX_RANGES];
+    int range_count = -1;
+
+    // Only the headers and section tables get paged in.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            range_count = string_sections(probe, map, st.st_size, ranges);
+            munmap(map, st.st_size);
+        }
+    }
+
+    probe->has_set_perm = found(probe, PATTERN_SET_PERM, ranges, range_count);
+    probe->has_set_metadata = found(probe, PATTERN_SET_METADATA, ranges, range_count);
+
+    if (!probe->api_from_note) {
+        int p;
+        for (p = 0; p < PROBE_PATTERN_COUNT; ++p) {
+            if (patterns[p].api_level > probe->api_level &&
+                    found(probe, p, ranges, range_count)) {
+                probe->api_level = patterns[p].api_level;
+            }
+        }
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_UPDATE_BINARY_PROBE_H
+#define _RECOVERY_UPDATE_BINARY_PROBE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Compatibility probe for the update-binary of a package.  The bytes of
+// the binary are fed to it while they are extracted, so matching costs no
+// extra pass over the file; once the file is complete its ELF section
+// headers decide which of the matches count.
+
+#define PROBE_PATTERN_COUNT 4
+#define PROBE_MAX_HITS 8
+#define PROBE_MAX_PATTERN 32
+
+typedef struct {
+    // results, valid after update_binary_probe_finish()
+    bool has_set_perm;
+    bool has_set_metadata;
+    int api_level;          // Android API level, 0 if unknown
+    bool api_from_note;     // api_level came from .note.android.ident
+
+    // matcher state
+    unsigned long long offset;
+    unsigned char tail[PROBE_MAX_PATTERN - 1];
+    size_t tail_len;
+    unsigned long long hits[PROBE_PATTERN_COUNT][PROBE_MAX_HITS];
+    int hit_count[PROBE_PATTERN_COUNT];
+} UpdateBinaryProbe;
+
+void update_binary_probe_init(UpdateBinaryProbe* probe);
+
+// Feed the next len bytes of the binary.
+void update_binary_probe_feed(UpdateBinaryProbe* probe,
+                              const unsigned char* data, size_t len);
+
+// Read the section headers of the extracted binary from fd (which must be
+// readable) and settle the results.  Binaries that aren't ELF or have no
+// section headers count every match.
+void update_binary_probe_finish(UpdateBinaryProbe* probe, int fd);
+
+// Whether the binary needs the pre-4.4 property environment: it's a
+// regular updater (it has set_perm_) built before set_metadata_ existed.
+static inline bool update_binary_needs_legacy_props(const UpdateBinaryProbe* probe) {
+    return probe->has_set_perm && !probe->has_set_metadata;
+}
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "update_progress.h"
+#include "updater/progress.h"
+
+// Big enough for the largest frame.
+#define READ_BUFFER_SIZE (128 * 1024)
+// Text commands longer than this are cut up, as fgets() used to.
+#define MAX_TEXT_COMMAND 1024
+
+typedef struct {
+    // ui_print output not on screen yet
+    char* text;
+    size_t text_len;
+    size_t text_size;
+
+    // the last set_progress not applied yet
+    bool has_progress;
+    float progress;
+
+    char** firmware_type;
+    char** firmware_filename;
+} Pending;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void queue_text(Pending* p, const char* text, size_t len) {
+    if (p->text_len + len + 1 > p->text_size) {
+        size_t size = p->text_size ? p->text_size : 4096;
+        while (p->text_len + len + 1 > size) size *= 2;
+        char* text = realloc(p->text, size);
+        if (text == NULL) return;
+        p->text = text;
+        p->text_size = size;
+    }
+    memcpy(p->text + p->text_len, text, len);
+    p->text_len += len;
+}
+
+static bool dirty(const Pending* p) {
+    return p->text_len > 0 || p->has_progress;
+}
+
+static void flush(Pending* p) {
+    if (p->text_len > 0) {
+        p->text[p->text_len] = '\0';
+        ui_print_str(p->text);
+        p->text_len = 0;
+    }
+    if (p->has_progress) {
+        ui_set_progress(p->progress);
+        p->has_progress = false;
+    }
+}
+
+// "ui_print <text>" shows text as is; a bare "ui_print" ends the line.
+static void print(Pending* p, const char* text, size_t len) {
+    if (len == 0) {
+        queue_text(p, "\n", 1);
+    } else {
+        queue_text(p, text, len);
+    }
+}
+
+static void show_progress(Pending* p, float fraction, int seconds) {
+    // A new scope starts; set_progress for the old one no longer matters.
+    p->has_progress = false;
+    ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION), seconds);
+}
+
+static void set_progress(Pending* p, float fraction) {
+    p->has_progress = true;
+    p->progress = fraction;
+}
+
+static void firmware(Pending* p, const char* type, const char* filename) {
+    if (*p->firmware_type != NULL) {
+        LOGE("ignoring attempt to do multiple firmware updates");
+    } else {
+        *p->firmware_type = strdup(type);
+        *p->firmware_filename = strdup(filename);
+    }
+}
+
+static void text_command(Pending* p, char* line) {
+    char* command = strtok(line, " \n");
+    if (command == NULL) {
+        return;
+    } else if (strcmp(command, "progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        char* seconds_s = strtok(NULL, " \n");
+        if (fraction_s == NULL || seconds_s == NULL) return;
+        show_progress(p, strtof(fraction_s, NULL), strtol(seconds_s, NULL, 10));
+    } else if (strcmp(command, "set_progress") == 0) {
+        char* fraction_s = strtok(NULL, " \n");
+        if (fraction_s == NULL) return;
+        set_progress(p, strtof(fraction_s, NULL));
+    } else if (strcmp(command, "firmware") == 0) {
+        char* type = strtok(NULL, " \n");
+        char* filename = strtok(NULL, " \n");
+        if (type != NULL && filename != NULL) {
+            firmware(p, type, filename);
+        }
+    } else if (strcmp(command, "ui_print") == 0) {
+        char* str = strtok(NULL, "\n");
+        print(p, str, str ? strlen(str) : 0);
+    } else {
+        LOGE("unknown command [%s]\n", command);
+    }
+}
+
+static void frame_command(Pending* p, int type, const unsigned char* payload, size_t len) {
+    float fraction;
+    switch (type) {
+        case PROGRESS_FRAME_PROGRESS:
+            if (len >= 8) {
+                int32_t seconds;
+                memcpy(&fraction, payload, 4);
+                memcpy(&seconds, payload + 4, 4);
+                show_progress(p, fraction, seconds);
+            }
+            break;
+        case PROGRESS_FRAME_SET_PROGRESS:
+            if (len >= 4) {
+                memcpy(&fraction, payload, 4);
+                set_progress(p, fraction);
+            }
+            break;
+        case PROGRESS_FRAME_UI_PRINT:
+            print(p, (const char*) payload, strnlen((const char*) payload, len));
+            break;
+        case PROGRESS_FRAME_FIRMWARE: {
+            const unsigned char* nul = memchr(payload, '\0', len);
+            if (nul != NULL && nul > payload && nul + 1 < payload + len) {
+                char filename[PATH_MAX];
+                size_t flen = payload + len - (nul + 1);
+                if (flen >= sizeof(filename)) break;
+                memcpy(filename, nul + 1, flen);
+                filename[flen] = '\0';
+                firmware(p, (const char*) payload, filename);
+            }
+            break;
+        }
+        default:
+            // newer than this recovery
+            break;
+    }
+}
+
+// Runs every complete command in buf.  At the end of the stream a last
+// text command without a newline counts too.  Returns the bytes used.
+static size_t run_commands(Pending* p, unsigned char* buf, size_t len, bool eof) {
+    size_t pos = 0;
+    while (pos < len) {
+        if (buf[pos] == PROGRESS_FRAME_MARK) {
+            if (len - pos < PROGRESS_FRAME_HEADER) break;
+            size_t payload = buf[pos + 2] | (buf[pos + 3] << 8);
+            if (len - pos < PROGRESS_FRAME_HEADER + payload) break;
+            frame_command(p, buf[pos + 1], buf + pos + PROGRESS_FRAME_HEADER, payload);
+            pos += PROGRESS_FRAME_HEADER + payload;
+            continue;
+        }
+
+        size_t avail = len - pos;
+        if (avail > MAX_TEXT_COMMAND - 1) avail = MAX_TEXT_COMMAND - 1;
+        unsigned char* nl = memchr(buf + pos, '\n', avail);
+        size_t end;
+        if (nl != NULL) {
+            end = nl + 1 - buf;
+        } else if (avail == MAX_TEXT_COMMAND - 1 || eof) {
+            end = pos + avail;
+        } else {
+            break;
+        }
+        char line[MAX_TEXT_COMMAND];
+        memcpy(line, buf + pos, end - pos);
+        line[end - pos] = '\0';
+        text_command(p, line);
+        pos = end;
+    }
+    return pos;
+}
+
+void update_progress_read(int fd, int fps,
+                          char** firmware_type, char** firmware_filename) {
+    Pending p;
+    memset(&p, 0, sizeof(p));
+    p.firmware_type = firmware_type;
+    p.firmware_filename = firmware_filename;
+    *firmware_type = NULL;
+    *firmware_filename = NULL;
+
+    static unsigned char buf[READ_BUFFER_SIZE];
+    size_t have = 0;
+    long long interval = fps > 0 ? 1000 / fps : 50;
+    long long next_frame = 0;
+
+    for (;;) {
+        int timeout = -1;
+        if (dirty(&p)) {
+            long long wait = next_frame - now_ms();
+            timeout = wait > 0 ? wait : 0;
+        }
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) break;
+
+        if (ready > 0) {
+            ssize_t n = read(fd, buf + have, READ_BUFFER_SIZE - have);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            have += n;
+            size_t used = run_commands(&p, buf, have, false);
+            memmove(buf, buf + used, have - used);
+            have -= used;
+        }
+
+        long long now = now_ms();
+        if (dirty(&p) && now >= next_frame) {
+            flush(&p);
+            next_frame = now + interval;
+        }
+    }
+
+    run_commands(&p, buf, have, true);
+    flush(&p);
+    free(p.text);
+}
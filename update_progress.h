@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_UPDATE_PROGRESS_H
+#define _RECOVERY_UPDATE_PROGRESS_H
+
+// Reads the update binary's command pipe until the updater closes it.
+// Text commands and frames (see updater/progress.h) are both accepted.
+// ui_print output and set_progress updates are held back and applied at
+// most fps times a second, so an updater printing a line per file doesn't
+// redraw the screen for every one of them.
+//
+// A firmware command is returned through firmware_type and
+// firmware_filename (malloc()ed, NULL if there was none).
+void update_progress_read(int fd, int fps,
+                          char** firmware_type, char** firmware_filename);
+
+#endif
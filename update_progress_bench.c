@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how long recovery takes to get through an updater that prints
+// a line per file, the way package_extract_dir scripts with ui_print do.
+// A forked "updater" sends the given number of ui_print lines, each with
+// a set_progress, over a pipe; recovery's side reads it
+//
+//   - one command at a time, the way try_update_binary used to,
+//   - with update_progress_read(), from an updater talking text,
+//   - with update_progress_read(), from an updater sending frames.
+//
+// Screen updates are simulated by spinning for -redraw-us microseconds.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "update_progress.h"
+#include "updater/progress.h"
+#include "updater/updater.h"
+
+#define PROGRESS_BAR_WIDTH 480
+
+static long redraw_us = 100;
+static unsigned long redraws;
+static float progress, scope;
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void redraw() {
+    double until = now() + redraw_us / 1000000.0;
+    ++redraws;
+    while (now() < until);
+}
+
+void ui_print_str(const char *str) {
+    redraw();
+}
+
+void ui_print(const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+    ui_print_str(buf);
+}
+
+void ui_show_progress(float portion, int seconds) {
+    scope = portion;
+    progress = 0;
+    redraw();
+}
+
+// Like ui.c, skips updates that don't move the bar.
+void ui_set_progress(float fraction) {
+    float scale = PROGRESS_BAR_WIDTH * scope;
+    if (fraction > progress && (int) (progress * scale) != (int) (fraction * scale)) {
+        progress = fraction;
+        redraw();
+    }
+}
+
+static void updater(int fd, int protocol, int lines) {
+    UpdaterInfo ui;
+    ui.cmd_pipe = fdopen(fd, "wb");
+    setlinebuf(ui.cmd_pipe);
+    ui.package_zip = NULL;
+    ui.version = 3;
+    ui.progress_protocol = protocol;
+
+    updater_progress(&ui, 1.0, 0);
+    int i;
+    for (i = 0; i < lines; ++i) {
+        char line[64];
+        snprintf(line, sizeof(line), "extracting /system/app/file%06d.apk", i);
+        updater_ui_print(&ui, line);
+        updater_ui_print(&ui, NULL);
+        updater_set_progress(&ui, (float) (i + 1) / lines);
+    }
+    fclose(ui.cmd_pipe);
+}
+
+// try_update_binary's loop before update_progress_read().
+static void read_per_command(int fd) {
+    char buffer[1024];
+    FILE* from_child = fdopen(fd, "r");
+    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
+        char* command = strtok(buffer, " \n");
+        if (command == NULL) {
+            continue;
+        } else if (strcmp(command, "progress") == 0) {
+            char* fraction_s = strtok(NULL, " \n");
+            char* seconds_s = strtok(NULL, " \n");
+            ui_show_progress(strtof(fraction_s, NULL) * (1-VERIFICATION_PROGRESS_FRACTION),
+                             strtol(seconds_s, NULL, 10));
+        } else if (strcmp(command, "set_progress") == 0) {
+            ui_set_progress(strtof(strtok(NULL, " \n"), NULL));
+        } else if (strcmp(command, "ui_print") == 0) {
+            char* str = strtok(NULL, "\n");
+            if (str) {
+                ui_print("%s", str);
+            } else {
+                ui_print("\n");
+            }
+        }
+    }
+    fclose(from_child);
+}
+
+int main(int argc, char **argv) {
+    int lines = 100000;
+    int fps = 30;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-lines") == 0 && i + 1 < argc) {
+            lines = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-redraw-us") == 0 && i + 1 < argc) {
+            redraw_us = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-fps") == 0 && i + 1 < argc) {
+            fps = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [-lines <n>] [-redraw-us <us>] [-fps <n>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    static const struct {
+        const char* name;
+        int protocol;
+        int coalesce;
+    } modes[] = {
+        { "per command",    0, 0 },
+        { "batched, text",  0, 1 },
+        { "batched, frames", UPDATER_PROGRESS_PROTOCOL, 1 },
+    };
+
+    printf("%d lines, %ld us per screen update, %d fps\n", lines, redraw_us, fps);
+    size_t m;
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+        int pipefd[2];
+        if (pipe(pipefd) != 0) {
+            perror("pipe");
+            return 1;
+        }
+        redraws = 0;
+        progress = scope = 0;
+
+        double start = now();
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipefd[0]);
+            updater(pipefd[1], modes[m].protocol, lines);
+            _exit(0);
+        }
+        close(pipefd[1]);
+
+        if (modes[m].coalesce) {
+            char* firmware_type;
+            char* firmware_filename;
+            update_progress_read(pipefd[0], fps, &firmware_type, &firmware_filename);
+            close(pipefd[0]);
+        } else {
+            read_per_command(pipefd[0]);
+        }
+        waitpid(pid, NULL, 0);
+
+        printf("%-16s %8.1f ms, %lu screen updates\n", modes[m].name,
+               (now() - start) * 1000, redraws);
+    }
+    return 0;
+}
@@ -5,6 +5,8 @@ LOCAL_PATH := $(call my-dir)
 updater_src_files := \
 	../mounts.c \
 	install.c \
+	progress.c \
+	schedule.c \
 	updater.c
 
 #
@@ -31,6 +33,9 @@ endif
 LOCAL_STATIC_LIBRARIES += libflashutils libmtdutils libmmcutils libbmlutils
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
 LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libminzip libz
+ifeq ($(BOARD_MINZIP_INFLATE),libdeflate)
+LOCAL_STATIC_LIBRARIES += libdeflate
+endif
 LOCAL_STATIC_LIBRARIES += libmincrypt libbz
 LOCAL_STATIC_LIBRARIES += libminelf
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc
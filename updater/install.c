@@ -33,6 +33,7 @@
 #include <sys/xattr.h>
 #include <linux/xattr.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "cutils/misc.h"
 #include "cutils/properties.h"
@@ -371,7 +372,7 @@ Value* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     int sec = strtol(sec_str, NULL, 10);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    updater_progress(ui, frac, sec);
 
     free(sec_str);
     return StringValue(frac_str);
@@ -389,7 +390,7 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     double frac = strtod(frac_str, NULL);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    updater_set_progress(ui, frac);
 
     return StringValue(frac_str);
 }
@@ -856,8 +857,10 @@ static int ApplyParsedPerms(
 }
 
 // nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
+// global variables.  *sigh*  The lock keeps scheduled statements (see
+// schedule.h) from walking two trees at once.
 static struct perm_parsed_args recursive_parsed_args;
+static pthread_mutex_t recursive_parsed_args_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
         int fileflags, struct FTW *pfwt) {
@@ -889,9 +892,13 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
     struct perm_parsed_args parsed = ParsePermArgs(argc, args);
 
     if (recursive) {
+        // no FTW_CHDIR: the working directory is shared with scheduled
+        // statements, and the callback gets whole paths anyway
+        pthread_mutex_lock(&recursive_parsed_args_lock);
         recursive_parsed_args = parsed;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
+        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_DEPTH | FTW_PHYS);
         memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
+        pthread_mutex_unlock(&recursive_parsed_args_lock);
     } else {
         bad += ApplyParsedPerms(args[0], &sb, parsed);
     }
@@ -1116,12 +1123,14 @@ Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     /* Skip files listed in the backup table */
     for (i=0; i<totalbaks; i++) {
         if (!strncmp(source_filename, bakfiles[i],PATH_MAX)) {
-            fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print Skipping update of modified file %s\n", source_filename);
+            UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+            char skipping[PATH_MAX + 40];
+            snprintf(skipping, sizeof(skipping),
+                "Skipping update of modified file %s", source_filename);
+            updater_ui_print(ui, skipping);
             /* the command pipe tokenizes on \n, so issue an empty ui_print
                to do the real line break */
-            fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print\n");
+            updater_ui_print(ui, NULL);
             return StringValue(strdup("t"));
         }
     }
@@ -1248,11 +1257,10 @@ Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     char* line = strtok(buffer, "\n");
     while (line) {
-        fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print %s\n", line);
+        updater_ui_print((UpdaterInfo*)(state->cookie), line);
         line = strtok(NULL, "\n");
     }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "ui_print\n");
+    updater_ui_print((UpdaterInfo*)(state->cookie), NULL);
 
     return StringValue(buffer);
 }
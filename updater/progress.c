@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "progress.h"
+#include "updater.h"
+
+// Frames go out whole, so recovery never has to wait for the rest of one,
+// and in one piece when scheduled statements (see schedule.h) send at once.
+static void send_frame(UpdaterInfo* ui, int type, const void* payload, size_t length) {
+    unsigned char header[PROGRESS_FRAME_HEADER];
+    if (length > PROGRESS_FRAME_MAX_PAYLOAD) {
+        length = PROGRESS_FRAME_MAX_PAYLOAD;
+    }
+    header[0] = PROGRESS_FRAME_MARK;
+    header[1] = type;
+    header[2] = length & 0xff;
+    header[3] = length >> 8;
+    flockfile(ui->cmd_pipe);
+    fwrite(header, 1, sizeof(header), ui->cmd_pipe);
+    fwrite(payload, 1, length, ui->cmd_pipe);
+    fflush(ui->cmd_pipe);
+    funlockfile(ui->cmd_pipe);
+}
+
+void updater_progress(UpdaterInfo* ui, float fraction, int seconds) {
+    if (ui->progress_protocol == 0) {
+        fprintf(ui->cmd_pipe, "progress %f %d\n", fraction, seconds);
+        return;
+    }
+    unsigned char payload[8];
+    int32_t secs = seconds;
+    memcpy(payload, &fraction, 4);
+    memcpy(payload + 4, &secs, 4);
+    send_frame(ui, PROGRESS_FRAME_PROGRESS, payload, sizeof(payload));
+}
+
+void updater_set_progress(UpdaterInfo* ui, float fraction) {
+    if (ui->progress_protocol == 0) {
+        fprintf(ui->cmd_pipe, "set_progress %f\n", fraction);
+        return;
+    }
+    send_frame(ui, PROGRESS_FRAME_SET_PROGRESS, &fraction, sizeof(fraction));
+}
+
+// text is a single line; NULL (or "") just ends the line on screen.
+void updater_ui_print(UpdaterInfo* ui, const char* text) {
+    if (text == NULL) text = "";
+    if (ui->progress_protocol == 0) {
+        if (*text == '\0') {
+            fprintf(ui->cmd_pipe, "ui_print\n");
+        } else {
+            fprintf(ui->cmd_pipe, "ui_print %s\n", text);
+        }
+        return;
+    }
+    send_frame(ui, PROGRESS_FRAME_UI_PRINT, text, strlen(text));
+}
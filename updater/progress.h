@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PROGRESS_H_
+#define _UPDATER_PROGRESS_H_
+
+// Binary commands on the updater's command pipe.
+//
+// Text commands ("ui_print ...\n" etc.) never start with a NUL byte, so a
+// frame is marked by one and both can be mixed freely on the same pipe:
+//
+//   0x00  type  length (2 bytes, little endian)  payload (length bytes)
+//
+// Recovery announces that it understands frames by putting
+// UPDATER_PROGRESS_ENV=<protocol version> in the updater's environment.
+// The API version argument can't carry it: updaters reject anything
+// above the versions they know about.  Updaters that don't look at the
+// environment keep talking text, and recovery keeps accepting it.
+// Frame types recovery doesn't know are skipped.
+
+#define UPDATER_PROGRESS_ENV "UPDATER_PROGRESS_PROTOCOL"
+#define UPDATER_PROGRESS_PROTOCOL 1
+
+#define PROGRESS_FRAME_MARK 0x00
+#define PROGRESS_FRAME_HEADER 4
+#define PROGRESS_FRAME_MAX_PAYLOAD 65535
+
+enum {
+    // float fraction, int32 seconds, both native byte order:
+    // like "progress <frac> <secs>"
+    PROGRESS_FRAME_PROGRESS = 1,
+    // float fraction: like "set_progress <frac>"
+    PROGRESS_FRAME_SET_PROGRESS = 2,
+    // the text of one "ui_print <text>" command; empty for "ui_print"
+    PROGRESS_FRAME_UI_PRINT = 3,
+    // type, NUL, filename: like "firmware <type> <filename>"
+    PROGRESS_FRAME_FIRMWARE = 4,
+};
+
+#endif
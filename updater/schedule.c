@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "applypatch/applypatch.h"
+#include "edify/expr.h"
+#include "schedule.h"
+
+enum {
+    STMT_BARRIER,       // runs alone
+    STMT_PATHS,         // runs beside statements it shares no paths with
+    STMT_FOLLOWS,       // waits for everything before it
+};
+
+typedef struct {
+    const char* name;
+    int first_path;     // index of the first path argument
+    int last_path;      // and of the last one; -1 for the last argument
+    int min_argc;
+    int max_argc;       // -1 for no limit
+} PathFunction;
+
+static const PathFunction kPathFunctions[] = {
+    { "package_extract_dir",    1,  1, 2,  2 },
+    { "package_extract_file",   1,  1, 2,  2 },
+    { "set_metadata",           0,  0, 1, -1 },
+    { "set_metadata_recursive", 0,  0, 1, -1 },
+    { "set_perm",               3, -1, 4, -1 },
+    { "set_perm_recursive",     4, -1, 5, -1 },
+    { "delete",                 0, -1, 1, -1 },
+    { "delete_recursive",       0, -1, 1, -1 },
+    { "symlink",                1, -1, 2, -1 },
+    { "apply_patch",            0,  1, 4, -1 },
+    { NULL,                     0,  0, 0,  0 },
+};
+
+static const char* kFollowFunctions[] = {
+    "ui_print", "show_progress", "set_progress", NULL,
+};
+
+typedef struct {
+    Expr* expr;
+    int kind;
+    char** paths;
+    int path_count;
+
+    // while its segment runs
+    int waiting;            // statements before it still to finish
+    int* dependents;
+    int dependent_count;
+    int started;
+    Value* value;           // NULL if it failed
+    char* errmsg;
+} Statement;
+
+// A call to the registered function name (not a device override of it).
+static int is_call(Expr* expr, const char* name) {
+    return strcmp(expr->name, name) == 0 && expr->fn == FindFunction(name);
+}
+
+// Arguments that can be evaluated on any thread, at any time: nothing but
+// strings and what's in the package.
+static int is_pure(Expr* expr) {
+    int i;
+    if (expr->fn == Literal) {
+        return 1;
+    }
+    if (expr->fn == ConcatFn ||
+            (is_call(expr, "package_extract_file") && expr->argc == 1)) {
+        for (i = 0; i < expr->argc; ++i) {
+            if (!is_pure(expr->argv[i])) return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Absolute path without "//", "." or ".." and trailing '/', or NULL.
+static char* normalize_path(const char* path) {
+    if (path[0] != '/') return NULL;
+
+    char* result = malloc(strlen(path) + 2);
+    char* out = result;
+    const char* p = path;
+    while (*p != '\0') {
+        while (*p == '/') p++;
+        if (*p == '\0') break;
+        const char* end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if ((len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+            free(result);
+            return NULL;
+        }
+        *out++ = '/';
+        memcpy(out, p, len);
+        out += len;
+        p += len;
+    }
+    if (out == result) *out++ = '/';
+    *out = '\0';
+    return result;
+}
+
+static void add_path(Statement* st, char* path) {
+    st->paths = realloc(st->paths, (st->path_count + 1) * sizeof(char*));
+    st->paths[st->path_count++] = path;
+}
+
+static void classify(Statement* st) {
+    Expr* expr = st->expr;
+    int i;
+
+    st->kind = STMT_BARRIER;
+    if (expr->fn == Literal) {
+        st->kind = STMT_PATHS;
+        return;
+    }
+    for (i = 0; i < expr->argc; ++i) {
+        if (!is_pure(expr->argv[i])) return;
+    }
+
+    for (i = 0; kFollowFunctions[i] != NULL; ++i) {
+        if (is_call(expr, kFollowFunctions[i])) {
+            st->kind = STMT_FOLLOWS;
+            return;
+        }
+    }
+
+    const PathFunction* fn;
+    for (fn = kPathFunctions; fn->name != NULL; ++fn) {
+        if (is_call(expr, fn->name)) break;
+    }
+    if (fn->name == NULL || expr->argc < fn->min_argc ||
+            (fn->max_argc >= 0 && expr->argc > fn->max_argc)) {
+        return;
+    }
+
+    int last = fn->last_path >= 0 ? fn->last_path : expr->argc - 1;
+    for (i = fn->first_path; i <= last; ++i) {
+        Expr* arg = expr->argv[i];
+        if (arg->fn != Literal) break;
+        // apply_patch's target "-" is the source
+        if (i == 1 && strcmp(arg->name, "-") == 0 && is_call(expr, "apply_patch")) continue;
+        // normalize_path() also turns away MTD:/EMMC: partitions
+        char* path = normalize_path(arg->name);
+        if (path == NULL) break;
+        add_path(st, path);
+    }
+    if (i <= last) {
+        for (i = 0; i < st->path_count; ++i) free(st->paths[i]);
+        free(st->paths);
+        st->paths = NULL;
+        st->path_count = 0;
+        return;
+    }
+    if (is_call(expr, "apply_patch")) {
+        add_path(st, strdup(CACHE_TEMP_SOURCE));
+    }
+    st->kind = STMT_PATHS;
+}
+
+// path (normalized) with the symlinks in the part of its parent that
+// exists resolved.  The last component is left alone: the statement
+// replaces or deletes that entry, it doesn't write through it.
+static char* resolve_parent(const char* path) {
+    char resolved[PATH_MAX];
+    size_t len = strrchr(path, '/') - path;
+
+    while (len > 0) {
+        char* prefix = strndup(path, len);
+        char* ok = realpath(prefix, resolved);
+        free(prefix);
+        if (ok != NULL) break;
+        // try again without the last component
+        do {
+            len--;
+        } while (len > 0 && path[len] != '/');
+    }
+    if (len == 0 || strcmp(resolved, "/") == 0) resolved[0] = '\0';
+
+    const char* rest = path + len;
+    if (resolved[0] == '\0' && strcmp(rest, "/") == 0) return strdup("/");
+    char* result = malloc(strlen(resolved) + strlen(rest) + 1);
+    strcpy(result, resolved);
+    strcat(result, rest);
+    return result;
+}
+
+// Whether a and b are the same place, or one is inside the other.
+static int paths_overlap(const char* a, const char* b) {
+    size_t la = strlen(a), lb = strlen(b);
+    if (la > lb) {
+        const char* t = a; a = b; b = t;
+        size_t tl = la; la = lb; lb = tl;
+    }
+    if (strcmp(a, "/") == 0) return 1;
+    return strncmp(a, b, la) == 0 && (b[la] == '\0' || b[la] == '/');
+}
+
+static int statements_overlap(const Statement* a, const Statement* b) {
+    int i, j;
+    for (i = 0; i < a->path_count; ++i) {
+        for (j = 0; j < b->path_count; ++j) {
+            if (paths_overlap(a->paths[i], b->paths[j])) return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    State* state;
+    Statement* sts;
+    int count;
+    int next;               // no statement before it is left to start
+    int first_failure;      // count if none
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Segment;
+
+static void* segment_thread(void* cookie) {
+    Segment* seg = cookie;
+
+    pthread_mutex_lock(&seg->lock);
+    for (;;) {
+        while (seg->next < seg->count && seg->sts[seg->next].started) seg->next++;
+        int end = seg->first_failure;
+        if (seg->next >= end) break;
+
+        // the first statement that is ready, to stay close to script order
+        int i;
+        for (i = seg->next; i < end; ++i) {
+            if (!seg->sts[i].started && seg->sts[i].waiting == 0) break;
+        }
+        if (i == end) {
+            pthread_cond_wait(&seg->cond, &seg->lock);
+            continue;
+        }
+
+        Statement* st = &seg->sts[i];
+        st->started = 1;
+        pthread_mutex_unlock(&seg->lock);
+
+        State state = *seg->state;
+        state.errmsg = NULL;
+        st->value = EvaluateValue(&state, st->expr);
+        st->errmsg = state.errmsg;
+
+        pthread_mutex_lock(&seg->lock);
+        if (st->value == NULL && i < seg->first_failure) {
+            seg->first_failure = i;
+        }
+        int d;
+        for (d = 0; d < st->dependent_count; ++d) {
+            seg->sts[st->dependents[d]].waiting--;
+        }
+        pthread_cond_broadcast(&seg->cond);
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return NULL;
+}
+
+static void add_dependent(Statement* st, int dependent) {
+    st->dependents = realloc(st->dependents, (st->dependent_count + 1) * sizeof(int));
+    st->dependents[st->dependent_count++] = dependent;
+}
+
+// Runs count statements that are not barriers.  Returns 0 if all of them
+// succeeded; otherwise state->errmsg is that of the first one that failed.
+static int run_segment(State* state, Statement* sts, int count, int jobs) {
+    int i, j;
+
+    // paths are only resolved now, after the barrier before the segment
+    // has mounted whatever it mounts.  A path that is a symlink to a
+    // directory is written through by package_extract_dir and the like,
+    // so where it leads counts too.
+    for (i = 0; i < count; ++i) {
+        int literal_paths = sts[i].path_count;
+        for (j = 0; j < literal_paths; ++j) {
+            char target[PATH_MAX];
+            char* resolved = resolve_parent(sts[i].paths[j]);
+            if (realpath(sts[i].paths[j], target) != NULL && strcmp(target, resolved) != 0) {
+                add_path(&sts[i], strdup(target));
+            }
+            free(sts[i].paths[j]);
+            sts[i].paths[j] = resolved;
+        }
+    }
+    for (j = 0; j < count; ++j) {
+        for (i = 0; i < j; ++i) {
+            if (sts[j].kind == STMT_FOLLOWS ||
+                    (sts[i].kind == STMT_PATHS && statements_overlap(&sts[i], &sts[j]))) {
+                add_dependent(&sts[i], j);
+                sts[j].waiting++;
+            }
+        }
+    }
+
+    Segment seg;
+    seg.state = state;
+    seg.sts = sts;
+    seg.count = count;
+    seg.next = 0;
+    seg.first_failure = count;
+    pthread_mutex_init(&seg.lock, NULL);
+    pthread_cond_init(&seg.cond, NULL);
+
+    pthread_t threads[UPDATER_MAX_JOBS];
+    int started = 0;
+    if (jobs > count) jobs = count;
+    while (started < jobs - 1 &&
+           pthread_create(&threads[started], NULL, segment_thread, &seg) == 0) {
+        started++;
+    }
+    segment_thread(&seg);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&seg.lock);
+    pthread_cond_destroy(&seg.cond);
+
+    for (i = 0; i < count; ++i) {
+        if (i == seg.first_failure) {
+            free(state->errmsg);
+            state->errmsg = sts[i].errmsg;
+        } else {
+            if (sts[i].started && sts[i].value == NULL) {
+                fprintf(stderr, "statement %d also failed: %s\n", i,
+                        sts[i].errmsg ? sts[i].errmsg : "(no error message)");
+            }
+            free(sts[i].errmsg);
+        }
+        sts[i].errmsg = NULL;
+    }
+    return seg.first_failure < count ? -1 : 0;
+}
+
+static void flatten(Expr* expr, Statement** sts, int* count, int* capacity) {
+    if (expr->fn == SequenceFn && expr->argc == 2) {
+        flatten(expr->argv[0], sts, count, capacity);
+        flatten(expr->argv[1], sts, count, capacity);
+        return;
+    }
+    if (*count == *capacity) {
+        *capacity = *capacity * 2 + 64;
+        *sts = realloc(*sts, *capacity * sizeof(Statement));
+    }
+    memset(&(*sts)[*count], 0, sizeof(Statement));
+    (*sts)[*count].expr = expr;
+    (*count)++;
+}
+
+char* ScheduleEvaluate(State* state, Expr* expr, int jobs) {
+    Statement* sts = NULL;
+    int count = 0, capacity = 0;
+    int i, barriers = 0;
+
+    if (jobs > UPDATER_MAX_JOBS) jobs = UPDATER_MAX_JOBS;
+    if (jobs <= 1) return Evaluate(state, expr);
+
+    flatten(expr, &sts, &count, &capacity);
+    for (i = 0; i < count; ++i) {
+        classify(&sts[i]);
+        if (sts[i].kind == STMT_BARRIER) barriers++;
+    }
+    fprintf(stderr, "running %d statements on up to %d threads, %d of them alone\n",
+            count, jobs, barriers);
+
+    Value* last = NULL;
+    int failed = 0;
+    for (i = 0; i < count && !failed; ) {
+        int end = i + 1;
+        if (sts[i].kind != STMT_BARRIER) {
+            while (end < count && sts[end].kind != STMT_BARRIER) end++;
+        }
+
+        FreeValue(last);
+        last = NULL;
+        if (end - i == 1) {
+            last = EvaluateValue(state, sts[i].expr);
+            failed = last == NULL;
+        } else {
+            failed = run_segment(state, sts + i, end - i, jobs) != 0;
+            last = sts[end - 1].value;
+            sts[end - 1].value = NULL;
+            int j;
+            for (j = i; j < end - 1; ++j) {
+                FreeValue(sts[j].value);
+            }
+        }
+        i = end;
+    }
+
+    for (i = 0; i < count; ++i) {
+        int j;
+        for (j = 0; j < sts[i].path_count; ++j) free(sts[i].paths[j]);
+        free(sts[i].paths);
+        free(sts[i].dependents);
+    }
+    free(sts);
+
+    if (failed) {
+        FreeValue(last);
+        return NULL;
+    }
+    if (last->type != VAL_STRING) {
+        ErrorAbort(state, "expecting string, got value type %d", last->type);
+        FreeValue(last);
+        return NULL;
+    }
+    char* result = last->data;
+    free(last);
+    return result;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_SCHEDULE_H_
+#define _UPDATER_SCHEDULE_H_
+
+#include "edify/expr.h"
+
+// Running the statements of the script's top-level ';' sequence side by
+// side.  Opt in by putting UPDATER_JOBS=<threads> (0 for one per CPU) in
+// the updater's environment; an "export" in recovery's init.rc will do.
+// Without it the script is evaluated one statement after the other, as
+// always.
+//
+// Only calls to a few install functions with literal, absolute paths run
+// concurrently: package_extract_dir, package_extract_file (to a file),
+// set_metadata[_recursive], set_perm[_recursive], delete[_recursive],
+// symlink and apply_patch on files.  Two of them are kept in script order
+// when one's paths are inside the other's (or the same); apply_patch
+// calls stay in order among themselves, as they share the /cache copy of
+// the source.  ui_print, show_progress and set_progress wait for
+// everything before them, so nothing is reported early.  Any other
+// statement -- mount, format, run_program, ifelse, assert, abort, device
+// functions... -- is a barrier: it runs alone, once everything before it
+// is done.
+//
+// Paths are compared after resolving symlinks in the part that exists
+// when the statements between two barriers are started; a script that
+// reaches one place under two names it creates itself must not opt in.
+//
+// Statements before the first one that fails all run, as they would in
+// order; statements after it may already have run if they didn't depend
+// on it.
+
+#define UPDATER_JOBS_ENV "UPDATER_JOBS"
+#define UPDATER_MAX_JOBS 16
+
+// Like Evaluate(), with up to jobs statements of expr's top-level
+// sequence running at once.
+char* ScheduleEvaluate(State* state, Expr* expr, int jobs);
+
+#endif
@@ -20,7 +20,9 @@
 
 #include "edify/expr.h"
 #include "updater.h"
+#include "progress.h"
 #include "install.h"
+#include "schedule.h"
 #include "minzip/Zip.h"
 
 // Generated by the makefile, this function defines the
@@ -122,25 +124,39 @@ int main(int argc, char** argv) {
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
     updater_info.version = atoi(version);
+    const char* protocol = getenv(UPDATER_PROGRESS_ENV);
+    updater_info.progress_protocol = protocol != NULL ? atoi(protocol) : 0;
+    if (updater_info.progress_protocol > UPDATER_PROGRESS_PROTOCOL) {
+        updater_info.progress_protocol = UPDATER_PROGRESS_PROTOCOL;
+    }
 
     State state;
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
 
-    char* result = Evaluate(&state, root);
+    // Independent statements run side by side only if asked for.
+    char* result;
+    const char* jobs = getenv(UPDATER_JOBS_ENV);
+    if (jobs != NULL) {
+        int n = atoi(jobs);
+        if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+        result = ScheduleEvaluate(&state, root, n);
+    } else {
+        result = Evaluate(&state, root);
+    }
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
-            fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
+            updater_ui_print(&updater_info, "script aborted (no error message)");
         } else {
             fprintf(stderr, "script aborted: %s\n", state.errmsg);
             char* line = strtok(state.errmsg, "\n");
             while (line) {
-                fprintf(cmd_pipe, "ui_print %s\n", line);
+                updater_ui_print(&updater_info, line);
                 line = strtok(NULL, "\n");
             }
-            fprintf(cmd_pipe, "ui_print\n");
+            updater_ui_print(&updater_info, NULL);
         }
         free(state.errmsg);
         return 7;
@@ -27,8 +27,15 @@ typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
     int version;
+    int progress_protocol;  // 0 if recovery only takes text commands
 } UpdaterInfo;
 
+// Commands to recovery, sent as frames (see progress.h) when it
+// understands them and as text otherwise.
+void updater_progress(UpdaterInfo* ui, float fraction, int seconds);
+void updater_set_progress(UpdaterInfo* ui, float fraction);
+void updater_ui_print(UpdaterInfo* ui, const char* text);
+
 extern struct selabel_handle *sehandle;
 
 #endif
@@ -24,7 +24,13 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Look for an RSA signature embedded in the .ZIP file comment given
 // the path to the zip.  Verify it matches one of the given public
@@ -34,13 +40,185 @@
 // or no key matches the signature).
 
 int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
-
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
         LOGE("failed to open %s (%s)\n", path, strerror(errno));
         return VERIFY_FAILURE;
     }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOGE("failed to stat %s (%s)\n", path, strerror(errno));
+        close(fd);
+        return VERIFY_FAILURE;
+    }
+    if (st.st_size == 0) {
+        LOGE("%s is empty\n", path);
+        close(fd);
+        return VERIFY_FAILURE;
+    }
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOGE("failed to map %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+    int result = verify_mapped(addr, st.st_size, pKeys, numKeys);
+    munmap(addr, st.st_size);
+    return result;
+}
+
+// The signed data is hashed straight out of the mapping.  The calling
+// thread acts as the reader: it faults the file in a block at a time, at
+// most VERIFY_READ_AHEAD blocks ahead of the slowest hash, while every
+// hash the keys need runs on its own thread behind it.  SHA-1 and SHA-256
+// of the same package therefore cost about as much as the slower of the
+// two instead of their sum.
+#define VERIFY_BLOCK_SIZE (1024 * 1024)
+#define VERIFY_READ_AHEAD 8
+#define VERIFY_PAGE_SIZE 4096
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const unsigned char* addr;
+    size_t length;
+    size_t ready;       // bytes the reader has faulted in
+} HashPipeline;
+
+typedef struct {
+    HashPipeline* pipeline;
+    int hash_len;       // SHA_DIGEST_SIZE or SHA256_DIGEST_SIZE
+    SHA_CTX sha1_ctx;
+    SHA256_CTX sha256_ctx;
+    size_t done;        // bytes hashed so far
+    pthread_t thread;
+    bool threaded;
+} HashWorker;
+
+static void hash_block(HashWorker* w, const unsigned char* data, size_t size) {
+    if (w->hash_len == SHA_DIGEST_SIZE) {
+        SHA_update(&w->sha1_ctx, data, size);
+    } else {
+        SHA256_update(&w->sha256_ctx, data, size);
+    }
+}
+
+static void* hash_thread(void* cookie) {
+    HashWorker* w = (HashWorker*)cookie;
+    HashPipeline* p = w->pipeline;
+
+    pthread_mutex_lock(&p->lock);
+    while (w->done < p->length) {
+        while (p->ready <= w->done) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        size_t end = p->ready;
+        pthread_mutex_unlock(&p->lock);
+
+        while (w->done < end) {
+            size_t size = end - w->done;
+            if (size > VERIFY_BLOCK_SIZE) size = VERIFY_BLOCK_SIZE;
+            hash_block(w, p->addr + w->done, size);
+
+            pthread_mutex_lock(&p->lock);
+            w->done += size;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->lock);
+        }
+
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// Touch one byte per page so the block is read in by this thread rather
+// than by whichever hash gets to it first.
+static void read_block(const unsigned char* data, size_t size) {
+    volatile unsigned char sink = 0;
+    size_t i;
+    for (i = 0; i < size; i += VERIFY_PAGE_SIZE) {
+        sink ^= data[i];
+    }
+    if (size > 0) sink ^= data[size - 1];
+}
+
+// Hash the first 'length' bytes at 'addr' with every worker, reporting
+// progress as the slowest of them advances.
+static void hash_mapped(const unsigned char* addr, size_t length,
+                        HashWorker* workers, int count) {
+    HashPipeline p;
+    int i;
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    p.addr = addr;
+    p.length = length;
+    p.ready = 0;
+
+    for (i = 0; i < count; ++i) {
+        workers[i].pipeline = &p;
+        workers[i].done = 0;
+        workers[i].threaded =
+            pthread_create(&workers[i].thread, NULL, hash_thread, &workers[i]) == 0;
+    }
+
+    double frac = -1.0;
+    for (;;) {
+        pthread_mutex_lock(&p.lock);
+        size_t slowest = length;
+        for (i = 0; i < count; ++i) {
+            if (workers[i].threaded && workers[i].done < slowest) {
+                slowest = workers[i].done;
+            }
+        }
+        if (p.ready >= length ||
+            p.ready >= slowest + VERIFY_READ_AHEAD * VERIFY_BLOCK_SIZE) {
+            if (slowest >= length) {
+                pthread_mutex_unlock(&p.lock);
+                break;
+            }
+            pthread_cond_wait(&p.cond, &p.lock);
+            pthread_mutex_unlock(&p.lock);
+        } else {
+            size_t start = p.ready;
+            pthread_mutex_unlock(&p.lock);
+
+            size_t size = length - start;
+            if (size > VERIFY_BLOCK_SIZE) size = VERIFY_BLOCK_SIZE;
+            read_block(addr + start, size);
+
+            pthread_mutex_lock(&p.lock);
+            p.ready = start + size;
+            pthread_cond_broadcast(&p.cond);
+            pthread_mutex_unlock(&p.lock);
+        }
+
+        double f = slowest / (double)length;
+        if (f > frac + 0.02) {
+            ui_set_progress(f);
+            frac = f;
+        }
+    }
+
+    // Workers that couldn't get a thread hash the (now read) data here.
+    for (i = 0; i < count; ++i) {
+        if (workers[i].threaded) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            hash_block(&workers[i], addr, length);
+            workers[i].done = length;
+        }
+    }
+    ui_set_progress(1.0);
+
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+}
+
+int verify_mapped(const unsigned char* addr, size_t length,
+                  const Certificate* pKeys, unsigned int numKeys) {
+    ui_set_progress(0.0);
 
     // An archive with a whole-file signature will end in six bytes:
     //
@@ -53,22 +231,15 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
 
 #define FOOTER_SIZE 6
 
-    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (length < FOOTER_SIZE) {
+        LOGE("package is too short for a footer\n");
         return VERIFY_FAILURE;
     }
 
-    unsigned char footer[FOOTER_SIZE];
-    if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
-        LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* footer = addr + length - FOOTER_SIZE;
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
         LOGE("footer is wrong\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -80,7 +251,6 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -90,9 +260,8 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
-    if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (length < eocd_size) {
+        LOGE("package is too short for its comment\n");
         return VERIFY_FAILURE;
     }
 
@@ -100,26 +269,15 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = ftell(f) + EOCD_HEADER_SIZE - 2;
+    size_t signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
 
-    unsigned char* eocd = malloc(eocd_size);
-    if (eocd == NULL) {
-        LOGE("malloc for EOCD record failed\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-    if (fread(eocd, 1, eocd_size, f) != eocd_size) {
-        LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* eocd = addr + length - eocd_size;
 
     // If this is really is the EOCD record, it will begin with the
     // magic number $50 $4b $05 $06.
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -132,13 +290,12 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
-
+    HashWorker workers[2];
+    int count = 0;
     bool need_sha1 = false;
     bool need_sha256 = false;
     for (i = 0; i < numKeys; ++i) {
@@ -147,43 +304,33 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
             case SHA256_DIGEST_SIZE: need_sha256 = true; break;
         }
     }
-
-    SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
-    SHA_init(&sha1_ctx);
-    SHA256_init(&sha256_ctx);
-    unsigned char* buffer = (unsigned char*)malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
-        return VERIFY_FAILURE;
+    if (need_sha1) {
+        workers[count].hash_len = SHA_DIGEST_SIZE;
+        SHA_init(&workers[count].sha1_ctx);
+        ++count;
+    }
+    if (need_sha256) {
+        workers[count].hash_len = SHA256_DIGEST_SIZE;
+        SHA256_init(&workers[count].sha256_ctx);
+        ++count;
     }
 
-    double frac = -1.0;
-    size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
-    while (so_far < signed_len) {
-        unsigned int size = BUFFER_SIZE;
-        if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
-        }
-        if (need_sha1) SHA_update(&sha1_ctx, buffer, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, buffer, size);
-        so_far += size;
-        double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
-            ui_set_progress(f);
-            frac = f;
+    // The mapping is usually the one the zip is later opened from, so
+    // the hint is dropped again once the whole file has been read.
+    madvise((void*)addr, length, MADV_SEQUENTIAL);
+    hash_mapped(addr, signed_len, workers, count);
+    madvise((void*)addr, length, MADV_NORMAL);
+
+    const uint8_t* sha1 = NULL;
+    const uint8_t* sha256 = NULL;
+    int w;
+    for (w = 0; w < count; ++w) {
+        if (workers[w].hash_len == SHA_DIGEST_SIZE) {
+            sha1 = SHA_final(&workers[w].sha1_ctx);
+        } else {
+            sha256 = SHA256_final(&workers[w].sha256_ctx);
         }
     }
-    fclose(f);
-    free(buffer);
-
-    const uint8_t* sha1 = SHA_final(&sha1_ctx);
-    const uint8_t* sha256 = SHA256_final(&sha256_ctx);
 
     for (i = 0; i < numKeys; ++i) {
         const uint8_t* hash;
@@ -198,13 +345,11 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         if (RSA_verify(pKeys[i].public_key, eocd + eocd_size - 6 - RSANUMBYTES,
                        RSANUMBYTES, hash, pKeys[i].hash_len)) {
             LOGI("whole-file signature verified against key %d\n", i);
-            free(eocd);
             return VERIFY_SUCCESS;
         } else {
             LOGI("failed to verify against key %d\n", i);
         }
     }
-    free(eocd);
     LOGE("failed to verify whole-file signature\n");
     return VERIFY_FAILURE;
 }
@@ -17,6 +17,8 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stddef.h>
+
 #include "mincrypt/rsa.h"
 
 typedef struct Certificate {
@@ -29,6 +31,11 @@ typedef struct Certificate {
  */
 int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys);
 
+/* Same as verify_file, for a package that is already mapped in memory.
+ */
+int verify_mapped(const unsigned char* addr, size_t length,
+                  const Certificate *pKeys, unsigned int numKeys);
+
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how fast verify_mapped() hashes a package for each mix of key
+// types found in /res/keys.  The package is either a file given on the
+// command line or a synthetic one of the given size; its signature is
+// never valid, so every run hashes the whole signed range and fails at
+// the RSA step, which costs next to nothing.  Results go to stderr, the
+// verifier's own logging to stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "verifier.h"
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+
+void ui_print(const char* fmt, ...) {
+}
+
+void ui_set_progress(float fraction) {
+}
+
+// A zip with nothing but an end of central directory record whose
+// comment holds a (bogus) whole-file signature footer, behind 'size'
+// bytes of filler.
+static unsigned char* make_package(size_t size, size_t* length) {
+    const int comment_size = RSANUMBYTES + 6;
+    *length = size + 22 + comment_size;
+    unsigned char* data = malloc(*length);
+    if (data == NULL) return NULL;
+
+    size_t i;
+    unsigned int x = 12345;
+    for (i = 0; i < size; ++i) {
+        x = x * 1103515245 + 12345;
+        data[i] = x >> 16;
+    }
+
+    unsigned char* eocd = data + size;
+    memset(eocd, 0, 22 + comment_size);
+    eocd[0] = 0x50; eocd[1] = 0x4b; eocd[2] = 0x05; eocd[3] = 0x06;
+    eocd[20] = comment_size & 0xff;
+    eocd[21] = comment_size >> 8;
+
+    unsigned char* footer = data + *length - 6;
+    footer[0] = comment_size & 0xff;
+    footer[1] = comment_size >> 8;
+    footer[2] = 0xff;
+    footer[3] = 0xff;
+    footer[4] = comment_size & 0xff;
+    footer[5] = comment_size >> 8;
+    return data;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = 256;
+    int rounds = 3;
+    const char* path = NULL;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-size") == 0 && i + 1 < argc) {
+            megabytes = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [-size <MB>] [-rounds <n>] [package]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    unsigned char* data;
+    size_t length;
+    if (path != NULL) {
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "can't open %s\n", path);
+            return 1;
+        }
+        length = st.st_size;
+        data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "can't map %s\n", path);
+            return 1;
+        }
+    } else {
+        data = make_package(megabytes << 20, &length);
+        if (data == NULL) {
+            fprintf(stderr, "can't allocate %zu MB\n", megabytes);
+            return 1;
+        }
+    }
+
+    RSAPublicKey key;
+    memset(&key, 0, sizeof(key));
+    key.len = RSANUMWORDS;
+    key.exponent = 3;
+
+    static const struct {
+        const char* name;
+        int hash_len[2];
+        int count;
+    } mixes[] = {
+        { "sha1",        { SHA_DIGEST_SIZE }, 1 },
+        { "sha256",      { SHA256_DIGEST_SIZE }, 1 },
+        { "sha1+sha256", { SHA_DIGEST_SIZE, SHA256_DIGEST_SIZE }, 2 },
+    };
+
+    fprintf(stderr, "%zu bytes, %d rounds\n", length, rounds);
+    size_t m;
+    for (m = 0; m < sizeof(mixes) / sizeof(mixes[0]); ++m) {
+        Certificate certs[2];
+        int k;
+        for (k = 0; k < mixes[m].count; ++k) {
+            certs[k].hash_len = mixes[m].hash_len[k];
+            certs[k].public_key = &key;
+        }
+
+        double best = 0;
+        int r;
+        for (r = 0; r < rounds; ++r) {
+            double start = now();
+            verify_mapped(data, length, certs, mixes[m].count);
+            double elapsed = now() - start;
+            if (r == 0 || elapsed < best) best = elapsed;
+        }
+        fprintf(stderr, "%-12s %8.1f MB/s\n", mixes[m].name, length / best / (1 << 20));
+    }
+    return 0;
+}